@@ -0,0 +1,277 @@
+#include "docker.h"
+
+extern struct uwsgi_server uwsgi;
+extern struct uwsgi_docker udocker;
+
+/*
+
+	Docker API requests run on a per-process libcurl multi handle: requests are queued with docker_request()
+	(each one with its timeout and a callback receiving the status and the parsed json response),
+	and docker_requests_run() drives all of them concurrently until none is pending.
+	Callbacks can queue more requests (but must not call docker_json()).
+
+	docker_json() is a single request run to completion, for the steps depending on the previous ones.
+
+	The multi handle keeps the connections to the daemon (HTTP keep-alive) across requests.
+	Handles inherited via fork() are never reused (the connections would be shared with the parent).
+
+*/
+
+struct docker_request {
+	CURL *curl;
+	char *url;
+	char *body;
+	struct uwsgi_buffer *ub;
+	docker_request_cb cb;
+	void *data;
+};
+
+// hack for adding support for unix sockets to libcurl
+static curl_socket_t docker_unix_socket(void *foobar, curlsocktype cs_type, struct curl_sockaddr *c_addr) {
+	struct sockaddr_un* un_addr = (struct sockaddr_un*)&c_addr->addr;
+	c_addr->family = AF_UNIX;
+	c_addr->addrlen = sizeof(struct sockaddr_un);
+
+	memset(un_addr, 0, c_addr->addrlen);
+	un_addr->sun_family = AF_UNIX;
+	strncpy(un_addr->sun_path, udocker.socket, sizeof(un_addr->sun_path));
+	c_addr->protocol = 0;
+	// libcurl calls us only when it cannot reuse a cached connection
+	udocker.connections++;
+	return socket(c_addr->family, c_addr->socktype, c_addr->protocol);
+}
+
+// store a libcurl response in a uwsgi_buffer
+static size_t docker_response(void *ptr, size_t size, size_t nmemb, void *data) {
+	struct uwsgi_buffer *ub = (struct uwsgi_buffer *) data;
+	if (uwsgi_buffer_append(ub, ptr, size*nmemb)) return -1;
+	return size*nmemb;
+}
+
+// get the libcurl multi handle of the current process
+static CURLM *docker_multi() {
+	if (udocker.multi && udocker.curl_pid == getpid()) {
+		return udocker.multi;
+	}
+	// do not cleanup the inherited handle, it would close the parent connections
+	udocker.multi = curl_multi_init();
+	if (!udocker.multi) return NULL;
+	udocker.curl_pid = getpid();
+	udocker.headers = curl_slist_append(NULL, "Content-Type: application/json");
+	udocker.requests = 0;
+	udocker.connections = 0;
+	udocker.pending = 0;
+	return udocker.multi;
+}
+
+// log connection reuse counters (reuse = requests not requiring a new connection)
+void docker_curl_stats() {
+	if (!udocker.requests) return;
+	uint64_t reused = udocker.requests > udocker.connections ? udocker.requests - udocker.connections : 0;
+	uwsgi_log("[docker] api requests: %llu connections: %llu reused: %llu (hit rate %llu%%)\n",
+		(unsigned long long) udocker.requests, (unsigned long long) udocker.connections,
+		(unsigned long long) reused, (unsigned long long) ((reused * 100) / udocker.requests));
+}
+
+// queue a request (timeout in seconds), the callback is called by docker_requests_run().
+// Returns -1 if the request cannot be queued (the callback is not called)
+int docker_request(char *method, char *url, json_t *json, int timeout, docker_request_cb cb, void *data) {
+	CURLM *multi = docker_multi();
+	if (!multi) return -1;
+	CURL *curl = curl_easy_init();
+	if (!curl) return -1;
+	struct docker_request *dr = uwsgi_calloc(sizeof(struct docker_request));
+	dr->curl = curl;
+	dr->cb = cb;
+	dr->data = data;
+	dr->ub = uwsgi_buffer_new(uwsgi.page_size);
+	dr->url = uwsgi_concat3("http://127.0.0.1", udocker.api_prefix, url);
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, dr);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long) timeout);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long) (timeout < uwsgi.socket_timeout ? timeout : uwsgi.socket_timeout));
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, udocker.headers);
+	curl_easy_setopt(curl, CURLOPT_URL, dr->url);
+	curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method);
+	if (json) {
+		dr->body = json_dumps(json, 0);
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, dr->body);
+	}
+	if (udocker.no_keepalive) {
+		curl_easy_setopt(curl, CURLOPT_FORBID_REUSE, 1L);
+	}
+	curl_easy_setopt(curl, CURLOPT_OPENSOCKETFUNCTION, docker_unix_socket);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, docker_response);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, dr->ub);
+	if (curl_multi_add_handle(multi, curl) != CURLM_OK) {
+		uwsgi_log("[docker] unable to queue request %s\n", dr->url);
+		curl_easy_cleanup(curl);
+		uwsgi_buffer_destroy(dr->ub);
+		if (dr->body) free(dr->body);
+		free(dr->url);
+		free(dr);
+		return -1;
+	}
+	udocker.pending++;
+	return 0;
+}
+
+static void docker_request_done(struct docker_request *dr, CURLcode res) {
+	long http_status = 0;
+	json_t *response = NULL;
+	udocker.requests++;
+	udocker.pending--;
+	if (res != CURLE_OK) {
+		uwsgi_log("[docker] error sending request %s: %s\n", dr->url, curl_easy_strerror(res));
+	}
+	else {
+		curl_easy_getinfo(dr->curl, CURLINFO_RESPONSE_CODE, &http_status);
+		if (udocker.debug) {
+			uwsgi_log("[docker-debug] HTTP request to %s -> %d\n%.*s\n", dr->url, (int) http_status, (int) dr->ub->pos, dr->ub->buf);
+		}
+		json_error_t error;
+		response = json_loadb(dr->ub->buf, dr->ub->pos, 0, &error);
+	}
+	curl_easy_cleanup(dr->curl);
+	uwsgi_buffer_destroy(dr->ub);
+	if (dr->body) free(dr->body);
+	free(dr->url);
+	docker_request_cb cb = dr->cb;
+	void *data = dr->data;
+	free(dr);
+	// the callback could queue new requests
+	if (cb) cb(data, http_status, response);
+	if (response) json_decref(response);
+}
+
+// run the queued requests until all of them are completed
+void docker_requests_run() {
+	CURLM *multi = docker_multi();
+	if (!multi) return;
+	while(udocker.pending > 0) {
+		int running = 0;
+		if (curl_multi_perform(multi, &running) != CURLM_OK) {
+			uwsgi_log("[docker] unable to run the api requests\n");
+			exit(1);
+		}
+		CURLMsg *msg;
+		int left = 0;
+		while((msg = curl_multi_info_read(multi, &left))) {
+			if (msg->msg != CURLMSG_DONE) continue;
+			CURL *curl = msg->easy_handle;
+			CURLcode res = msg->data.result;
+			struct docker_request *dr = NULL;
+			curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **) &dr);
+			curl_multi_remove_handle(multi, curl);
+			docker_request_done(dr, res);
+		}
+		if (udocker.pending > 0 && running > 0) {
+			curl_multi_wait(multi, NULL, 0, 1000, NULL);
+		}
+	}
+}
+
+struct docker_sync {
+	long *http_status;
+	json_t *response;
+};
+
+static void docker_json_done(void *data, long http_status, json_t *response) {
+	struct docker_sync *ds = (struct docker_sync *) data;
+	*ds->http_status = http_status;
+	if (response) ds->response = json_incref(response);
+}
+
+// a single request, run to completion
+json_t *docker_json(char *method, char *url, json_t *json, long *http_status) {
+	struct docker_sync ds;
+	ds.http_status = http_status;
+	ds.response = NULL;
+	if (docker_request(method, url, json, uwsgi.socket_timeout, docker_json_done, &ds)) return NULL;
+	docker_requests_run();
+	return ds.response;
+}
+
+// "1.41" -> 41 (there are only 1.x versions)
+static int docker_api_parse(const char *version) {
+	if (strncmp(version, "1.", 2)) return -1;
+	return atoi(version + 2);
+}
+
+// from now on the requests ask for the given version
+static int docker_api_set(int version) {
+	udocker.api_version = version;
+	snprintf(udocker.api_prefix, sizeof(udocker.api_prefix), "/v1.%d", version);
+	return version;
+}
+
+// get the api version of the daemon (GET /version).
+// Only a successful negotiation is cached, so a daemon started after the Emperor is asked again by each bridge
+int docker_api_version() {
+	if (udocker.api_version > 0) return udocker.api_version;
+	if (udocker.api) {
+		int forced = docker_api_parse(udocker.api);
+		if (forced <= 0) {
+			uwsgi_log("[docker] invalid api version: %s\n", udocker.api);
+			exit(1);
+		}
+		return docker_api_set(forced);
+	}
+	// /version is unversioned (the prefix of a previous fallback is dropped)
+	udocker.api_prefix[0] = 0;
+	int negotiated = 0;
+	long http_status = 0;
+	json_t *response = docker_json("GET", "/version", NULL, &http_status);
+	json_t *version = response ? json_object_get(response, "ApiVersion") : NULL;
+	if (http_status == 200 && version && json_is_string(version)) {
+		negotiated = docker_api_parse(json_string_value(version));
+	}
+	if (response) json_decref(response);
+	if (negotiated > 0) {
+		if (udocker.debug) uwsgi_log("[docker-debug] daemon api version 1.%d\n", negotiated);
+		return docker_api_set(negotiated);
+	}
+	uwsgi_log("[docker] unable to get the api version of the daemon, using " DOCKER_API "\n");
+	// the requests must match the bodies built for the fallback version, not the latest api of the daemon
+	int fallback = docker_api_set(docker_api_parse(DOCKER_API));
+	udocker.api_version = 0;
+	return fallback;
+}
+
+// inspect a container by its name (or id), returns NULL if it does not exist
+json_t *docker_inspect(char *name) {
+	long http_status = 0;
+	char *url = uwsgi_concat3("/containers/", name, "/json");
+	json_t *response = docker_json("GET", url, NULL, &http_status);
+	free(url);
+	if (http_status == 404) {
+		uwsgi_log("[docker] container %s not found\n", name);
+		goto error;
+	}
+	if (http_status != 200 || !response || !json_is_object(response)) {
+		uwsgi_log("[docker] unable to inspect container %s\n", name);
+		goto error;
+	}
+	return response;
+error:
+	if (response) json_decref(response);
+	return NULL;
+}
+
+// get the id of a container by its name (the returned value must be freed).
+// The daemon resolves the name for us, so the cost does not depend
+// on the number of containers on the host
+char *docker_container_id(char *name) {
+	char *container_id = NULL;
+	json_t *response = docker_inspect(name);
+	if (!response) return NULL;
+	json_t *json_container_id = json_object_get(response, "Id");
+	if (!json_container_id || !json_is_string(json_container_id)) {
+		uwsgi_log("[docker] unable to get container id for %s\n", name);
+		goto end;
+	}
+	container_id = uwsgi_str((char *) json_string_value(json_container_id));
+end:
+	json_decref(response);
+	return container_id;
+}
@@ -0,0 +1,136 @@
+#include "docker.h"
+
+extern struct uwsgi_server uwsgi;
+extern struct uwsgi_docker udocker;
+
+/*
+
+	Crash loop detection (--docker-crash-backoff <ms>).
+
+	When the container of a vassal dies, its bridge asks the daemon the exit code. A container dying
+	within --docker-crash-window seconds from the handoff with a non zero exit code (or killed by the OOM killer)
+	is a crash: the crash streak of the vassal (in its registry slot) grows, otherwise it is reset.
+
+	The next bridge of a crashing vassal sleeps before talking to the daemon: the base delay doubles
+	at every crash (up to --docker-crash-backoff-max milliseconds), half of it is random (so a bad deploy of many vassals
+	does not come back in waves). With --docker-crash-keep the last crashed container of the vassal
+	is renamed <vassal>-crashed (and left stopped) for post-mortem analysis, instead of being destroyed.
+
+*/
+
+void docker_crash_init() {
+	if (!udocker.crash_backoff_max) udocker.crash_backoff_max = 60000;
+	if (udocker.crash_backoff_max < udocker.crash_backoff) udocker.crash_backoff_max = udocker.crash_backoff;
+	if (!udocker.crash_window) udocker.crash_window = 10;
+}
+
+// exit code of a dead container (-1 if unknown)
+static int docker_crash_exit_code(char *container_id) {
+	int exit_code = -1;
+	json_t *response = docker_inspect(container_id);
+	if (!response) return -1;
+	json_t *state = json_object_get(response, "State");
+	json_t *json_exit_code = state ? json_object_get(state, "ExitCode") : NULL;
+	if (json_exit_code && json_is_integer(json_exit_code)) exit_code = json_integer_value(json_exit_code);
+	json_decref(response);
+	return exit_code;
+}
+
+// account the death of a container (alive for lifetime microseconds), returns 1 on crash
+int docker_crash_record(char *name, char *container_id, uint64_t lifetime) {
+	if (!udocker.crash_backoff || !udocker.shared) return 0;
+	struct uwsgi_docker_container *dc = docker_registry_lookup(name);
+	if (!dc) return 0;
+	int exit_code = docker_crash_exit_code(container_id);
+
+	docker_shared_lock();
+	int crash = lifetime < (uint64_t) udocker.crash_window * 1000000 && (exit_code != 0 || dc->oom);
+	dc->crash_exit_code = exit_code;
+	dc->crash_lifetime = lifetime;
+	if (crash) {
+		dc->crashes++;
+		dc->crash_streak++;
+		// base * 2^(streak-1), half of it random (bridges share the random state of the Emperor, use our own seed)
+		unsigned int seed = getpid() ^ uwsgi_micros();
+		uint64_t delay = udocker.crash_backoff;
+		uint64_t i;
+		for(i=1;i<dc->crash_streak && delay < (uint64_t) udocker.crash_backoff_max;i++) delay *= 2;
+		if (delay > (uint64_t) udocker.crash_backoff_max) delay = udocker.crash_backoff_max;
+		delay = (delay / 2) + (rand_r(&seed) % ((delay / 2) + 1));
+		dc->crash_until = uwsgi_micros() + (delay * 1000);
+	}
+	else {
+		dc->crash_streak = 0;
+		dc->crash_until = 0;
+	}
+	uint64_t streak = dc->crash_streak;
+	docker_shared_unlock();
+
+	if (crash) {
+		uwsgi_log("[docker] container %s (%s) crashed after %llums with exit code %d (%llu crashes in a row)\n", container_id, name,
+			(unsigned long long) (lifetime / 1000), exit_code, (unsigned long long) streak);
+	}
+	return crash;
+}
+
+// wait for the end of the backoff of a crashing vassal
+void docker_crash_backoff(char *name) {
+	if (!udocker.crash_backoff || !udocker.shared) return;
+	struct uwsgi_docker_container *dc = docker_registry_lookup(name);
+	if (!dc) return;
+	docker_shared_lock();
+	uint64_t until = dc->crash_until;
+	uint64_t streak = dc->crash_streak;
+	docker_shared_unlock();
+	uint64_t now = uwsgi_micros();
+	if (!streak || until <= now) return;
+	uwsgi_log("[docker] vassal %s is crashing (%llu crashes in a row), respawning it in %llums\n", name,
+		(unsigned long long) streak, (unsigned long long) ((until - now) / 1000));
+	// usleep() is interrupted by the death signal of the monitor
+	while(now < until) {
+		usleep(until - now > 1000000 ? 1000000 : until - now);
+		now = uwsgi_micros();
+	}
+}
+
+// keep the crashed container for post-mortem (replacing the previous one), returns 0 on success
+int docker_crash_keep(char *name, char *container_id) {
+	long http_status = 0;
+	char *crashed = uwsgi_concat2(name, "-crashed");
+	char *url = uwsgi_concat3("/containers/", crashed, "?force=1&v=1");
+	json_t *response = docker_json("DELETE", url, NULL, &http_status);
+	free(url);
+	if (response) json_decref(response);
+	if (http_status != 204 && http_status != 404) {
+		uwsgi_log("[docker] unable to delete the previous crashed container of %s\n", name);
+		free(crashed);
+		return -1;
+	}
+	http_status = 0;
+	url = uwsgi_concat4("/containers/", container_id, "/rename?name=", crashed);
+	response = docker_json("POST", url, NULL, &http_status);
+	free(url);
+	if (response) json_decref(response);
+	if (http_status != 204) {
+		uwsgi_log("[docker] unable to rename crashed container %s (%s)\n", container_id, name);
+		free(crashed);
+		return -1;
+	}
+	uwsgi_log("[docker] crashed container %s kept as %s\n", container_id, crashed);
+	free(crashed);
+	// the vassal has no container anymore
+	docker_registry_state(name, DOCKER_STATE_DESTROYED);
+	return 0;
+}
+
+// crash counters for the stats server (from a copy of the slot)
+json_t *docker_crash_json(struct uwsgi_docker_container *dc) {
+	json_t *crashes = json_object();
+	uint64_t now = uwsgi_micros();
+	json_object_set_new(crashes, "total", json_integer(dc->crashes));
+	json_object_set_new(crashes, "streak", json_integer(dc->crash_streak));
+	json_object_set_new(crashes, "exit_code", json_integer(dc->crash_exit_code));
+	json_object_set_new(crashes, "lifetime_ms", json_integer(dc->crash_lifetime / 1000));
+	json_object_set_new(crashes, "backoff_ms", json_integer(dc->crash_until > now ? (dc->crash_until - now) / 1000 : 0));
+	return crashes;
+}
@@ -1,19 +1,8 @@
-#include <uwsgi.h>
-#include <curl/curl.h>
-#include <jansson.h>
+#include "docker.h"
 
 extern struct uwsgi_server uwsgi;
 
-#define DOCKER_SOCKET "/var/run/docker.sock"
-#define DOCKER_API "1.14"
-
-static struct uwsgi_docker {
-	int emperor;
-	int debug;
-	int emperor_required;
-	char *socket;
-	char *vassal_socket_dir;
-} udocker;
+struct uwsgi_docker udocker;
 
 static struct uwsgi_option docker_options[] = {
 	{"docker-emperor", no_argument, 0, "enable Emperor integration with docker", uwsgi_opt_true, &udocker.emperor, 0},
@@ -22,195 +11,884 @@ static struct uwsgi_option docker_options[] = {
 	{"emperor-docker-required", no_argument, 0, "enable Emperor integration with docker", uwsgi_opt_true, &udocker.emperor_required, 0},
 	{"docker-debug", no_argument, 0, "enable debug mode", uwsgi_opt_true, &udocker.debug, 0},
 	{"docker-daemon-socket", required_argument, 0, "set the docker daemon socket path (default: " DOCKER_SOCKET ")", uwsgi_opt_set_str, &udocker.socket, 0},
+	{"docker-api-version", required_argument, 0, "force the docker api version instead of asking the daemon (1.14 passes the container settings on start)", uwsgi_opt_set_str, &udocker.api, 0},
 	{"docker-socket-dir", required_argument, 0, "set default vassal socket directory", uwsgi_opt_set_str, &udocker.vassal_socket_dir, 0},
+	{"docker-proxy-dir", required_argument, 0, "place the emperor proxy sockets in a directory (better on tmpfs) instead of the vassals dir, mounting a directory per vassal", uwsgi_opt_set_str, &udocker.proxy_dir, 0},
+	{"docker-config-mount", no_argument, 0, "mount the vassal config file (read-only) in the container instead of piping it via the emperor proxy", uwsgi_opt_true, &udocker.config_mount, 0},
+	{"docker-events", no_argument, 0, "track containers in a registry fed by the docker events stream", uwsgi_opt_true, &udocker.events, 0},
+	{"docker-registry-size", required_argument, 0, "set the max number of containers in the registry (default 4096)", uwsgi_opt_set_int, &udocker.registry_size, 0},
+	{"docker-shared-bridge", no_argument, 0, "forward the logs of all of the containers from a single process", uwsgi_opt_true, &udocker.shared_bridge, 0},
+	{"docker-stats", required_argument, 0, "enable the docker stats server on the specified address", uwsgi_opt_set_str, &udocker.stats, 0},
+	{"docker-adopt", no_argument, 0, "reuse existing containers matching the vassal config instead of re-creating them", uwsgi_opt_true, &udocker.adopt, 0},
+	{"docker-metrics", no_argument, 0, "collect the resource usage of the containers and expose it via the docker stats server", uwsgi_opt_true, &udocker.metrics, 0},
+	{"docker-no-keepalive", no_argument, 0, "open a new connection to the docker daemon for each request", uwsgi_opt_true, &udocker.no_keepalive, 0},
+	{"docker-pool", required_argument, 0, "keep the specified number of warm (created) containers for each container config", uwsgi_opt_set_int, &udocker.pool, 0},
+	{"docker-force-remove", no_argument, 0, "destroy containers with a single forced DELETE (killing them) instead of stop and DELETE", uwsgi_opt_true, &udocker.force_remove, 0},
+	{"docker-teardown-concurrency", required_argument, 0, "set the max number of parallel removals when the Emperor dies (default 16)", uwsgi_opt_set_int, &udocker.teardown_concurrency, 0},
+	{"docker-reuse", no_argument, 0, "stop the containers of dead vassals and restart them on respawn if their spec did not change", uwsgi_opt_true, &udocker.reuse, 0},
+	{"docker-rolling", no_argument, 0, "keep vassal sockets in the monitor and replace running containers only once the new ones are ready", uwsgi_opt_true, &udocker.rolling, 0},
+	{"docker-rolling-grace", required_argument, 0, "close the vassal sockets kept by the monitor after the specified number of seconds without a bridge using them (default 30)", uwsgi_opt_set_int, &udocker.rolling_grace, 0},
+	{"docker-log-rate", required_argument, 0, "set the max number of bytes per second forwarded from each container stream (the others are dropped)", uwsgi_opt_set_int, &udocker.log_rate, 0},
+	{"docker-log-burst", required_argument, 0, "set the max number of bytes forwarded at once when --docker-log-rate is in place (default: the rate)", uwsgi_opt_set_int, &udocker.log_burst, 0},
+	{"docker-log-ring", required_argument, 0, "keep the last kilobytes of the output of each vassal in memory and expose them via the docker stats server", uwsgi_opt_set_int, &udocker.log_ring, 0},
+	{"docker-log-rings", required_argument, 0, "set the max number of vassals with a log ring (default 64)", uwsgi_opt_set_int, &udocker.log_rings_max, 0},
+	{"docker-crash-backoff", required_argument, 0, "delay (in milliseconds, doubled at each crash) the respawn of vassals whose containers die right after the spawn", uwsgi_opt_set_int, &udocker.crash_backoff, 0},
+	{"docker-crash-backoff-max", required_argument, 0, "set the max crash loop backoff in milliseconds (default 60000)", uwsgi_opt_set_int, &udocker.crash_backoff_max, 0},
+	{"docker-crash-window", required_argument, 0, "containers dying (with a non zero exit code) within the specified seconds from the spawn are crashes (default 10)", uwsgi_opt_set_int, &udocker.crash_window, 0},
+	{"docker-crash-keep", no_argument, 0, "keep the last crashed container of each vassal (renamed <vassal>-crashed) for post-mortem", uwsgi_opt_true, &udocker.crash_keep, 0},
+	{"docker-pull", no_argument, 0, "pull the missing images of the vassals before creating their containers", uwsgi_opt_true, &udocker.pull, 0},
+	{"docker-pull-concurrency", required_argument, 0, "set the max number of images pulled at the same time (default 4)", uwsgi_opt_set_int, &udocker.pull_concurrency, 0},
+	{"docker-pull-timeout", required_argument, 0, "set the timeout (in seconds) of image pulls (default 600)", uwsgi_opt_set_int, &udocker.pull_timeout, 0},
+	{"docker-placement", no_argument, 0, "give each vassal the least loaded cpus (and the memory) of a NUMA node", uwsgi_opt_true, &udocker.placement, 0},
+	{"docker-spawn-concurrency", required_argument, 0, "set the max number of vassals talking to the docker daemon at the same time (default unlimited)", uwsgi_opt_set_int, &udocker.spawn_concurrency, 0},
+	{"docker-spawn-retries", required_argument, 0, "set the max number of retries of create/start on daemon failures (default 3)", uwsgi_opt_set_int, &udocker.spawn_retries, 0},
+	{"docker-spawn-backoff", required_argument, 0, "set the base delay (in milliseconds) between retries of create/start (default 100)", uwsgi_opt_set_int, &udocker.spawn_backoff, 0},
 	UWSGI_END_OF_OPTIONS
 };
 
-// hack for adding support for unix sockets to libcurl
-static curl_socket_t docker_unix_socket(void *foobar, curlsocktype cs_type, struct curl_sockaddr *c_addr) {
-	struct sockaddr_un* un_addr = (struct sockaddr_un*)&c_addr->addr;
-	c_addr->family = AF_UNIX;
-	c_addr->addrlen = sizeof(struct sockaddr_un);
+// the vassal attributes collected by the Emperor, spec attributes
+// define the container, so they are part of its spec hash
+static struct uwsgi_docker_attribute {
+	char *name;
+	int spec;
+} docker_attributes[] = {
+	{"docker-proxy", 1},
+	{"docker-image", 1},
+	{"docker-port", 1},
+	{"docker-socket", 0},
+	{"docker-socket-shards", 0},
+	{"docker-workdir", 1},
+	{"docker-hostname", 1},
+	{"docker-memory", 1},
+	{"docker-swap", 1},
+	{"docker-mount", 1},
+	{"docker-dns", 1},
+	{"docker-env", 1},
+	{"docker-user", 1},
+	{"docker-cidfile", 0},
+	{"docker-network-mode", 1},
+	{"docker-tty", 1},
+	{"docker-stdout-log", 0},
+	{"docker-stderr-log", 0},
+	{"docker-priority", 0},
+	{"docker-lazy", 0},
+	{"docker-idle", 0},
+	{"docker-pause", 0},
+	{"docker-stop-timeout", 0},
+	{"docker-rolling-delay", 0},
+	{"docker-cpuset", 1},
+	{"docker-cpuset-mems", 1},
+	{"docker-cpu-shares", 1},
+	{"docker-cpu-quota", 1},
+	{"docker-cpus", 1},
+	{NULL, 0},
+};
 
-	memset(un_addr, 0, c_addr->addrlen);
-	un_addr->sun_family = AF_UNIX;
-	strncpy(un_addr->sun_path, udocker.socket, sizeof(un_addr->sun_path));
-	c_addr->protocol = 0;
-	return socket(c_addr->family, c_addr->socktype, c_addr->protocol);
+// boolean attributes, anything but "0", "false", "no" and "off" is true
+static int docker_attr_bool(struct uwsgi_instance *ui, char *name, int default_value) {
+	char *value = vassal_attr_get(ui, name);
+	if (!value) return default_value;
+	if (!strcmp(value, "0") || !strcasecmp(value, "false") || !strcasecmp(value, "no") || !strcasecmp(value, "off")) return 0;
+	return 1;
 }
 
-// store a libcurl response in a uwsgi_buffer
-static size_t docker_response(void *ptr, size_t size, size_t nmemb, void *data) {
-	struct uwsgi_buffer *ub = (struct uwsgi_buffer *) data;
-	if (uwsgi_buffer_append(ub, ptr, size*nmemb)) return -1;
-	return size*nmemb;
+// FNV-1a
+static uint64_t docker_hash(uint64_t hash, char *value, size_t len) {
+	size_t i;
+	for(i=0;i<len;i++) {
+		hash ^= (uint8_t) value[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
 }
 
-static json_t *docker_json(char *method, char *url, json_t *json, long *http_status) {
-	json_t *response = NULL;
-	char *json_body = NULL;
-	struct uwsgi_buffer *ub = uwsgi_buffer_new(uwsgi.page_size);
-	CURL *curl = curl_easy_init();
-	if (!curl) goto error;
-	struct curl_slist *headers = NULL;
-	headers = curl_slist_append(headers, "Content-Type: application/json");
-	curl_easy_setopt(curl, CURLOPT_TIMEOUT, uwsgi.socket_timeout);
-	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, uwsgi.socket_timeout);
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-	char *full_url = uwsgi_concat2("http://127.0.0.1", url);
-	curl_easy_setopt(curl, CURLOPT_URL, full_url);
-	curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method);
-	if (json) {
-		json_body = json_dumps(json, 0);
-		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_body);
-	}
-	curl_easy_setopt(curl, CURLOPT_OPENSOCKETFUNCTION, docker_unix_socket);
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, docker_response);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, ub);
-	CURLcode res = curl_easy_perform(curl);
-	if (json_body) free(json_body);
-
-	if (res != CURLE_OK) {
-		uwsgi_log("[docker] error sending request %s: %s\n", full_url, curl_easy_strerror(res));
-		free(full_url);
-		curl_slist_free_all(headers);
-		curl_easy_cleanup(curl);
-		goto error;
-	}
-
-	curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, http_status);
-	curl_slist_free_all(headers);
-	curl_easy_cleanup(curl);
+static int docker_hash_attr(struct uwsgi_instance *ui, char *value, void *data) {
+	uint64_t *hash = (uint64_t *) data;
+	// include the terminator, so "a","b" and "ab" differ
+	*hash = docker_hash(*hash, value, strlen(value) + 1);
+	return 0;
+}
 
-	if (udocker.debug) {
-		uwsgi_log("[docker-debug] HTTP request to %s -> %d\n%.*s\n", full_url, *http_status, ub->pos, ub->buf);
+// hash the vassal attributes and the command line defining the container
+static uint64_t docker_spec_hash(struct uwsgi_instance *ui, char **argv) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	struct uwsgi_docker_attribute *attr = docker_attributes;
+	while(attr->name) {
+		if (attr->spec) {
+			hash = docker_hash(hash, attr->name, strlen(attr->name) + 1);
+			vassal_attr_get_multi(ui, attr->name, docker_hash_attr, &hash);
+		}
+		attr++;
 	}
-
-	free(full_url);
-
-	json_error_t error;
-	response = json_loadb(ub->buf, ub->pos, 0, &error);
-error:
-	uwsgi_buffer_destroy(ub);
-	return response;
+	while(*argv) {
+		docker_hash_attr(ui, *argv, &hash);
+		argv++;
+	}
+	return hash;
 }
 
-// check if a container has teh specified name
-static int docker_hasname(json_t *obj, char *container_name) {
-	json_t *names = json_object_get(obj, "Names");
-	if (!names || !json_is_array(names)) {
-		return 0;
-	}
-	size_t i, items = json_array_size(names);
-	for(i=0;i<items;i++) {
-		json_t *name = json_array_get(names, i);
-		if (!name || !json_is_string(name)) continue;
-		char *value = (char *)json_string_value(name);
-		if (!value) continue;
-		if (value[0] == '/') {
-			if (!strcmp(container_name, value+1)) {
-				return 1;
-			}
-		}
-		else {
-			if (!strcmp(container_name, value)) {
-				return 1;
-			}
+// seconds given to the container for a graceful shutdown (docker-stop-timeout)
+static int docker_stop_timeout = 3;
+
+static int docker_stop(char *container_id) {
+	long http_status = 0;
+	char timeout[sizeof(UMAX64_STR)+1];
+	snprintf(timeout, sizeof(timeout), "%d", docker_stop_timeout);
+	char *url = uwsgi_concat4("/containers/", container_id, "/stop?t=", timeout);
+	json_t *response = docker_json("POST", url, NULL, &http_status);
+	free(url);
+	if (response) json_decref(response);
+	// a paused container (the bridge died while it was paused) must be unpaused first
+	if (http_status == 409) {
+		http_status = 0;
+		url = uwsgi_concat3("/containers/", container_id, "/unpause");
+		response = docker_json("POST", url, NULL, &http_status);
+		free(url);
+		if (response) json_decref(response);
+		if (http_status == 204) {
+			http_status = 0;
+			url = uwsgi_concat4("/containers/", container_id, "/stop?t=", timeout);
+			response = docker_json("POST", url, NULL, &http_status);
+			free(url);
+			if (response) json_decref(response);
 		}
 	}
+	if (http_status != 204 && http_status != 304) {
+		uwsgi_log("[docker] unable to stop container %s\n", container_id);
+		return http_status == 404 ? 404 : -1;
+	}
+	uwsgi_log("[docker] container %s stopped\n", container_id);
 	return 0;
 }
 
 // stop and DELETE
-static int docker_destroy(char *name, char *container_id) {
-	// useful for menaging jansson reference counting
-	json_t *garbage = NULL;
+int docker_destroy(char *name, char *container_id) {
+	// the container id we need to free
+	char *garbage = NULL;
 	long http_status = 0;
+	char registry_id[65];
+	int from_registry = 0;
+	char *url = NULL;
 	// get the container_id by its name
 	if (!container_id) {
-		json_t *response = docker_json("GET", "/containers/json?all=1", NULL, &http_status);
-		if (!response || !json_is_array(response)) {
-			uwsgi_log("[docker] unable to get containers list\n");
-                	return -1;
-		}
-		size_t i, items = json_array_size(response);
-		for(i=0;i<items;i++) {
-			json_t *container_object = json_array_get(response, i);
-			if (!container_object || !json_is_object(container_object)) {
-				uwsgi_log("[docker] invalid containers list\n");
-                		return -1;
-			}
-			if (docker_hasname(container_object, name)) {
-				uwsgi_log("CONTAINER FOUND !!\n");
-				json_t *json_container_id = json_object_get(container_object, "Id");
-				if (!json_container_id || !json_is_string(json_container_id)) {
-					uwsgi_log("[docker] unable to get container id for %s\n", name);
-                			return -1;
-				}
-				container_id = (char *) json_string_value(json_container_id);
-				break;
-			}
+		// the registry saves us a request to the daemon
+		if (!docker_registry_get(name, registry_id, NULL)) {
+			container_id = registry_id;
+			from_registry = 1;
+		}
+		else {
+			garbage = docker_container_id(name);
+			container_id = garbage;
 		}
-		garbage = response;
 	}
 
 	if (!container_id) {
 		uwsgi_log("[docker] unable to get container id for %s\n", name);
-		if (garbage) json_decref(garbage);
-                return -1;
+		return -1;
 	}
 
-	char *url = uwsgi_concat3("/containers/", container_id, "/stop?t=3");
-	json_t *response = docker_json("POST", url, NULL, &http_status);
-	free(url);
-	if (response) json_decref(response);
-	if (http_status != 204 && http_status != 304) {
-		if (garbage) json_decref(garbage);
-		uwsgi_log("[docker] unable to stop container %s\n", container_id);
+	// a single request, the container is killed
+	if (udocker.force_remove) goto remove;
+
+	int ret = docker_stop(container_id);
+	// the registry is out of sync, ask the daemon
+	if (ret == 404 && from_registry) {
+		docker_registry_state(name, DOCKER_STATE_DESTROYED);
+		return docker_destroy(name, NULL);
+	}
+	// already removed (by the monitor)
+	if (ret == 404) {
+		uwsgi_log("[docker] container %s already deleted\n", container_id);
+		docker_registry_state(name, DOCKER_STATE_DESTROYED);
+		if (garbage) free(garbage);
+		return 0;
+	}
+	if (ret) {
+		if (garbage) free(garbage);
 		return -1;
 	}
-	uwsgi_log("[docker] container %s stopped\n", container_id);
 
+remove:
 	// now DELETE
-	url = uwsgi_concat2("/containers/", container_id);
-	response = docker_json("DELETE", url, NULL, &http_status);
+	url = uwsgi_concat3("/containers/", container_id, udocker.force_remove ? "?force=1&v=1" : "");
+	json_t *response = docker_json("DELETE", url, NULL, &http_status);
 	free(url);
 	if (response) json_decref(response);
+	if (http_status == 404 && udocker.force_remove && from_registry) {
+		docker_registry_state(name, DOCKER_STATE_DESTROYED);
+		return docker_destroy(name, NULL);
+	}
+	// already removed (by the monitor)
+	if (http_status == 404 && udocker.force_remove) http_status = 204;
 	if (http_status != 204) {
-		if (garbage) json_decref(garbage);
 		uwsgi_log("[docker] unable to delete container %s\n", container_id);
+		if (garbage) free(garbage);
 		return -1;
 	}
 
 	uwsgi_log("[docker] container %s deleted\n", container_id);
-	if (garbage) json_decref(garbage);
+	docker_registry_state(name, DOCKER_STATE_DESTROYED);
+	if (garbage) free(garbage);
 	return 0;
 }
 
+// check if the existing container of the vassal has been created with the same spec,
+// and (eventually) stop it, so we can start it again without re-creating it
+static char *docker_adopt(struct uwsgi_instance *ui, char *image, char *env_spec) {
+	char *container_id = NULL;
+	json_t *container = docker_inspect(ui->name);
+	if (!container) return NULL;
+
+	json_t *json_container_id = json_object_get(container, "Id");
+	json_t *config = json_object_get(container, "Config");
+	if (!json_container_id || !json_is_string(json_container_id) || !config || !json_is_object(config)) goto end;
+
+	json_t *json_image = json_object_get(config, "Image");
+	if (!json_image || !json_is_string(json_image) || strcmp(json_string_value(json_image), image)) goto drifted;
+
+	json_t *env = json_object_get(config, "Env");
+	if (!env || !json_is_array(env)) goto drifted;
+	size_t i, items = json_array_size(env);
+	for(i=0;i<items;i++) {
+		json_t *item = json_array_get(env, i);
+		if (item && json_is_string(item) && !strcmp(json_string_value(item), env_spec)) break;
+	}
+	if (i == items) goto drifted;
+
+	container_id = uwsgi_str((char *) json_string_value(json_container_id));
+
+	// a running container has lost its Emperor pipes, it cannot be reused as is
+	json_t *state = json_object_get(container, "State");
+	if (state && json_is_object(state) && json_is_true(json_object_get(state, "Running"))) {
+		if (docker_stop(container_id)) {
+			free(container_id);
+			container_id = NULL;
+			goto end;
+		}
+	}
+
+	// the container keeps the cpus it has been created with, not the ones just assigned to the vassal
+	if (udocker.placement) {
+		json_t *host_config = json_object_get(container, "HostConfig");
+		json_t *cpus = host_config && json_is_object(host_config) ? json_object_get(host_config, "CpusetCpus") : NULL;
+		// Cpuset up to api 1.17
+		if (!cpus || !json_is_string(cpus) || !json_string_value(cpus)[0]) cpus = json_object_get(config, "Cpuset");
+		docker_placement_adopt(ui->name, cpus && json_is_string(cpus) ? (char *) json_string_value(cpus) : NULL);
+	}
+
+	uwsgi_log("[docker] adopting container %s (%s)\n", container_id, ui->name);
+	goto end;
+
+drifted:
+	uwsgi_log("[docker] container %s (%s) does not match the vassal config, replacing it\n", json_string_value(json_container_id), ui->name);
+end:
+	json_decref(container);
+	return container_id;
+}
+
+// the warm pool config of the vassal, refilled after the spawn
+static uint64_t docker_pool_key;
+static json_t *docker_pool_body;
+// the warm containers mount their own directory (HostConfig on create), and the one of ours
+static int docker_pool_mount;
+static char *docker_pool_dir;
+
+// spawn phases timings (in microseconds)
+static uint64_t docker_spawn[DOCKER_SPAWN_PHASES];
+static uint64_t docker_spawn_mark;
+static uint64_t docker_spawn_begin;
+
+// account the time elapsed from the previous mark to a phase
+static void docker_spawn_phase(int phase) {
+	uint64_t now = uwsgi_micros();
+	if (docker_spawn_mark) docker_spawn[phase] += now - docker_spawn_mark;
+	docker_spawn_mark = now;
+}
+
+// the vassal sockets (all of the docker-socket addresses, docker-socket-shards times each).
+// When they are more than one, the instance gets them from a zerg socket mounted next to the emperor proxy
+#define DOCKER_ZERG_TIMEOUT 30
+
+static struct docker_shards {
+	int fds[DOCKER_SHARDS_MAX];
+	int count;
+	int shards;
+	// the first socket has been kept by the monitor (--docker-rolling)
+	int kept;
+	int zerg_fd;
+	char *zerg_path;
+} docker_shards;
+
+// the vassal sockets watched for activity (docker-idle and docker-pause)
+static struct docker_idle {
+	int timeout;
+	int pause;
+	// tcp ports (0 for unix sockets) and addresses (all zeros for the wildcard, ipv4 ones mapped to ipv6), unix socket paths
+	int ports[DOCKER_SHARDS_MAX];
+	unsigned char addrs[DOCKER_SHARDS_MAX][16];
+	char *paths[DOCKER_SHARDS_MAX];
+	int count;
+	uint64_t active;
+	uint64_t checked;
+	// a connection has been seen waiting in the accept queue of a vassal socket during this second
+	uint64_t pending;
+	// the vassal sockets are kept open, they are polled for pending connections (and wake up a paused container)
+	// the Emperor pipe of the instance: a paused container cannot read its commands
+	int emperor_fd;
+	int paused;
+	// failed unpause requests (retried with an exponential delay)
+	int wake_failures;
+	uint64_t wake_retry;
+	char *container_id;
+	struct uwsgi_docker_container *dc;
+} docker_idle;
+
+// get the address of a vassal socket, before it is closed (tcp shards share the port)
+static void docker_idle_setup(int fd) {
+	union uwsgi_sockaddr usa;
+	socklen_t len = sizeof(union uwsgi_sockaddr);
+	memset(&usa, 0, sizeof(union uwsgi_sockaddr));
+	docker_idle.active = uwsgi_now();
+	if (getsockname(fd, (struct sockaddr *) &usa, &len)) {
+		uwsgi_error("docker_idle_setup()/getsockname()");
+		return;
+	}
+	int port = 0;
+	unsigned char addr[16];
+	memset(addr, 0, sizeof(addr));
+	if (usa.sa.sa_family == AF_UNIX) {
+		docker_idle.ports[docker_idle.count] = 0;
+		docker_idle.paths[docker_idle.count++] = uwsgi_str(usa.sa_un.sun_path);
+		return;
+	}
+	else if (usa.sa.sa_family == AF_INET) {
+		port = ntohs(usa.sa_in.sin_port);
+		if (usa.sa_in.sin_addr.s_addr != INADDR_ANY) {
+			addr[10] = 0xff;
+			addr[11] = 0xff;
+			memcpy(addr + 12, &usa.sa_in.sin_addr, 4);
+		}
+	}
+#ifdef AF_INET6
+	else if (usa.sa.sa_family == AF_INET6) {
+		port = ntohs(usa.sa_in6.sin6_port);
+		memcpy(addr, &usa.sa_in6.sin6_addr, 16);
+	}
+#endif
+	if (!port) return;
+	int i;
+	for(i=0;i<docker_idle.count;i++) {
+		if (docker_idle.ports[i] == port && !memcmp(docker_idle.addrs[i], addr, 16)) return;
+	}
+	docker_idle.paths[docker_idle.count] = NULL;
+	memcpy(docker_idle.addrs[docker_idle.count], addr, 16);
+	docker_idle.ports[docker_idle.count++] = port;
+}
+
+// the connection is accepted by one of the watched sockets (tcp ones bound to the wildcard match any local address)
+static int docker_idle_match(int port, unsigned char *addr, char *path) {
+	static unsigned char any[16];
+	int i;
+	for(i=0;i<docker_idle.count;i++) {
+		if (port && docker_idle.ports[i] == port && (!memcmp(docker_idle.addrs[i], any, 16) || !memcmp(docker_idle.addrs[i], addr, 16))) return 1;
+		if (path && docker_idle.paths[i] && !strcmp(docker_idle.paths[i], path)) return 1;
+	}
+	return 0;
+}
 
+// count the connections accepted by the vassal sockets. Sockets passed to the
+// container still live in our network namespace, so /proc/net reports them
+static int docker_idle_connections() {
+	// counted by the monitor (a stale count means the monitor is gone)
+	struct uwsgi_docker_container *dc = docker_idle.dc;
+	if (dc && dc->idle_scanned && uwsgi_micros() - dc->idle_scanned < 3000000) return dc->idle_connections;
+	char line[512];
+	int count = 0;
+	int i, paths = 0, ports = 0;
+	for(i=0;i<docker_idle.count;i++) {
+		if (docker_idle.paths[i]) paths++;
+		else ports++;
+	}
+	if (paths) {
+		FILE *f = fopen("/proc/net/unix", "r");
+		if (!f) return -1;
+		while(fgets(line, sizeof(line), f)) {
+			unsigned int st = 0;
+			char path[256];
+			path[0] = 0;
+			// Num RefCount Protocol Flags Type St Inode Path
+			if (sscanf(line, "%*s %*s %*s %*s %*s %x %*s %255s", &st, path) < 2) continue;
+			// 03 -> connected
+			if (st == 3 && docker_idle_match(0, NULL, path)) count++;
+		}
+		fclose(f);
+	}
+	char *files[] = {"/proc/net/tcp", "/proc/net/tcp6", NULL};
+	char **file = files;
+	while(ports && *file) {
+		FILE *f = fopen(*file, "r");
+		file++;
+		if (!f) continue;
+		while(fgets(line, sizeof(line), f)) {
+			unsigned char addr[16];
+			int port = 0, st = 0;
+			if (docker_proc_tcp_parse(line, addr, &port, &st)) continue;
+			// 01 -> established
+			if (st == 1 && port && docker_idle_match(port, addr, NULL)) count++;
+		}
+		fclose(f);
+	}
+	return count;
+}
+
+// POST /containers/<id>/pause or /unpause
+static int docker_pause(char *action) {
+	long http_status = 0;
+	char *url = uwsgi_concat4("/containers/", docker_idle.container_id, "/", action);
+	json_t *response = docker_json("POST", url, NULL, &http_status);
+	free(url);
+	if (response) json_decref(response);
+	if (http_status != 204) {
+		uwsgi_log("[docker] unable to %s container %s\n", action, docker_idle.container_id);
+		return -1;
+	}
+	return 0;
+}
+
+// failed unpause requests before considering the container running
+#define DOCKER_WAKE_RETRIES 5
+
+// a connection (or a command of the Emperor) is pending for the paused container
+static void docker_wake() {
+	uint64_t start = uwsgi_micros();
+	if (docker_pause("unpause")) {
+		docker_idle.wake_failures++;
+		// the daemon could have unpaused it (or the container is gone), the stop will tell
+		if (docker_idle.wake_failures >= DOCKER_WAKE_RETRIES) {
+			uwsgi_log("[docker] unable to unpause container %s %d times, considering it running\n", docker_idle.container_id, docker_idle.wake_failures);
+			docker_idle.paused = 0;
+			docker_idle.wake_failures = 0;
+			docker_idle.wake_retry = 0;
+			docker_idle.active = uwsgi_now();
+			return;
+		}
+		// 100ms, 200ms, 400ms ...
+		docker_idle.wake_retry = start + (100000ULL << (docker_idle.wake_failures - 1));
+		return;
+	}
+	uint64_t elapsed = uwsgi_micros() - start;
+	docker_idle.paused = 0;
+	docker_idle.wake_failures = 0;
+	docker_idle.wake_retry = 0;
+	docker_idle.active = uwsgi_now();
+	if (docker_idle.dc) {
+		__sync_add_and_fetch(&docker_idle.dc->wakes, 1);
+		__sync_add_and_fetch(&docker_idle.dc->wake_time, elapsed);
+		docker_idle.dc->wake_last = elapsed;
+	}
+	if (docker_idle.dc) docker_registry_state(docker_idle.dc->name, DOCKER_STATE_RUNNING);
+	uwsgi_log("[docker] container %s woken up in %lluus\n", docker_idle.container_id, (unsigned long long) elapsed);
+}
+
+// wait for data on fd (timeouts are managed by docker_idle_expired())
+// returns 1 if fd is readable, 0 on timeout, -1 on error
+static int docker_wait(int fd) {
+	struct pollfd pfd[DOCKER_SHARDS_MAX + 2];
+	int nfds = 1;
+	int timeout = (docker_idle.timeout || docker_idle.pause) ? 1000 : -1;
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+	pfd[0].revents = 0;
+	if (docker_idle.paused) {
+		uint64_t now = uwsgi_micros();
+		// the last unpause failed, the pending connection is left alone until the next retry
+		if (docker_idle.wake_retry > now) {
+			uint64_t delay = (docker_idle.wake_retry - now) / 1000;
+			if (delay < (uint64_t) timeout) timeout = delay + 1;
+		}
+		else {
+			int i;
+			for(i=0;i<docker_shards.count;i++) {
+				pfd[nfds].fd = docker_shards.fds[i];
+				pfd[nfds].events = POLLIN;
+				pfd[nfds].revents = 0;
+				nfds++;
+			}
+			// the command is not read, the instance gets it once unpaused
+			if (docker_idle.emperor_fd > -1) {
+				pfd[nfds].fd = docker_idle.emperor_fd;
+				pfd[nfds].events = POLLIN;
+				pfd[nfds].revents = 0;
+				nfds++;
+			}
+		}
+	}
+	// connections accepted by the instance between two counts of the established ones: the bridge is woken
+	// up when they are queued (at most once per second, a full accept queue would keep the sockets readable)
+	else if (docker_idle.count && docker_idle.pending != uwsgi_now()) {
+		int i;
+		for(i=0;i<docker_shards.count;i++) {
+			pfd[nfds].fd = docker_shards.fds[i];
+			pfd[nfds].events = POLLIN;
+			pfd[nfds].revents = 0;
+			nfds++;
+		}
+	}
+	int ret = poll(pfd, nfds, timeout);
+	if (ret < 0) return -1;
+	int i;
+	for(i=1;i<nfds;i++) {
+		if (!pfd[i].revents) continue;
+		if (docker_idle.paused) {
+			docker_wake();
+		}
+		else {
+			docker_idle.pending = uwsgi_now();
+			docker_idle.active = docker_idle.pending;
+		}
+		break;
+	}
+	return pfd[0].revents ? 1 : 0;
+}
+
+// pause the container after docker-pause seconds without connections (checked every second),
+// returns 1 when the vassal had no connections for the whole idle timeout
+static int docker_idle_expired() {
+	if (!docker_idle.timeout && !docker_idle.pause) return 0;
+	uint64_t now = uwsgi_now();
+	if (now == docker_idle.checked) return 0;
+	docker_idle.checked = now;
+	// a paused container cannot have new connections
+	if (!docker_idle.paused && docker_idle.pending != now && docker_idle_connections() != 0) {
+		docker_idle.active = now;
+		return 0;
+	}
+	if (docker_idle.timeout && now - docker_idle.active >= (uint64_t) docker_idle.timeout) return 1;
+	if (docker_idle.pause && !docker_idle.paused && now - docker_idle.active >= (uint64_t) docker_idle.pause) {
+		if (docker_pause("pause")) {
+			// do not retry every second
+			docker_idle.active = now;
+			return 0;
+		}
+		docker_idle.paused = 1;
+		if (docker_idle.dc) {
+			__sync_add_and_fetch(&docker_idle.dc->pauses, 1);
+			docker_registry_state(docker_idle.dc->name, DOCKER_STATE_PAUSED);
+		}
+		uwsgi_log("[docker] container %s paused after %d seconds without connections\n", docker_idle.container_id, docker_idle.pause);
+	}
+	return 0;
+}
+
+// rolling replace: the running container of the vassal (retired once the new one is ready)
+static char *docker_rolling_old;
+static char *docker_rolling_name;
+static int docker_rolling_delay;
+
+// the new instance got its file descriptors: destroy the old container
+// and give the vassal name to the new one
+static void docker_rolling_retire(struct uwsgi_instance *ui, char *container_id) {
+	if (docker_rolling_delay > 0) sleep(docker_rolling_delay);
+	uwsgi_log("[docker] container %s (%s) replaced by %s, retiring it\n", docker_rolling_old, ui->name, container_id);
+	docker_destroy(ui->name, docker_rolling_old);
+	long http_status = 0;
+	char *url = uwsgi_concat4("/containers/", container_id, "/rename?name=", ui->name);
+	json_t *response = docker_json("POST", url, NULL, &http_status);
+	free(url);
+	if (response) json_decref(response);
+	if (http_status != 204) {
+		uwsgi_log("[docker] unable to rename container %s (%s) to %s\n", container_id, docker_rolling_name, ui->name);
+	}
+	else {
+		docker_registry_state(docker_rolling_name, DOCKER_STATE_DESTROYED);
+	}
+	// destroying the old container marked the vassal as destroyed
+	docker_registry_set(ui->name, container_id, DOCKER_STATE_RUNNING, getpid());
+	free(docker_rolling_old);
+	docker_rolling_old = NULL;
+}
+
+// check for a running container of the vassal, it will keep serving until the new one is ready
+static void docker_rolling_check(struct uwsgi_instance *ui) {
+	json_t *container = docker_inspect(ui->name);
+	if (!container) return;
+	json_t *json_container_id = json_object_get(container, "Id");
+	json_t *state = json_object_get(container, "State");
+	if (json_container_id && json_is_string(json_container_id) && state && json_is_object(state) && json_is_true(json_object_get(state, "Running"))) {
+		docker_rolling_old = uwsgi_str((char *) json_string_value(json_container_id));
+		docker_rolling_name = uwsgi_concat2(ui->name, "-rolling");
+		uwsgi_log("[docker] container %s (%s) is running, replacing it with %s\n", docker_rolling_old, ui->name, docker_rolling_name);
+	}
+	json_decref(container);
+}
+
+static int docker_bind_socket(struct uwsgi_instance *ui, char *value, void *data) {
+	int i = 0;
+	// the first shard of the first address is already there
+	if (docker_shards.kept) {
+		docker_shards.kept = 0;
+		i = 1;
+	}
+	for(;i<docker_shards.shards;i++) {
+		if (docker_shards.count >= DOCKER_SHARDS_MAX) {
+			uwsgi_log("[docker] too many sockets for vassal %s (max %d)\n", ui->name, DOCKER_SHARDS_MAX);
+			return -1;
+		}
+		int fd = -1;
+		char *address = uwsgi_str(value);
+		char *tcp_port = strchr(address, ':');
+		if (tcp_port) {
+			// the kernel spreads the connections between the shards
+			if (docker_shards.shards > 1) uwsgi.reuse_port = 1;
+			fd = bind_to_tcp(address, uwsgi.listen_queue, tcp_port);
+		}
+		else {
+			// unix shards are distinct sockets (<path>, <path>.1, <path>.2 ...)
+			if (i > 0) {
+				char shard[sizeof(UMAX64_STR)+1];
+				snprintf(shard, sizeof(shard), ".%d", i);
+				char *tmp = uwsgi_concat2(address, shard);
+				free(address);
+				address = tmp;
+			}
+			fd = bind_to_unix(address, uwsgi.listen_queue, uwsgi.chmod_socket, 0);
+		}
+		free(address);
+		if (fd < 0) return -1;
+		docker_shards.fds[docker_shards.count++] = fd;
+	}
+	return 0;
+}
+
+// set when the monitor notifies us about the death of the container
+static volatile sig_atomic_t docker_container_died = 0;
+
+static void docker_death_handler(int signum) {
+	docker_container_died = 1;
+}
+
+// set by SIGTERM and SIGINT after the handoff, the container is destroyed (unpausing it) before exiting
+static volatile sig_atomic_t docker_bridge_stopped = 0;
+
+static void docker_stop_handler(int signum) {
+	docker_bridge_stopped = 1;
+}
+
+// results of docker_wait_fds() (otherwise the index of the readable fd)
+#define DOCKER_WAIT_TIMEOUT -1
+#define DOCKER_WAIT_DIED -2
+#define DOCKER_WAIT_EMPEROR -3
+// seconds between two checks of the container state, without the monitor notifications
+#define DOCKER_WAIT_CHECK 5
+
+// the container exited (or has been removed) while we were waiting for it
+static int docker_container_exited(char *container_id) {
+	json_t *container = docker_inspect(container_id);
+	if (!container) return 1;
+	json_t *state = json_object_get(container, "State");
+	int exited = !state || !json_is_object(state) || !json_is_true(json_object_get(state, "Running"));
+	json_decref(container);
+	return exited;
+}
+
+// wait (at most timeout seconds, -1 for ever) for one of the fds to be readable, the death of the container (if any)
+// and the commands of the Emperor are checked every second, so a signal or a dead container never leave us blocked
+static int docker_wait_fds(int emperor_fd, int *fds, int count, int timeout, char *container_id) {
+	struct pollfd pfd[DOCKER_SHARDS_MAX + 2];
+	uint64_t started = uwsgi_now();
+	uint64_t checked = started;
+	int i;
+	for(;;) {
+		if (docker_container_died) return DOCKER_WAIT_DIED;
+		// SIGTERM or SIGINT, as a stop command
+		if (docker_bridge_stopped) return DOCKER_WAIT_EMPEROR;
+		uint64_t now = uwsgi_now();
+		if (timeout >= 0 && now - started >= (uint64_t) timeout) return DOCKER_WAIT_TIMEOUT;
+		// the monitor does not notify us without --docker-events
+		if (container_id && !udocker.events && now - checked >= DOCKER_WAIT_CHECK) {
+			checked = now;
+			if (docker_container_exited(container_id)) return DOCKER_WAIT_DIED;
+		}
+		for(i=0;i<count;i++) {
+			pfd[i].fd = fds[i];
+			pfd[i].events = POLLIN;
+			pfd[i].revents = 0;
+		}
+		int nfds = count;
+		if (emperor_fd > -1) {
+			pfd[nfds].fd = emperor_fd;
+			pfd[nfds].events = POLLIN;
+			pfd[nfds].revents = 0;
+			nfds++;
+		}
+		int ret = poll(pfd, nfds, 1000);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			uwsgi_error("docker_wait_fds()/poll()");
+			return DOCKER_WAIT_DIED;
+		}
+		if (ret == 0) continue;
+		// a stop or reload command (or the Emperor is gone), nobody else can get it before the handoff
+		if (emperor_fd > -1 && pfd[count].revents) {
+			char byte;
+			if (read(emperor_fd, &byte, 1) < 0 && errno == EINTR) continue;
+			return DOCKER_WAIT_EMPEROR;
+		}
+		for(i=0;i<count;i++) {
+			if (pfd[i].revents) return i;
+		}
+	}
+}
+
+// wait for a connection on any of the vassal sockets, a command of the Emperor
+// (stop, reload or its death) ends the bridge before spawning anything
+static void docker_wait_connection(struct uwsgi_instance *ui, int proxy_fd, char *proxy_path) {
+	// a stopped bridge cleans its sockets
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(struct sigaction));
+	sa.sa_handler = docker_stop_handler;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	int ret = docker_wait_fds(ui->pipe[1], docker_shards.fds, docker_shards.count, -1, NULL);
+	sa.sa_handler = SIG_DFL;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	if (ret >= 0) return;
+	uwsgi_log("[docker] vassal %s stopped while waiting for the first connection\n", ui->name);
+	close(proxy_fd);
+	unlink(proxy_path);
+	if (docker_shards.zerg_fd > -1) {
+		close(docker_shards.zerg_fd);
+		unlink(docker_shards.zerg_path);
+	}
+	exit(0);
+}
+
+// pass the sockets to the instance (it connects to the zerg socket while binding its sockets), the zerg socket is non blocking
+static void docker_zerg_send() {
+	int fd = accept(docker_shards.zerg_fd, NULL, NULL);
+	if (fd < 0) {
+		uwsgi_error("docker_zerg_send()/accept()");
+		return;
+	}
+	docker_send_fds(fd, "uwsgi-zerg", 10, docker_shards.fds, docker_shards.count);
+	close(fd);
+	close(docker_shards.zerg_fd);
+	docker_shards.zerg_fd = -1;
+	unlink(docker_shards.zerg_path);
+}
+
+// open the destination of a container stream (the uWSGI log by default)
+static int docker_log_fd(struct uwsgi_instance *ui, char *attr) {
+	char *path = vassal_attr_get(ui, attr);
+	if (!path) return dup(2);
+	int fd = open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+	if (fd < 0) {
+		uwsgi_error_open(path);
+		return dup(2);
+	}
+	return fd;
+}
 
 // here we use a raw connection
-static void docker_attach(struct uwsgi_instance *ui, int proxy_fd, char *proxy_path, char *container_id, int socket_fd) {
+static void docker_attach(struct uwsgi_instance *ui, int proxy_fd, char *proxy_path, char *container_id, int socket_fd, int tty) {
 
 	uwsgi_log("[docker] waiting for proxy connection on container %s (%s)\n", container_id, ui->name);
 	// wait for connection
-	uwsgi_master_manage_emperor_proxy(proxy_fd, ui->pipe[1], ui->pipe_config[1], socket_fd);
+	docker_spawn_phase(DOCKER_SPAWN_START);
+	int zerg = docker_shards.zerg_fd > -1;
+	// never block in accept(): the container could die (or the vassal be stopped) before connecting
+	int wait_fds[2] = {proxy_fd, docker_shards.zerg_fd};
+	int ret = docker_wait_fds(ui->pipe[1], wait_fds, zerg ? 2 : 1, -1, container_id);
+	// the instance could ask for its sockets before connecting to the emperor proxy
+	if (ret == 1) {
+		docker_zerg_send();
+		ret = docker_wait_fds(ui->pipe[1], &proxy_fd, 1, -1, container_id);
+	}
+	if (ret != 0) {
+		if (ret == DOCKER_WAIT_EMPEROR) {
+			uwsgi_log("[docker] vassal %s stopped before the handoff\n", ui->name);
+		}
+		else {
+			uwsgi_log("[docker] container %s (%s) died before connecting to the emperor proxy\n", container_id, ui->name);
+		}
+		close(proxy_fd);
+		unlink(proxy_path);
+		if (docker_shards.zerg_fd > -1) {
+			close(docker_shards.zerg_fd);
+			unlink(docker_shards.zerg_path);
+		}
+		goto end;
+	}
+	docker_spawn_phase(DOCKER_SPAWN_PROXY);
+	// the sockets are passed via the zerg socket
+	uwsgi_master_manage_emperor_proxy(proxy_fd, ui->pipe[1], ui->pipe_config[1], zerg ? -1 : socket_fd);
+	if (docker_shards.zerg_fd > -1) {
+		// the Emperor pipe belongs to the instance now
+		ret = docker_wait_fds(-1, &docker_shards.zerg_fd, 1, DOCKER_ZERG_TIMEOUT, container_id);
+		if (ret == 0) {
+			docker_zerg_send();
+		}
+		else {
+			if (ret == DOCKER_WAIT_TIMEOUT) uwsgi_log("[docker] the instance of %s did not ask for its sockets\n", ui->name);
+			close(docker_shards.zerg_fd);
+			docker_shards.zerg_fd = -1;
+			unlink(docker_shards.zerg_path);
+		}
+	}
+	docker_spawn_phase(DOCKER_SPAWN_HANDOFF);
+	docker_spawn[DOCKER_SPAWN_TOTAL] = docker_spawn_mark - docker_spawn_begin;
+	docker_spawn_record(ui->name, docker_spawn);
+	if (docker_rolling_old) docker_rolling_retire(ui, container_id);
+	if ((docker_idle.timeout || docker_idle.pause) && socket_fd > -1) {
+		int i;
+		for(i=0;i<docker_shards.count;i++) docker_idle_setup(docker_shards.fds[i]);
+		docker_idle.container_id = container_id;
+		docker_idle.dc = docker_registry_lookup(ui->name);
+		docker_monitor_idle(docker_idle.dc, docker_idle.ports, docker_idle.addrs, docker_idle.paths, docker_idle.count);
+	}
 	// we do not need those fds anymore
 	close(proxy_fd);
-	close(ui->pipe[1]);
+	if (docker_pool_dir) rmdir(docker_pool_dir);
 	if (ui->pipe_config[1] > -1)
 		close(ui->pipe_config[1]);
-	if (socket_fd > -1)
-		close(socket_fd);
+	// the Emperor pipe of a paused container is polled by us, the sockets are polled for pending connections too
+	docker_idle.emperor_fd = -1;
+	if (docker_idle.pause) {
+		docker_idle.emperor_fd = ui->pipe[1];
+	}
+	else {
+		close(ui->pipe[1]);
+	}
+	if (!docker_idle.pause && !docker_idle.count) {
+		int i;
+		for(i=0;i<docker_shards.count;i++) close(docker_shards.fds[i]);
+	}
 	unlink(proxy_path);
 
+	// the pool is refilled by a child, without delaying the logs of the container
+	if (docker_pool_body) {
+		docker_pool_refill_async(ui->name, docker_pool_key, docker_pool_body, docker_pool_mount);
+		json_decref(docker_pool_body);
+		docker_pool_body = NULL;
+	}
+
+	// from now on the container is ours: a stopped bridge does not leave it behind (paused or not)
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(struct sigaction));
+	sa.sa_handler = docker_stop_handler;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
 	int fd = uwsgi_connect(udocker.socket, uwsgi.socket_timeout, 0);
 	if (fd < 0) goto end;
 
 	// send a raw request, we do not need curl this time
 	// ub structure us not freed on error, as we brutally exit
 	struct uwsgi_buffer *ub = uwsgi_buffer_new(uwsgi.page_size);
-	if (uwsgi_buffer_append(ub, "POST /containers/", 17)) goto end;
+	if (uwsgi_buffer_append(ub, "POST ", 5)) goto end;
+	if (uwsgi_buffer_append(ub, udocker.api_prefix, strlen(udocker.api_prefix))) goto end;
+	if (uwsgi_buffer_append(ub, "/containers/", 12)) goto end;
 	if (uwsgi_buffer_append(ub, container_id, strlen(container_id))) goto end;
 	if (uwsgi_buffer_append(ub, "/attach?stream=1&logs=1&stdin=1&stdout=1&stderr=1 HTTP/1.1\r\n\r\n", 62)) goto end;
 	if (uwsgi_write_nb(fd, ub->buf, ub->pos, uwsgi.socket_timeout)) {
@@ -219,23 +897,84 @@ static void docker_attach(struct uwsgi_instance *ui, int proxy_fd, char *proxy_p
 	}
 	uwsgi_buffer_destroy(ub);
 
+	int log_fds[2];
+	log_fds[0] = docker_log_fd(ui, "docker-stdout-log");
+	log_fds[1] = docker_log_fd(ui, "docker-stderr-log");
+
+	if (udocker.shared_bridge) {
+		// the monitor forwards the logs, we only wait for the end of the stream
+		int wait_fd = docker_monitor_attach(ui->name, container_id, tty, fd, log_fds);
+		if (wait_fd > -1) {
+			close(fd);
+			close(log_fds[0]);
+			close(log_fds[1]);
+			// give back the memory used during the spawn
+			malloc_trim(0);
+			for(;;) {
+				int ret = docker_wait(wait_fd);
+				if (docker_container_died) {
+					uwsgi_log("[docker] container %s (%s) is dead\n", container_id, ui->name);
+					break;
+				}
+				if (docker_bridge_stopped) {
+					uwsgi_log("[docker] bridge of %s stopped (container %s)\n", ui->name, container_id);
+					break;
+				}
+				if (docker_idle_expired()) {
+					uwsgi_log("[docker] container %s (%s) is idle, stopping it\n", container_id, ui->name);
+					break;
+				}
+				if (ret == 0 || (ret < 0 && errno == EINTR)) continue;
+				break;
+			}
+			goto end;
+		}
+		uwsgi_log("[docker] unable to pass the attach stream of container %s (%s) to the monitor\n", container_id, ui->name);
+	}
+
+	struct docker_log *dl = docker_log_new(tty, log_fds[0], log_fds[1], docker_registry_lookup(ui->name), 0);
+
 	// now start waiting for pty data
 	for(;;) {
-		int ret = uwsgi_waitfd_event(fd, -1, POLLIN);
-		if (ret <= 0) break;
-		char buf[8192];
-		ssize_t rlen = read(fd, buf, 8192);
-		if (rlen <= 0) {
-			uwsgi_error("docker_attach()/read()");
+		int ret = docker_wait(fd);
+		if (docker_container_died) {
+			uwsgi_log("[docker] container %s (%s) is dead\n", container_id, ui->name);
+			break;
+		}
+		if (docker_bridge_stopped) {
+			uwsgi_log("[docker] bridge of %s stopped (container %s)\n", ui->name, container_id);
 			break;
 		}
-		// forward the log line
-		uwsgi_log("%.*s", rlen, buf);
+		if (docker_idle_expired()) {
+			uwsgi_log("[docker] container %s (%s) is idle, stopping it\n", container_id, ui->name);
+			break;
+		}
+		if (ret == 0) continue;
+		if (ret < 0) break;
+		// forward the logs
+		if (docker_log_read(dl, fd)) break;
 	}
+	docker_log_destroy(dl);
 end:
+	// paused containers cannot be stopped
+	if (docker_idle.paused) docker_pause("unpause");
+	// the handoff is the last spawn phase, crashed containers are never reused
+	if (docker_crash_record(ui->name, container_id, uwsgi_micros() - docker_spawn_mark)) {
+		if (udocker.crash_keep && !docker_crash_keep(ui->name, container_id)) {
+			if (udocker.debug) docker_curl_stats();
+			return;
+		}
+	}
+	// keep the container for the next spawn of the vassal (warm containers cannot be reused)
+	else if (udocker.reuse && !docker_pool_dir && !docker_stop(container_id)) {
+		docker_registry_state(ui->name, DOCKER_STATE_STOPPED);
+		if (udocker.debug) docker_curl_stats();
+		return;
+	}
 	// destroy the container
 	uwsgi_log("[docker] destroying container %s (%s) ...\n", container_id, ui->name);
 	docker_destroy(ui->name, container_id);
+	if (udocker.debug) docker_curl_stats();
 	// never here
 }
 
@@ -277,37 +1016,14 @@ end:
 	return ret;
 }
 
-static int docker_expose_port(struct uwsgi_instance *ui, char *value, void *data) {
-        int ret = -1;
-        json_t *ports = (json_t *) data;
-        // how many colons ?
-        size_t i,n = 0;
-        char **items = uwsgi_split_quoted(value, strlen(value), ":", &n);
-        if (n < 2) goto end;
-        // hostport:dockerport ?
-        char *docker_port = NULL;
-        if (n == 2) {
-                docker_port = items[1];
-        }
-        // hostip:hostport:dockerport
-        else {
-                docker_port = items[2];
-        }
-        json_object_set(ports, docker_port, json_object());
-        ret = 0;
-end:
-        for(i=0;i<n;i++) {
-                free(items[i]);
-        }
-        free(items);
-        return ret;
-}
-
 // POST /containers/create HTTP/1.1
 static void docker_run(struct uwsgi_instance *ui, char **argv) {
 
 	if (!udocker.emperor) return;
 
+	// we must not keep the monitor alive
+	if (udocker.shared && udocker.shared->monitor) close(udocker.monitor_pipe[1]);
+
 	char *proxy_attr = vassal_attr_get(ui, "docker-proxy");
 	char *image_attr = vassal_attr_get(ui, "docker-image");
 
@@ -323,8 +1039,23 @@ static void docker_run(struct uwsgi_instance *ui, char **argv) {
 	uwsgi_set_processname(processname);
 	free(processname);
 
+	// the monitor notifies us as soon as the container dies (do not restart syscalls)
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(struct sigaction));
+	sa.sa_handler = docker_death_handler;
+	sigaction(DOCKER_DEATH_SIGNAL, &sa, NULL);
+
+	// capable daemons get the host settings on create (and a start without body),
+	// older ones on start
+	int hostconfig = docker_api_version() >= DOCKER_API_HOSTCONFIG;
+	// with HostConfig on create the binds of a warm container cannot change: it mounts a directory
+	// of its own (at the proxy path of the pool), where the bridge taking it moves its sockets
+	docker_pool_mount = udocker.pool && hostconfig && !proxy_attr;
+
 	char *proxy_attr_emperor = NULL;
 	char *proxy_attr_docker = NULL;
+	// the directory of the vassal in the proxy dir (mounted instead of the socket)
+	char *proxy_dir = NULL;
 	if (proxy_attr) {
 		char *colon = strchr(proxy_attr, ':');
 		if (colon) {
@@ -339,6 +1070,14 @@ static void docker_run(struct uwsgi_instance *ui, char **argv) {
 			proxy_attr_docker = proxy_attr;
 		}
 	}
+	else if (udocker.proxy_dir) {
+		// the directory survives the containers of the vassal, only the socket is re-created
+		proxy_dir = uwsgi_concat3(udocker.proxy_dir, "/", ui->name);
+		if (docker_proxy_mkdir(proxy_dir)) exit(1);
+		proxy_attr_emperor = uwsgi_concat3(proxy_dir, "/", DOCKER_PROXY_SOCKET);
+		// the same for all of the vassals (and the pool containers)
+		proxy_attr_docker = DOCKER_PROXY_MOUNT "/" DOCKER_PROXY_SOCKET;
+	}
 	else {
 		// if docker-proxy is not specified we place the socket
 		// in the vassals dir
@@ -356,38 +1095,177 @@ static void docker_run(struct uwsgi_instance *ui, char **argv) {
 		}
 		proxy_attr_emperor = uwsgi_concat2(socket_path, ".sock");
 		free(socket_path);
-		proxy_attr_docker = uwsgi_concat3("/", ui->name, ".sock");
+		// pool containers are shared by vassals, the path cannot contain the vassal name
+		proxy_attr_docker = udocker.pool ? DOCKER_POOL_PROXY : uwsgi_concat3("/", ui->name, ".sock");
 	}
 
 	int socket_fd = -1;
 	char *docker_socket = vassal_attr_get(ui, "docker-socket");
+	char *docker_socket_shards = vassal_attr_get(ui, "docker-socket-shards");
+	docker_shards.shards = docker_socket_shards ? atoi(docker_socket_shards) : 1;
+	if (docker_shards.shards < 1) docker_shards.shards = 1;
+	docker_shards.zerg_fd = -1;
+	// the monitor keeps the first socket across the containers of the vassal (the other ones are ours)
+	if (docker_socket && udocker.rolling) {
+		socket_fd = docker_monitor_socket(ui->name, docker_socket, docker_shards.shards);
+	}
+	if (socket_fd > -1) {
+		docker_shards.fds[docker_shards.count++] = socket_fd;
+		docker_shards.kept = 1;
+	}
 	if (docker_socket) {
-		char *tcp_port = strchr(docker_socket, ':');
-                if (tcp_port) {
-                        socket_fd = bind_to_tcp(docker_socket, uwsgi.listen_queue, tcp_port);
-                }
-                else {
-                        socket_fd = bind_to_unix(docker_socket, uwsgi.listen_queue, uwsgi.chmod_socket, 0);
-                }
-        if (socket_fd == -1) {
-        	uwsgi_error("error binding docker-socket");
-        	exit(1);
-        }
+		if (vassal_attr_get_multi(ui, "docker-socket", docker_bind_socket, NULL)) {
+			uwsgi_error("error binding docker-socket");
+			exit(1);
+		}
+		socket_fd = docker_shards.fds[0];
 	}
 
 	// first of all we wait for proxy connection
         int proxy_fd = bind_to_unix(proxy_attr_emperor, uwsgi.listen_queue, uwsgi.chmod_socket, 0);
         if (proxy_fd < 0) exit(1);
 
+	// the zerg socket is mounted next to the emperor proxy
+	if (docker_shards.count > 1) {
+		docker_shards.zerg_path = uwsgi_concat2(proxy_attr_emperor, ".zerg");
+		docker_shards.zerg_fd = bind_to_unix(docker_shards.zerg_path, uwsgi.listen_queue, uwsgi.chmod_socket, 0);
+		if (docker_shards.zerg_fd < 0) exit(1);
+		uwsgi_socket_nb(docker_shards.zerg_fd);
+	}
+
+	// on demand mode: the container is created when the first connection arrives
+	// (and destroyed after docker-idle seconds without connections, the Emperor will respawn us)
+	char *docker_rolling_delay_attr = vassal_attr_get(ui, "docker-rolling-delay");
+	if (docker_rolling_delay_attr) docker_rolling_delay = atoi(docker_rolling_delay_attr);
+
+	char *docker_stop_timeout_attr = vassal_attr_get(ui, "docker-stop-timeout");
+	if (docker_stop_timeout_attr) docker_stop_timeout = atoi(docker_stop_timeout_attr);
+
+	char *docker_idle_attr = vassal_attr_get(ui, "docker-idle");
+	if (docker_idle_attr) docker_idle.timeout = atoi(docker_idle_attr);
+	char *docker_pause_attr = vassal_attr_get(ui, "docker-pause");
+	if (docker_pause_attr) {
+		docker_idle.pause = atoi(docker_pause_attr);
+		if (docker_idle.pause > 0 && socket_fd < 0) {
+			uwsgi_log("[docker] docker-pause requires the docker-socket attribute (vassal %s)\n", ui->name);
+			exit(1);
+		}
+	}
+	// pull the image before waiting for connections (lazy vassals are ready for the first one),
+	// other vassals of the same image wait for our pull
+	if (docker_image_ensure(image_attr)) {
+		uwsgi_log("[docker] image %s is not available for vassal %s\n", image_attr, ui->name);
+		exit(1);
+	}
+
+	if (docker_attr_bool(ui, "docker-lazy", 0) || docker_idle.timeout > 0) {
+		if (socket_fd < 0) {
+			uwsgi_log("[docker] on demand mode requires the docker-socket attribute (vassal %s)\n", ui->name);
+			exit(1);
+		}
+		uwsgi_log("[docker] vassal %s is waiting for the first connection on %s\n", ui->name, docker_socket);
+		docker_wait_connection(ui, proxy_fd, proxy_attr_emperor);
+		uwsgi_log("[docker] connection on %s, spawning vassal %s\n", docker_socket, ui->name);
+	}
+
+	// do not hammer the daemon with a crashing vassal
+	docker_crash_backoff(ui->name);
+
 	// start connecting to the docker server in sync way
-	json_t *root = json_object();
+	docker_spawn_begin = uwsgi_micros();
+	docker_spawn_mark = docker_spawn_begin;
+
+	// without a tty, stdout and stderr are multiplexed in the attach stream
+	int tty = docker_attr_bool(ui, "docker-tty", 1);
+	uint64_t spec = docker_spec_hash(ui, argv);
+	// the instance of a sharded vassal needs the zerg socket
+	if (docker_shards.zerg_fd > -1) spec = docker_hash(spec, "zerg", 5);
+	char *docker_priority = vassal_attr_get(ui, "docker-priority");
+	char *container_id = NULL;
+	json_t *garbage = NULL;
+	json_t *root = NULL;
+	json_t *ports = NULL;
+
+	json_t *host_config = json_object();
+
+	// Volumes/Binds
+	json_t *binds = json_array();
+        if (vassal_attr_get_multi(ui, "docker-mount", docker_add_item_to_array, binds)) {
+                uwsgi_log("[docker] unable to build volumes mapping for vassal %s\n", ui->name);
+                exit(1);
+        }
+	// the binds of the emperor proxy (the zerg socket is in the same directory) are not part of the pool config
+	json_t *proxy_binds = json_array();
+	if (proxy_dir) {
+		char *dir_bind = uwsgi_concat3(proxy_dir, ":", DOCKER_PROXY_MOUNT);
+		json_array_append_new(proxy_binds, json_string(dir_bind));
+		free(dir_bind);
+	}
+	else {
+		char *proxy_bind = uwsgi_concat3(proxy_attr_emperor, ":", proxy_attr_docker);
+		json_array_append_new(proxy_binds, json_string(proxy_bind));
+		free(proxy_bind);
+	}
+	if (docker_shards.zerg_fd > -1 && !proxy_dir) {
+		char *zerg_bind = uwsgi_concat4(docker_shards.zerg_path, ":", proxy_attr_docker, ".zerg");
+		json_array_append_new(proxy_binds, json_string(zerg_bind));
+		free(zerg_bind);
+	}
+	if (!docker_pool_mount) json_array_extend(binds, proxy_binds);
+	// the instance reads the config from the same path (vassals without a file get it via the emperor proxy)
+	if (udocker.config_mount) {
+		char *config_path = uwsgi_expand_path(ui->name, strlen(ui->name), NULL);
+		if (config_path) {
+			char *config_bind = uwsgi_concat4(config_path, ":", config_path, ":ro");
+			json_array_append(binds, json_string(config_bind));
+			free(config_bind);
+			free(config_path);
+		}
+	}
+	json_object_set(host_config, "Binds", binds);
+
+	// Dns
+	json_t *dns = json_array();
+	if (vassal_attr_get_multi(ui, "docker-dns", docker_add_item_to_array, dns)) {
+                uwsgi_log("[docker] unable to build dns list for vassal %s\n", ui->name);
+                exit(1);
+        }
+	json_object_set(host_config, "Dns", dns);
+
+	// PortBindings (the exposed ports are their keys)
+	ports = json_object();
+        if (vassal_attr_get_multi(ui, "docker-port", docker_add_port, ports)) {
+                uwsgi_log("[docker] unable to build port mapping for vassal %s\n", ui->name);
+                exit(1);
+        }
+        if (json_object_set(host_config, "PortBindings", ports)) exit(1);
+
+	char *docker_network_mode = vassal_attr_get(ui, "docker-network-mode");
+	if (docker_network_mode) {
+                if (json_object_set(host_config, "NetworkMode", json_string(docker_network_mode))) exit(1);
+        }
+
+	// the stopped container of the vassal has the same spec, restart it
+	// without even building the create request
+	if (udocker.reuse) {
+		container_id = docker_registry_reusable(ui->name, spec);
+		if (container_id) {
+			uwsgi_log("[docker] reusing stopped container %s (%s)\n", container_id, ui->name);
+			docker_spawn_phase(DOCKER_SPAWN_BUILD);
+			docker_spawn_acquire(ui->name, docker_priority ? atoi(docker_priority) : 0);
+			docker_spawn_phase(DOCKER_SPAWN_QUEUE);
+			goto adopted;
+		}
+	}
+
+	root = json_object();
 	if (!root) exit(1);
 
 	if (json_object_set(root, "Image", json_string(image_attr))) exit(1);
 
 	if (json_object_set(root, "AttachStdin", json_true())) exit(1);
 	if (json_object_set(root, "OpenStdin", json_true())) exit(1);
-	if (json_object_set(root, "Tty", json_true())) exit(1);
+	if (json_object_set(root, "Tty", tty ? json_true() : json_false())) exit(1);
 	if (json_object_set(root, "AttachStdout", json_true())) exit(1);
 	if (json_object_set(root, "AttachStderr", json_true())) exit(1);
 
@@ -411,6 +1289,43 @@ static void docker_run(struct uwsgi_instance *ui, char **argv) {
 		if (json_object_set(root, "MemorySwap", json_integer(strtoul(docker_swap, NULL, 10)))) exit(1);
 	}
 
+	// cpu controls (Cpuset up to api 1.17, CpusetCpus later, unknown fields are ignored)
+	char *docker_cpuset = vassal_attr_get(ui, "docker-cpuset");
+	char *docker_cpuset_mems = vassal_attr_get(ui, "docker-cpuset-mems");
+	char placement_cpus[DOCKER_CPUSET_MAX * 4];
+	char placement_mems[sizeof(UMAX64_STR)+1];
+	if (!docker_cpuset && udocker.placement) {
+		char *docker_cpus = vassal_attr_get(ui, "docker-cpus");
+		uint64_t mask[DOCKER_CPUSET_WORDS];
+		int node = -1;
+		if (!docker_placement_assign(ui->name, docker_cpus ? atoi(docker_cpus) : 1, mask, &node)) {
+			docker_cpuset_format(mask, placement_cpus, sizeof(placement_cpus));
+			docker_cpuset = placement_cpus;
+			if (node > -1 && !docker_cpuset_mems) {
+				snprintf(placement_mems, sizeof(placement_mems), "%d", node);
+				docker_cpuset_mems = placement_mems;
+			}
+			uwsgi_log("[docker] vassal %s placed on cpus %s (node %d)\n", ui->name, placement_cpus, node);
+		}
+	}
+	if (docker_cpuset) {
+		if (json_object_set(root, "Cpuset", json_string(docker_cpuset))) exit(1);
+		if (json_object_set(root, "CpusetCpus", json_string(docker_cpuset))) exit(1);
+	}
+	if (docker_cpuset_mems) {
+		if (json_object_set(root, "CpusetMems", json_string(docker_cpuset_mems))) exit(1);
+	}
+
+	char *docker_cpu_shares = vassal_attr_get(ui, "docker-cpu-shares");
+	if (docker_cpu_shares) {
+		if (json_object_set(root, "CpuShares", json_integer(strtoul(docker_cpu_shares, NULL, 10)))) exit(1);
+	}
+
+	char *docker_cpu_quota = vassal_attr_get(ui, "docker-cpu-quota");
+	if (docker_cpu_quota) {
+		if (json_object_set(root, "CpuQuota", json_integer(strtoul(docker_cpu_quota, NULL, 10)))) exit(1);
+	}
+
 	char *docker_user = vassal_attr_get(ui, "docker-user");
         if (docker_user) {
                 if (json_object_set(root, "User", json_string(docker_user))) exit(1);
@@ -425,14 +1340,21 @@ static void docker_run(struct uwsgi_instance *ui, char **argv) {
 	char *env_proxy = uwsgi_concat2("UWSGI_EMPEROR_PROXY=", proxy_attr_docker);
 	json_array_append(env, json_string(env_proxy));
 	free(env_proxy);
+	// uWSGI maps UWSGI_* variables to options
+	if (docker_shards.zerg_fd > -1) {
+		char *env_zerg = uwsgi_concat3("UWSGI_ZERG=", proxy_attr_docker, ".zerg");
+		json_array_append(env, json_string(env_zerg));
+		free(env_zerg);
+	}
 	if (json_object_set(root, "Env", env)) exit(1);
 
-	json_t *ports = json_object();
-        if (vassal_attr_get_multi(ui, "docker-port", docker_expose_port, ports)) {
-                uwsgi_log("[docker] unable to build port mapping for vassal %s\n", ui->name);
-                exit(1);
-        }
-        if (json_object_set(root, "ExposedPorts", ports)) exit(1);
+	json_t *exposed_ports = json_object();
+	const char *port;
+	json_t *port_map_list;
+	json_object_foreach(ports, port, port_map_list) {
+		json_object_set_new(exposed_ports, port, json_object());
+	}
+        if (json_object_set_new(root, "ExposedPorts", exposed_ports)) exit(1);
 
 	json_t *cmd = json_array();
 	if (!cmd) exit(1);
@@ -445,13 +1367,97 @@ static void docker_run(struct uwsgi_instance *ui, char **argv) {
 
 	if (json_object_set(root, "Cmd", cmd)) exit(1);
 
-	char *container_id = NULL;
-	json_t *garbage = NULL;
+	if (hostconfig) {
+		// resources moved to HostConfig in api 1.18, older daemons read them from the root object
+		static char *resources[] = {"Memory", "MemorySwap", "CpusetCpus", "CpusetMems", "CpuShares", "CpuQuota", NULL};
+		char **resource = resources;
+		while(*resource) {
+			json_t *value = json_object_get(root, *resource);
+			if (value) json_object_set(host_config, *resource, value);
+			resource++;
+		}
+		if (json_object_set(root, "HostConfig", host_config)) exit(1);
+	}
+
+	// pool containers are shared by vassals with the same create request,
+	// its hash is the spec (with the legacy api binds, ports and dns are applied on start,
+	// otherwise they are part of the request, without the binds of the emperor proxy)
+	uint64_t config = spec;
+	if (udocker.pool) {
+		char *body = json_dumps(root, JSON_COMPACT|JSON_SORT_KEYS);
+		if (!body) exit(1);
+		config = docker_hash(0xcbf29ce484222325ULL, body, strlen(body));
+		free(body);
+	}
+
+	// the spec hash allows recognizing our containers after an Emperor restart
+	char env_spec[sizeof(DOCKER_SPEC_ENV) + 16];
+	snprintf(env_spec, sizeof(env_spec), DOCKER_SPEC_ENV "%016llx", (unsigned long long) config);
+	json_array_append(env, json_string(env_spec));
+
+	docker_spawn_phase(DOCKER_SPAWN_BUILD);
+
+	// wait for our turn (vassals with higher priority go first)
+	docker_spawn_acquire(ui->name, docker_priority ? atoi(docker_priority) : 0);
+	docker_spawn_phase(DOCKER_SPAWN_QUEUE);
+
+	// the name of the new container
+	char *create_name = ui->name;
+	if (udocker.rolling && socket_fd > -1) {
+		docker_rolling_check(ui);
+		if (docker_rolling_old) create_name = docker_rolling_name;
+	}
 
+	// a running container is replaced, not adopted
+	if (udocker.adopt && !docker_rolling_old) {
+		container_id = docker_adopt(ui, image_attr, env_spec);
+		if (container_id) goto adopted;
+	}
+
+	// if the registry knows about a container with the same name, destroy it
+	// now instead of waiting for a 409 from the daemon
+	char registry_id[65];
+	if (!docker_rolling_old && !docker_registry_get(ui->name, registry_id, NULL)) {
+		if (docker_destroy(ui->name, NULL)) {
+			exit(1);
+		}
+	}
+
+	if (udocker.pool) {
+		docker_pool_key = config;
+		docker_pool_body = docker_pool_mount ? json_deep_copy(root) : json_incref(root);
+		char *pool_name = NULL;
+		container_id = docker_pool_get(create_name, config, &pool_name);
+		if (container_id && docker_pool_mount) {
+			// the warm container looks for the emperor proxy in its directory
+			docker_pool_dir = docker_pool_path(pool_name);
+			close(proxy_fd);
+			unlink(proxy_attr_emperor);
+			proxy_attr_emperor = uwsgi_concat3(docker_pool_dir, "/", DOCKER_PROXY_SOCKET);
+			proxy_fd = bind_to_unix(proxy_attr_emperor, uwsgi.listen_queue, uwsgi.chmod_socket, 0);
+			if (proxy_fd < 0) exit(1);
+			if (docker_shards.zerg_fd > -1) {
+				close(docker_shards.zerg_fd);
+				unlink(docker_shards.zerg_path);
+				docker_shards.zerg_path = uwsgi_concat2(proxy_attr_emperor, ".zerg");
+				docker_shards.zerg_fd = bind_to_unix(docker_shards.zerg_path, uwsgi.listen_queue, uwsgi.chmod_socket, 0);
+				if (docker_shards.zerg_fd < 0) exit(1);
+				uwsgi_socket_nb(docker_shards.zerg_fd);
+			}
+		}
+		if (pool_name) free(pool_name);
+		if (container_id) goto adopted;
+		// our own container
+		if (docker_pool_mount) json_array_extend(binds, proxy_binds);
+	}
+	json_decref(proxy_binds);
+
+	int attempt = 0;
+	int image_retried = 0;
 	for(;;) {
 		long http_status = 0;
 
-		char *url = uwsgi_concat2("/containers/create?name=", ui->name);
+		char *url = uwsgi_concat2("/containers/create?name=", create_name);
 		if (udocker.debug) {
 			uwsgi_log("[docker-debug] POST %s\n%s\n", url, json_dumps(root, 0));
 		}
@@ -461,17 +1467,34 @@ static void docker_run(struct uwsgi_instance *ui, char **argv) {
 		// if the status code is 409 (Conflict), the container is already running,
 		// destroy it and retry
 		if (http_status == 409) {
+			if (response) json_decref(response);
+			// someone else keeps re-creating it
+			if (attempt++ > udocker.spawn_retries) {
+				uwsgi_log("[docker] unable to create container for vassal %s (name conflict)\n", ui->name);
+				exit(1);
+			}
 			// if we cannot destroy the container
 			// we better to quit
-			if (docker_destroy(ui->name, NULL)) {
+			if (docker_destroy(create_name, NULL)) {
 				exit(1);
 			}
 			// re-create it
-			if (response) json_decref(response);
 			continue;
 		}
 
+		// the image has been removed after we checked it
+		if (http_status == 404 && udocker.images && !image_retried) {
+			if (response) json_decref(response);
+			image_retried = 1;
+			docker_image_forget(image_attr);
+			if (!docker_image_ensure(image_attr)) continue;
+			uwsgi_log("[docker] image %s is not available for vassal %s\n", image_attr, ui->name);
+			exit(1);
+		}
+
 		if (http_status != 201) {
+			if (response) json_decref(response);
+			if (docker_spawn_backoff(ui->name, attempt++, http_status)) continue;
 			uwsgi_log("[docker] unable to create container for vassal %s\n", ui->name);
                         exit(1);
 		}
@@ -498,6 +1521,11 @@ static void docker_run(struct uwsgi_instance *ui, char **argv) {
 		break;
 	}
 
+adopted:
+	docker_registry_set(ui->name, container_id, DOCKER_STATE_CREATED, getpid());
+	// a warm container looks for the emperor proxy in its pool directory (removed after the handoff), it is never reused
+	docker_registry_spec(ui->name, docker_pool_dir ? 0 : spec);
+
 	char *docker_cidfile = vassal_attr_get(ui, "docker-cidfile");
 	if (docker_cidfile) {
 		FILE *cidfile = fopen(docker_cidfile, "w");
@@ -512,57 +1540,36 @@ static void docker_run(struct uwsgi_instance *ui, char **argv) {
 		fclose(cidfile);
 	}
 
-	// free json object
-	json_decref(root);
-	// and now we sart the docker instance
-	root = json_object();
+	docker_spawn_phase(DOCKER_SPAWN_CREATE);
 
-	// Volumes/Binds
-	json_t *binds = json_array();
-        if (vassal_attr_get_multi(ui, "docker-mount", docker_add_item_to_array, binds)) {
-                uwsgi_log("[docker] unable to build volumes mapping for vassal %s\n", ui->name);
-                exit(1);
-        }
-	char *proxy_bind = uwsgi_concat3(proxy_attr_emperor, ":", proxy_attr_docker);
-	json_array_append(binds, json_string(proxy_bind));
-	free(proxy_bind);
-	json_object_set(root, "Binds", binds);
-
-	// Dns
-	json_t *dns = json_array();
-	if (vassal_attr_get_multi(ui, "docker-dns", docker_add_item_to_array, dns)) {
-                uwsgi_log("[docker] unable to build dns list for vassal %s\n", ui->name);
-                exit(1);
-        }
-	json_object_set(root, "Dns", dns);
-
-
-	// PortBindings
-	ports = json_object();
-        if (vassal_attr_get_multi(ui, "docker-port", docker_add_port, ports)) {
-                uwsgi_log("[docker] unable to build port mapping for vassal %s\n", ui->name);
-                exit(1);
-        }
-        if (json_object_set(root, "PortBindings", ports)) exit(1);
-
-	char *docker_network_mode = vassal_attr_get(ui, "docker-network-mode");
-	if (docker_network_mode) {
-                if (json_object_set(root, "NetworkMode", json_string(docker_network_mode))) exit(1);
-        }
+	// free json object
+	if (root) json_decref(root);
+	// and now we sart the docker instance (the legacy api wants the host settings now)
+	root = hostconfig ? NULL : host_config;
 
-	long http_status = 0;
 	char *url = uwsgi_concat3("/containers/", container_id, "/start");
 	if (udocker.debug) {
-		uwsgi_log("[docker-debug] POST %s\n%s\n", url, json_dumps(root, 0));
+		uwsgi_log("[docker-debug] POST %s\n%s\n", url, root ? json_dumps(root, 0) : "");
 	}
-	json_t *response = docker_json("POST", url, root, &http_status);
-	free(url);
-	if (http_status != 204) {
+	long http_status = 0;
+	attempt = 0;
+	for(;;) {
+		http_status = 0;
+		json_t *response = docker_json("POST", url, root, &http_status);
+		if (response) json_decref(response);
+		if (http_status == 204) break;
+		// a timed out request could have started it anyway
+		if (http_status == 304 && attempt > 0) break;
+		if (docker_spawn_backoff(ui->name, attempt++, http_status)) continue;
 		uwsgi_log("[docker] unable to start container %s (%s)\n", container_id, ui->name);
+		// a reused container could have been removed in the meantime
+		if (http_status == 404) docker_registry_state(ui->name, DOCKER_STATE_DESTROYED);
 		exit(1);
 	}
+	free(url);
 
-	if (response) json_decref(response);
+	// let the next vassal talk to the daemon
+	docker_spawn_release();
 
 	// if garbage is defined, container_id is part of a json object
 	// this may seems useless, but we want to have the minimal impact
@@ -573,39 +1580,101 @@ static void docker_run(struct uwsgi_instance *ui, char **argv) {
 	}
 
 	uwsgi_log("[docker] started %s (%d)\n", container_id, http_status);
+	if (udocker.debug) docker_curl_stats();
 
 	// free json object
-	json_decref(root);
+	json_decref(host_config);
 
 	// now attach to stdout and stderr (read: pty)
-	docker_attach(ui, proxy_fd, proxy_attr_emperor, container_id, socket_fd);
+	docker_attach(ui, proxy_fd, proxy_attr_emperor, container_id, socket_fd, tty);
 	// never here ?
 	exit(0);
 }
 
+// create a directory for the emperor proxy sockets (fixing the mode of an existing one), returns 0 on success.
+// With chmod-socket the instance could run as another user (docker-user): it must be able to traverse it
+int docker_proxy_mkdir(char *path) {
+	mode_t mode = uwsgi.chmod_socket ? S_IRWXU|S_IXGRP|S_IXOTH : S_IRWXU;
+	if (!mkdir(path, mode)) {
+		// the umask could have dropped the execute bits
+		if (uwsgi.chmod_socket && chmod(path, mode)) goto error;
+		return 0;
+	}
+	if (errno != EEXIST) goto error;
+	struct stat st;
+	if (stat(path, &st) || !S_ISDIR(st.st_mode)) goto error;
+	if ((st.st_mode & 0777) != mode && chmod(path, mode)) goto error;
+	return 0;
+error:
+	uwsgi_error_open(path);
+	return -1;
+}
+
+// create the proxy dir and remove the sockets left by a previous Emperor (the vassal directories are kept)
+static void docker_proxy_dir_init() {
+	if (docker_proxy_mkdir(udocker.proxy_dir)) exit(1);
+	DIR *dir = opendir(udocker.proxy_dir);
+	if (!dir) {
+		uwsgi_error_open(udocker.proxy_dir);
+		exit(1);
+	}
+	int removed = 0;
+	struct dirent *de;
+	while((de = readdir(dir))) {
+		if (de->d_name[0] == '.') continue;
+		char *path = uwsgi_concat4(udocker.proxy_dir, "/", de->d_name, "/" DOCKER_PROXY_SOCKET);
+		if (!unlink(path)) removed++;
+		char *zerg_path = uwsgi_concat2(path, ".zerg");
+		if (!unlink(zerg_path)) removed++;
+		free(zerg_path);
+		free(path);
+	}
+	closedir(dir);
+	if (removed) uwsgi_log("[docker] removed %d stale sockets from %s\n", removed, udocker.proxy_dir);
+}
+
 static void docker_setup(int (*start)(void *), char **argv) {
 	if (udocker.emperor_required) udocker.emperor = 1;
 	if (udocker.emperor) {
-		// TODO this should be an option
-		uwsgi.emperor_force_config_pipe = 1;
-		uwsgi_string_new_list(&uwsgi.emperor_collect_attributes, "docker-proxy");
-		uwsgi_string_new_list(&uwsgi.emperor_collect_attributes, "docker-image");
-		uwsgi_string_new_list(&uwsgi.emperor_collect_attributes, "docker-port");
-		uwsgi_string_new_list(&uwsgi.emperor_collect_attributes, "docker-socket");
-		uwsgi_string_new_list(&uwsgi.emperor_collect_attributes, "docker-workdir");
-		uwsgi_string_new_list(&uwsgi.emperor_collect_attributes, "docker-hostname");
-		uwsgi_string_new_list(&uwsgi.emperor_collect_attributes, "docker-memory");
-		uwsgi_string_new_list(&uwsgi.emperor_collect_attributes, "docker-swap");
-		uwsgi_string_new_list(&uwsgi.emperor_collect_attributes, "docker-mount");
-		uwsgi_string_new_list(&uwsgi.emperor_collect_attributes, "docker-dns");
-		uwsgi_string_new_list(&uwsgi.emperor_collect_attributes, "docker-env");
-		uwsgi_string_new_list(&uwsgi.emperor_collect_attributes, "docker-user");
-		uwsgi_string_new_list(&uwsgi.emperor_collect_attributes, "docker-cidfile");
-		uwsgi_string_new_list(&uwsgi.emperor_collect_attributes, "docker-network-mode");
+		// mounted configs are passed by path
+		if (!udocker.config_mount) uwsgi.emperor_force_config_pipe = 1;
+		struct uwsgi_docker_attribute *attr = docker_attributes;
+		while(attr->name) {
+			uwsgi_string_new_list(&uwsgi.emperor_collect_attributes, attr->name);
+			attr++;
+		}
 	}
 	if (!udocker.socket) {
 		udocker.socket = DOCKER_SOCKET;
 	}
+	if (udocker.emperor && udocker.proxy_dir) docker_proxy_dir_init();
+	// negotiate the api version once, the bridges inherit it
+	if (udocker.emperor) {
+		docker_api_version();
+		// do not leak the connection to the bridges
+		if (udocker.multi) {
+			curl_multi_cleanup(udocker.multi);
+			udocker.multi = NULL;
+		}
+	}
+	if (!udocker.spawn_retries) udocker.spawn_retries = 3;
+	if (!udocker.spawn_backoff) udocker.spawn_backoff = 100;
+	if (!udocker.log_burst) udocker.log_burst = udocker.log_rate;
+	if (!udocker.rolling_grace) udocker.rolling_grace = 30;
+	// the spawn scheduler lives in the registry shared area
+	// the warm pool (and the containers on Emperor death) are destroyed by the monitor
+	// reused containers are found by the registry, cpuset assignments live in it
+	int monitor = udocker.events || udocker.shared_bridge || udocker.stats || udocker.pool || udocker.teardown_concurrency || udocker.rolling || udocker.reuse || udocker.metrics;
+	// the image table and the log rings live next to it, crash streaks in the slots
+	if (udocker.emperor && (monitor || udocker.spawn_concurrency || udocker.placement || udocker.pull || udocker.crash_backoff || udocker.log_ring)) {
+		docker_registry_init();
+		if (udocker.crash_backoff) docker_crash_init();
+		if (udocker.placement) docker_placement_init();
+		if (udocker.pull) docker_image_init();
+		if (udocker.pool) docker_pool_init();
+		if (udocker.log_ring) docker_log_init();
+		if (monitor) docker_monitor_start();
+	}
 }
 
 struct uwsgi_plugin docker_plugin = {
@@ -0,0 +1,334 @@
+#include <uwsgi.h>
+#include <curl/curl.h>
+#include <jansson.h>
+#include <malloc.h>
+
+#define DOCKER_SOCKET "/var/run/docker.sock"
+// used when the daemon cannot tell us its api version (container settings are passed on start)
+#define DOCKER_API "1.14"
+// /containers/create accepts HostConfig (and start without a body) since api 1.15
+#define DOCKER_API_HOSTCONFIG 15
+
+#define DOCKER_REGISTRY_SIZE 4096
+// seconds before the slot of a destroyed container can be taken by another name
+#define DOCKER_REGISTRY_GRACE 60
+// default number of log rings (--docker-log-rings)
+#define DOCKER_LOG_RINGS 64
+
+// environment variable storing the spec hash of a container
+#define DOCKER_SPEC_ENV "UWSGI_DOCKER_SPEC="
+
+// state of a container as reported by the docker events stream
+#define DOCKER_STATE_UNKNOWN 0
+#define DOCKER_STATE_CREATED 1
+#define DOCKER_STATE_RUNNING 2
+#define DOCKER_STATE_STOPPED 3
+#define DOCKER_STATE_DEAD 4
+#define DOCKER_STATE_DESTROYED 5
+#define DOCKER_STATE_PAUSED 6
+
+// spawn phases
+#define DOCKER_SPAWN_BUILD 0
+#define DOCKER_SPAWN_CREATE 1
+#define DOCKER_SPAWN_START 2
+#define DOCKER_SPAWN_PROXY 3
+#define DOCKER_SPAWN_HANDOFF 4
+#define DOCKER_SPAWN_QUEUE 5
+#define DOCKER_SPAWN_TOTAL 6
+#define DOCKER_SPAWN_PHASES 7
+
+// spawn scheduler state of a vassal
+#define DOCKER_SCHED_NONE 0
+#define DOCKER_SCHED_WAITING 1
+#define DOCKER_SCHED_GRANTED 2
+
+// warm pool
+#define DOCKER_POOL_SLOTS 1024
+#define DOCKER_POOL_EMPTY 0
+#define DOCKER_POOL_CREATING 1
+#define DOCKER_POOL_READY 2
+// --docker-proxy-dir: the directory of a vassal (in the proxy dir) is mounted here
+#define DOCKER_PROXY_MOUNT "/uwsgi-docker"
+#define DOCKER_PROXY_SOCKET "proxy.sock"
+// the emperor proxy path in pool containers (they are shared by vassals)
+#define DOCKER_POOL_PROXY DOCKER_PROXY_MOUNT "/" DOCKER_PROXY_SOCKET
+
+// image table (--docker-pull)
+#define DOCKER_IMAGE_SLOTS 256
+#define DOCKER_IMAGE_NONE 0
+#define DOCKER_IMAGE_PULLING 1
+#define DOCKER_IMAGE_READY 2
+#define DOCKER_IMAGE_FAILED 3
+
+// cpuset placement
+#define DOCKER_CPUSET_MAX 512
+#define DOCKER_CPUSET_WORDS (DOCKER_CPUSET_MAX / 64)
+#define DOCKER_NUMA_NODES 64
+
+// log2 buckets of microseconds
+#define DOCKER_HISTOGRAM_BUCKETS 40
+
+// sent by the monitor to a bridge whose container died
+#define DOCKER_DEATH_SIGNAL SIGUSR2
+
+// max number of vassal sockets (uWSGI zerg clients take up to 8 sockets)
+#define DOCKER_SHARDS_MAX 8
+
+struct uwsgi_docker_container {
+	char name[0xff];
+	char id[65];
+	int state;
+	int oom;
+	// the bridge managing the container (if any)
+	pid_t bridge;
+	// start time of the bridge (pids are recycled)
+	uint64_t bridge_start;
+	uint64_t updated;
+	// forwarded logs (0 -> stdout, 1 -> stderr)
+	uint64_t log_bytes[2];
+	uint64_t log_lines[2];
+	// bytes over the rate limit (not forwarded)
+	uint64_t log_dropped[2];
+	// duration (in microseconds) of the phases of the last spawn
+	uint64_t spawn[DOCKER_SPAWN_PHASES];
+	uint64_t spawns;
+	// spec hash of the container (docker-reuse)
+	uint64_t spec;
+	// idle pauses (docker-pause) and wake up time (in microseconds)
+	uint64_t pauses;
+	uint64_t wakes;
+	uint64_t wake_time;
+	uint64_t wake_last;
+	// the vassal sockets watched by docker-idle and docker-pause (tcp addresses and ports or hashes of the unix paths),
+	// the monitor counts their connections for the bridge
+	int idle_ports[DOCKER_SHARDS_MAX];
+	unsigned char idle_addrs[DOCKER_SHARDS_MAX][16];
+	uint32_t idle_paths[DOCKER_SHARDS_MAX];
+	int idle_sockets;
+	int idle_connections;
+	uint64_t idle_scanned;
+	// spawn scheduler
+	int sched_state;
+	int sched_priority;
+	uint64_t sched_ticket;
+	pid_t sched_pid;
+	// crash loop detection (survive the containers of the vassal)
+	uint64_t crashes;
+	uint64_t crash_streak;
+	uint64_t crash_until;
+	uint64_t crash_lifetime;
+	int crash_exit_code;
+	// cpuset placement (--docker-placement)
+	int placed;
+	int cpuset_node;
+	uint64_t cpuset[DOCKER_CPUSET_WORDS];
+	// the log ring of the vassal (index + 1, 0 if none)
+	int log_ring;
+	// next slot (+ 1) with the same id hash, events are mapped to slots by id
+	uint64_t id_next;
+};
+
+// a created (never started) container, waiting for a vassal with the same config
+struct uwsgi_docker_pool {
+	uint64_t key;
+	int state;
+	char id[65];
+	char name[64];
+};
+
+// an image checked (or pulled) by a bridge
+struct uwsgi_docker_image {
+	char name[0xff];
+	int state;
+	// the bridge checking (or pulling) it
+	pid_t pid;
+	int pull;
+};
+
+// this area is allocated in shared memory before the Emperor spawns
+// vassals, so bridges and the monitor see the same registry
+struct uwsgi_docker_shared {
+	pthread_mutex_t lock;
+	// set by the monitor once the registry has been populated
+	int ready;
+	pid_t monitor;
+	uint64_t events;
+	// spawn phases of all of the vassals
+	uint64_t spawn_histogram[DOCKER_SPAWN_PHASES][DOCKER_HISTOGRAM_BUCKETS];
+	// spawn scheduler (protected by the lock)
+	pthread_cond_t sched_cond;
+	uint64_t sched_running;
+	uint64_t sched_waiting;
+	uint64_t sched_tickets;
+	uint64_t sched_reaped;
+	uint64_t sched_retries;
+	uint64_t pool_counter;
+	uint64_t slots;
+	// followed by the heads (slot + 1) of the id chains
+	struct uwsgi_docker_container containers[];
+};
+
+// the cpus of each NUMA node (read by the Emperor)
+struct docker_topology {
+	int nodes;
+	// -1 without NUMA support
+	int node[DOCKER_NUMA_NODES];
+	uint64_t cpus[DOCKER_NUMA_NODES][DOCKER_CPUSET_WORDS];
+};
+
+struct uwsgi_docker {
+	int emperor;
+	int debug;
+	int emperor_required;
+	int no_keepalive;
+	int adopt;
+	char *socket;
+	char *vassal_socket_dir;
+	// per-Emperor directory (on tmpfs) for the emperor proxy sockets
+	char *proxy_dir;
+	// mount the vassal config instead of piping it
+	int config_mount;
+	// api version of the daemon (the minor of 1.x), negotiated via /version unless forced
+	char *api;
+	int api_version;
+	// "/v1.<n>" once the version is known (the unversioned paths get the latest api of the daemon)
+	char api_prefix[16];
+	// per-process libcurl multi handle (and its connection cache)
+	pid_t curl_pid;
+	CURLM *multi;
+	struct curl_slist *headers;
+	uint64_t requests;
+	uint64_t connections;
+	uint64_t pending;
+	// container registry
+	int events;
+	int registry_size;
+	struct uwsgi_docker_shared *shared;
+	// the monitor dies when this pipe is closed
+	int monitor_pipe[2];
+	// bridges hand attach streams to the monitor
+	int shared_bridge;
+	int monitor_channel[2];
+	char *stats;
+	// spawn scheduler
+	int spawn_concurrency;
+	int spawn_retries;
+	int spawn_backoff;
+	// warm pool (protected by the registry lock)
+	int pool;
+	// "<pid namespace>-<Emperor pid>-<Emperor start time>", the owner of the warm containers
+	char pool_owner[48];
+	struct uwsgi_docker_pool *pool_entries;
+	// teardown
+	int force_remove;
+	int teardown_concurrency;
+	int rolling;
+	int rolling_grace;
+	// restart stopped containers with the same spec
+	int reuse;
+	// resource usage of the containers (collected by the monitor)
+	int metrics;
+	// cpuset placement
+	int placement;
+	struct docker_topology topology;
+	// log rate limit (bytes per second) and rings (kilobytes per vassal, given on demand)
+	int log_rate;
+	int log_burst;
+	int log_ring;
+	int log_rings_max;
+	uint64_t log_ring_size;
+	char *log_rings;
+	// crash loop backoff (in milliseconds)
+	int crash_backoff;
+	int crash_backoff_max;
+	int crash_window;
+	int crash_keep;
+	// image readiness (protected by the registry lock)
+	int pull;
+	int pull_concurrency;
+	int pull_timeout;
+	struct uwsgi_docker_image *images;
+};
+
+typedef void (*docker_request_cb)(void *, long, json_t *);
+int docker_request(char *, char *, json_t *, int, docker_request_cb, void *);
+void docker_requests_run(void);
+json_t *docker_json(char *, char *, json_t *, long *);
+json_t *docker_inspect(char *);
+int docker_destroy(char *, char *);
+char *docker_container_id(char *);
+int docker_api_version(void);
+void docker_curl_stats(void);
+
+void docker_registry_init(void);
+int docker_registry_get(char *, char *, int *);
+void docker_registry_set(char *, char *, int, pid_t);
+void docker_registry_state(char *, int);
+struct uwsgi_docker_container *docker_registry_lookup(char *);
+struct uwsgi_docker_container *docker_registry_reserve(char *);
+void docker_registry_spec(char *, uint64_t);
+char *docker_registry_reusable(char *, uint64_t);
+uint64_t docker_pid_start(pid_t);
+int docker_bridge_alive(pid_t, uint64_t);
+void docker_monitor_start(void);
+int docker_monitor_attach(char *, char *, int, int, int *);
+uint64_t docker_monitor_streams(void);
+json_t *docker_monitor_metrics(char *);
+int docker_monitor_socket(char *, char *, int);
+void docker_monitor_idle(struct uwsgi_docker_container *, int *, unsigned char (*)[16], char **, int);
+int docker_proc_tcp_parse(char *, unsigned char *, int *, int *);
+void docker_shared_lock(void);
+void docker_shared_unlock(void);
+int docker_send_fds(int, char *, size_t, int *, int);
+int docker_recv_fds(int, char *, size_t, int *, int);
+
+char *docker_stats_body(void);
+void docker_spawn_record(char *, uint64_t *);
+
+void docker_spawn_acquire(char *, int);
+void docker_spawn_release(void);
+int docker_spawn_backoff(char *, int, long);
+
+void docker_pool_init(void);
+char *docker_pool_get(char *, uint64_t, char **);
+char *docker_pool_path(char *);
+int docker_proxy_mkdir(char *);
+void docker_pool_refill(char *, uint64_t, json_t *, int);
+void docker_pool_refill_async(char *, uint64_t, json_t *, int);
+int docker_pool_collect(char **);
+void docker_pool_cleanup(void);
+
+int docker_teardown(char **, int);
+
+void docker_crash_init(void);
+int docker_crash_record(char *, char *, uint64_t);
+void docker_crash_backoff(char *);
+int docker_crash_keep(char *, char *);
+json_t *docker_crash_json(struct uwsgi_docker_container *);
+
+void docker_image_init(void);
+int docker_image_ensure(char *);
+void docker_image_forget(char *);
+json_t *docker_image_json(void);
+
+void docker_placement_init(void);
+int docker_placement_assign(char *, int, uint64_t *, int *);
+void docker_placement_adopt(char *, char *);
+void docker_cpuset_format(uint64_t *, char *, size_t);
+json_t *docker_placement_json(void);
+
+struct docker_log;
+void docker_log_init(void);
+json_t *docker_log_tail(struct uwsgi_docker_container *);
+void docker_log_release(struct uwsgi_docker_container *);
+struct docker_log *docker_log_new(int, int, int, struct uwsgi_docker_container *, int);
+int docker_log_read(struct docker_log *, int);
+void docker_log_destroy(struct docker_log *);
+
+struct docker_metrics;
+struct docker_metrics *docker_metrics_new(void);
+int docker_metrics_connect(void);
+int docker_metrics_request(struct docker_metrics *, int, char *);
+int docker_metrics_read(struct docker_metrics *, int);
+json_t *docker_metrics_json(struct docker_metrics *);
+void docker_metrics_destroy(struct docker_metrics *);
@@ -0,0 +1,193 @@
+#include "docker.h"
+
+extern struct uwsgi_server uwsgi;
+extern struct uwsgi_docker udocker;
+
+/*
+
+	Image readiness (--docker-pull).
+
+	Before waiting for connections (docker-lazy) or creating its container, a bridge checks the image
+	of its vassal (GET /images/<name>/json) and pulls it when missing (POST /images/create).
+
+	The image table (in shared memory, protected by the registry lock) remembers the images found
+	or pulled by the bridges, so each image is checked once. Only one bridge checks (and pulls) a given image,
+	the other vassals of the same image wait for it instead of failing their create request.
+	At most --docker-pull-concurrency images are pulled at the same time.
+
+	An image removed from the daemon is forgotten when the create request of a vassal gets a 404.
+
+*/
+
+void docker_image_init() {
+	udocker.images = uwsgi_calloc_shared(sizeof(struct uwsgi_docker_image) * DOCKER_IMAGE_SLOTS);
+	if (!udocker.pull_concurrency) udocker.pull_concurrency = 4;
+	if (!udocker.pull_timeout) udocker.pull_timeout = 600;
+}
+
+// must be called with the lock held
+static struct uwsgi_docker_image *docker_image_slot(char *name, int create) {
+	struct uwsgi_docker_image *free_slot = NULL;
+	int i;
+	for(i=0;i<DOCKER_IMAGE_SLOTS;i++) {
+		struct uwsgi_docker_image *di = &udocker.images[i];
+		if (di->state == DOCKER_IMAGE_NONE) {
+			if (!free_slot) free_slot = di;
+			continue;
+		}
+		if (!strcmp(di->name, name)) return di;
+	}
+	if (!create || !free_slot) return NULL;
+	strcpy(free_slot->name, name);
+	return free_slot;
+}
+
+// wait for a change in the table, must be called with the lock held
+static void docker_image_wait() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec++;
+	if (pthread_cond_timedwait(&udocker.shared->sched_cond, &udocker.shared->lock, &ts) == EOWNERDEAD) {
+		pthread_mutex_consistent(&udocker.shared->lock);
+	}
+}
+
+static int docker_image_exists(char *name) {
+	long http_status = 0;
+	char *url = uwsgi_concat3("/images/", name, "/json");
+	json_t *response = docker_json("GET", url, NULL, &http_status);
+	free(url);
+	if (response) json_decref(response);
+	return http_status == 200;
+}
+
+// number of pulls in progress (bridges dying during a pull are skipped), must be called with the lock held
+static int docker_image_pulls() {
+	int i, pulls = 0;
+	for(i=0;i<DOCKER_IMAGE_SLOTS;i++) {
+		struct uwsgi_docker_image *di = &udocker.images[i];
+		if (di->state != DOCKER_IMAGE_PULLING || !di->pull) continue;
+		if (kill(di->pid, 0) && errno == ESRCH) continue;
+		pulls++;
+	}
+	return pulls;
+}
+
+static void docker_image_pulled(void *data, long http_status, json_t *response) {
+	*((long *) data) = http_status;
+}
+
+// the response is a stream of progress messages (errors included), so the image is checked again after the pull
+static int docker_image_pull(struct uwsgi_docker_image *di, char *name) {
+	// name:tag (the colon of a registry port is followed by a slash), a name@digest reference
+	// is passed as is (the digest contains a colon too)
+	char *image = uwsgi_str(name);
+	char *tag = strchr(image, '@') ? NULL : strrchr(image, ':');
+	if (tag && strchr(tag, '/')) tag = NULL;
+	if (tag) *tag++ = 0;
+	char *url = tag ? uwsgi_concat4("/images/create?fromImage=", image, "&tag=", tag) : uwsgi_concat2("/images/create?fromImage=", image);
+	free(image);
+
+	// wait for a pull turn
+	docker_shared_lock();
+	while(docker_image_pulls() >= udocker.pull_concurrency) {
+		docker_image_wait();
+	}
+	di->pull = 1;
+	docker_shared_unlock();
+
+	uwsgi_log("[docker] pulling image %s ...\n", name);
+	uint64_t now = uwsgi_micros();
+	long http_status = 0;
+	if (!docker_request("POST", url, NULL, udocker.pull_timeout, docker_image_pulled, &http_status)) {
+		docker_requests_run();
+	}
+	free(url);
+
+	docker_shared_lock();
+	di->pull = 0;
+	pthread_cond_broadcast(&udocker.shared->sched_cond);
+	docker_shared_unlock();
+
+	if (http_status != 200 || !docker_image_exists(name)) {
+		uwsgi_log("[docker] unable to pull image %s\n", name);
+		return -1;
+	}
+	uwsgi_log("[docker] image %s pulled in %llums\n", name, (unsigned long long) ((uwsgi_micros() - now) / 1000));
+	return 0;
+}
+
+// ensure the image is available (pulling it if required), returns 0 when the image is ready
+int docker_image_ensure(char *name) {
+	if (!udocker.images) return 0;
+	// the create request will tell
+	if (strlen(name) >= sizeof(udocker.images[0].name)) return 0;
+
+	int waited = 0;
+	docker_shared_lock();
+	struct uwsgi_docker_image *di = NULL;
+	for(;;) {
+		di = docker_image_slot(name, 1);
+		if (!di) {
+			docker_shared_unlock();
+			uwsgi_log("[docker] the image table is full, %s is not checked\n", name);
+			return 0;
+		}
+		if (di->state == DOCKER_IMAGE_READY) {
+			docker_shared_unlock();
+			return 0;
+		}
+		// the pull we waited for failed (the next spawns will try again)
+		if (di->state == DOCKER_IMAGE_FAILED && waited) {
+			docker_shared_unlock();
+			return -1;
+		}
+		if (di->state != DOCKER_IMAGE_PULLING) break;
+		// the bridge pulling the image died
+		if (kill(di->pid, 0) && errno == ESRCH) break;
+		if (!waited) uwsgi_log("[docker] waiting for image %s (pulled by bridge %d)\n", name, (int) di->pid);
+		waited = 1;
+		docker_image_wait();
+	}
+	di->state = DOCKER_IMAGE_PULLING;
+	di->pid = getpid();
+	docker_shared_unlock();
+
+	int ret = 0;
+	if (!docker_image_exists(name)) ret = docker_image_pull(di, name);
+
+	docker_shared_lock();
+	di->state = ret ? DOCKER_IMAGE_FAILED : DOCKER_IMAGE_READY;
+	di->pid = 0;
+	di->pull = 0;
+	pthread_cond_broadcast(&udocker.shared->sched_cond);
+	docker_shared_unlock();
+	return ret;
+}
+
+// the image has been removed from the daemon
+void docker_image_forget(char *name) {
+	if (!udocker.images) return;
+	docker_shared_lock();
+	struct uwsgi_docker_image *di = docker_image_slot(name, 0);
+	if (di && di->state != DOCKER_IMAGE_PULLING) di->state = DOCKER_IMAGE_NONE;
+	docker_shared_unlock();
+}
+
+// the image table for the stats server
+json_t *docker_image_json() {
+	static char *states[] = {"none", "pulling", "ready", "failed"};
+	json_t *images = json_array();
+	int i;
+	docker_shared_lock();
+	for(i=0;i<DOCKER_IMAGE_SLOTS;i++) {
+		struct uwsgi_docker_image *di = &udocker.images[i];
+		if (di->state == DOCKER_IMAGE_NONE) continue;
+		json_t *image = json_object();
+		json_object_set_new(image, "name", json_string(di->name));
+		json_object_set_new(image, "state", json_string(states[di->state]));
+		json_array_append_new(images, image);
+	}
+	docker_shared_unlock();
+	return images;
+}
@@ -0,0 +1,450 @@
+#include "docker.h"
+
+extern struct uwsgi_server uwsgi;
+extern struct uwsgi_docker udocker;
+
+/*
+
+	Log forwarding for container attach streams (used both by the bridges and by the monitor).
+
+	With a tty the stream is raw, otherwise docker multiplexes stdout and stderr with 8 bytes headers:
+
+	[stream (1 byte)][0 0 0][payload size (32bit big endian)]
+
+	Payloads are never copied or formatted: they are written to the log fds directly
+	from the read buffer (coalesced with writev) after each read.
+
+	With --docker-log-rate each stream gets a token bucket (bytes per second, --docker-log-burst bytes at most):
+	what exceeds it is not forwarded, but counted in the registry slot of the vassal.
+
+	With --docker-log-ring each vassal gets a ring buffer (in shared memory, next to the registry) keeping the last
+	kilobytes of its output (forwarded or not), reported by the stats server. The ring has a single writer (the process reading
+	the attach stream), readers could get a torn tail while it is written, that is fine for diagnosis.
+	At most --docker-log-rings rings are allocated, and given to the vassals by their first attach stream: when all of them are
+	in use, the ring of the destroyed container updated the longest time ago is taken over. A recycled registry slot releases its ring.
+
+	The monitor forwards the logs of all of the containers, so its destinations are non-blocking (pipes and terminals are reopened
+	with O_NONBLOCK, sockets are written with MSG_DONTWAIT): what a slow destination does not accept is kept (up to 64k per stream)
+	and written before the next output of the container, the rest is dropped (and counted as dropped).
+
+*/
+
+#define DOCKER_LOG_BUFSIZE 65536
+#define DOCKER_LOG_IOVECS 64
+// output kept for a non-blocking destination not accepting it
+#define DOCKER_LOG_PENDING 65536
+
+// the read buffer is shared by all of the streams, as segments are flushed after every read
+static char docker_log_buf[DOCKER_LOG_BUFSIZE];
+
+struct docker_log {
+	int tty;
+	// response headers still to be skipped
+	struct uwsgi_buffer *headers;
+	// frame parser state
+	uint8_t header[8];
+	size_t header_pos;
+	int stream;
+	size_t remains;
+	// 0 -> stdout, 1 -> stderr
+	int fds[2];
+	// socket destinations are written with MSG_DONTWAIT
+	int sock[2];
+	struct uwsgi_buffer *pending[2];
+	struct iovec iov[2][DOCKER_LOG_IOVECS];
+	int iov_count[2];
+	struct uwsgi_docker_container *dc;
+	// rate limit
+	uint64_t tokens[2];
+	uint64_t refilled;
+	uint64_t dropped[2];
+	// the stream has a log ring (it could be taken over once the container is destroyed)
+	int ring;
+};
+
+// the last bytes of the output of a vassal
+struct docker_log_ring {
+	// the registry slot owning it (index + 1, 0 if free)
+	uint64_t slot;
+	// bytes written so far
+	uint64_t pos;
+	char data[];
+};
+
+void docker_log_init() {
+	if (!udocker.log_rings_max) udocker.log_rings_max = DOCKER_LOG_RINGS;
+	udocker.log_ring_size = udocker.log_ring * 1024;
+	udocker.log_rings = uwsgi_calloc_shared((sizeof(struct docker_log_ring) + udocker.log_ring_size) * udocker.log_rings_max);
+}
+
+static struct docker_log_ring *docker_log_ring_at(int index) {
+	return (struct docker_log_ring *) (udocker.log_rings + ((uint64_t) index * (sizeof(struct docker_log_ring) + udocker.log_ring_size)));
+}
+
+// the ring of a registry slot (NULL if it has none)
+static struct docker_log_ring *docker_log_ring(struct uwsgi_docker_container *dc) {
+	if (!udocker.log_rings || !dc || !dc->log_ring) return NULL;
+	struct docker_log_ring *ring = docker_log_ring_at(dc->log_ring - 1);
+	// taken over by another vassal
+	if (ring->slot != (uint64_t) (dc - udocker.shared->containers) + 1) return NULL;
+	return ring;
+}
+
+// give a ring to a registry slot (a free one, or the one of the oldest destroyed container)
+static struct docker_log_ring *docker_log_ring_get(struct uwsgi_docker_container *dc) {
+	if (!udocker.log_rings || !dc) return NULL;
+	docker_shared_lock();
+	struct docker_log_ring *ring = docker_log_ring(dc);
+	if (ring) goto end;
+	int i, index = -1;
+	uint64_t oldest = 0;
+	for(i=0;i<udocker.log_rings_max;i++) {
+		struct docker_log_ring *candidate = docker_log_ring_at(i);
+		if (!candidate->slot) {
+			index = i;
+			break;
+		}
+		struct uwsgi_docker_container *owner = &udocker.shared->containers[candidate->slot - 1];
+		// the tail of a crashing vassal is still useful
+		if (owner->state != DOCKER_STATE_DESTROYED || owner->bridge > 0 || owner->crash_streak) continue;
+		if (index < 0 || owner->updated < oldest) {
+			index = i;
+			oldest = owner->updated;
+		}
+	}
+	if (index < 0) {
+		uwsgi_log("[docker] all of the %d log rings are in use, the output of %s is not kept\n", udocker.log_rings_max, dc->name);
+		goto end;
+	}
+	ring = docker_log_ring_at(index);
+	if (ring->slot) udocker.shared->containers[ring->slot - 1].log_ring = 0;
+	ring->slot = (dc - udocker.shared->containers) + 1;
+	ring->pos = 0;
+	dc->log_ring = index + 1;
+end:
+	docker_shared_unlock();
+	return ring;
+}
+
+// a recycled registry slot gives back its ring, must be called with the lock held
+void docker_log_release(struct uwsgi_docker_container *dc) {
+	struct docker_log_ring *ring = docker_log_ring(dc);
+	if (ring) ring->slot = 0;
+	dc->log_ring = 0;
+}
+
+static void docker_log_ring_write(struct docker_log_ring *ring, char *buf, size_t len) {
+	size_t size = udocker.log_ring_size;
+	// only the tail fits
+	if (len > size) {
+		buf += len - size;
+		len = size;
+	}
+	size_t offset = ring->pos % size;
+	size_t chunk = size - offset;
+	if (chunk > len) chunk = len;
+	memcpy(ring->data + offset, buf, chunk);
+	memcpy(ring->data, buf + chunk, len - chunk);
+	__sync_add_and_fetch(&ring->pos, len);
+}
+
+// the content of the ring of a vassal (starting from a full line), for the stats server
+json_t *docker_log_tail(struct uwsgi_docker_container *dc) {
+	struct docker_log_ring *ring = docker_log_ring(dc);
+	if (!ring) return NULL;
+	size_t size = udocker.log_ring_size;
+	uint64_t pos = ring->pos;
+	size_t len = pos > size ? size : pos;
+	char *tail = uwsgi_malloc(len + 1);
+	size_t offset = (pos - len) % size;
+	size_t chunk = size - offset;
+	if (chunk > len) chunk = len;
+	memcpy(tail, ring->data + offset, chunk);
+	memcpy(tail + chunk, ring->data, len - chunk);
+	tail[len] = 0;
+	char *start = tail;
+	// the oldest line has been overwritten
+	if (pos > size) {
+		char *nl = memchr(tail, '\n', len);
+		if (nl) start = nl + 1;
+	}
+	json_t *json_tail = json_string(start);
+	// not valid utf-8 (or a NUL byte), keep it readable
+	if (!json_tail) {
+		char *ptr = start;
+		while(ptr < tail + len) {
+			if ((*ptr < 32 && *ptr != '\n' && *ptr != '\t') || (uint8_t) *ptr > 126) *ptr = '?';
+			ptr++;
+		}
+		json_tail = json_string(start);
+	}
+	free(tail);
+	return json_tail;
+}
+
+// get a non-blocking version of a log fd, without changing the (shared) file description of the original one
+static int docker_log_nonblock(struct docker_log *dl, int stream, int fd) {
+	struct stat st;
+	if (fstat(fd, &st)) return fd;
+	if (S_ISSOCK(st.st_mode)) {
+		dl->sock[stream] = 1;
+		return fd;
+	}
+	// regular files never block
+	if (!S_ISFIFO(st.st_mode) && !S_ISCHR(st.st_mode)) return fd;
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	int nb_fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if (nb_fd < 0) {
+		uwsgi_error_open(path);
+		return fd;
+	}
+	close(fd);
+	return nb_fd;
+}
+
+struct docker_log *docker_log_new(int tty, int stdout_fd, int stderr_fd, struct uwsgi_docker_container *dc, int nonblocking) {
+	struct docker_log *dl = uwsgi_calloc(sizeof(struct docker_log));
+	dl->tty = tty;
+	dl->headers = uwsgi_buffer_new(uwsgi.page_size);
+	dl->fds[0] = nonblocking ? docker_log_nonblock(dl, 0, stdout_fd) : stdout_fd;
+	dl->fds[1] = nonblocking ? docker_log_nonblock(dl, 1, stderr_fd) : stderr_fd;
+	dl->dc = dc;
+	dl->tokens[0] = dl->tokens[1] = udocker.log_burst;
+	dl->refilled = uwsgi_micros();
+	dl->ring = docker_log_ring_get(dc) != NULL;
+	return dl;
+}
+
+static ssize_t docker_log_writev(struct docker_log *dl, int stream, struct iovec *iov, int count) {
+	if (dl->sock[stream]) {
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(struct msghdr));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		return sendmsg(dl->fds[stream], &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+	return writev(dl->fds[stream], iov, count);
+}
+
+// keep what a non-blocking destination did not accept, the rest is dropped
+static void docker_log_pending(struct docker_log *dl, int stream, struct iovec *iov, int count) {
+	if (!dl->pending[stream]) dl->pending[stream] = uwsgi_buffer_new(uwsgi.page_size);
+	struct uwsgi_buffer *ub = dl->pending[stream];
+	uint64_t dropped = 0;
+	int i;
+	for(i=0;i<count;i++) {
+		size_t len = iov[i].iov_len;
+		size_t room = ub->pos < DOCKER_LOG_PENDING ? DOCKER_LOG_PENDING - ub->pos : 0;
+		if (room > len) room = len;
+		if (room && uwsgi_buffer_append(ub, iov[i].iov_base, room)) room = 0;
+		dropped += len - room;
+	}
+	if (dropped && dl->dc) __sync_add_and_fetch(&dl->dc->log_dropped[stream], dropped);
+}
+
+// write the output kept for a slow destination, returns -1 if some of it is still there
+static int docker_log_flush_pending(struct docker_log *dl, int stream) {
+	struct uwsgi_buffer *ub = dl->pending[stream];
+	while(ub && ub->pos > 0) {
+		struct iovec iov;
+		iov.iov_base = ub->buf;
+		iov.iov_len = ub->pos;
+		ssize_t wlen = docker_log_writev(dl, stream, &iov, 1);
+		if (wlen < 0) {
+			if (errno == EINTR) continue;
+			if (uwsgi_is_again()) return -1;
+			uwsgi_error("docker_log_flush_pending()/writev()");
+			ub->pos = 0;
+			return 0;
+		}
+		memmove(ub->buf, ub->buf + wlen, ub->pos - wlen);
+		ub->pos -= wlen;
+	}
+	return 0;
+}
+
+void docker_log_destroy(struct docker_log *dl) {
+	if (dl->headers) uwsgi_buffer_destroy(dl->headers);
+	int i;
+	for(i=0;i<2;i++) {
+		if (!dl->pending[i]) continue;
+		// last chance
+		docker_log_flush_pending(dl, i);
+		uwsgi_buffer_destroy(dl->pending[i]);
+	}
+	close(dl->fds[0]);
+	close(dl->fds[1]);
+	free(dl);
+}
+
+static void docker_log_flush(struct docker_log *dl, int stream) {
+	struct iovec *iov = dl->iov[stream];
+	int count = dl->iov_count[stream];
+	dl->iov_count[stream] = 0;
+	if (!count) return;
+	// the older output goes first
+	if (docker_log_flush_pending(dl, stream)) {
+		docker_log_pending(dl, stream, iov, count);
+		return;
+	}
+	while(count > 0) {
+		ssize_t wlen = docker_log_writev(dl, stream, iov, count);
+		if (wlen < 0) {
+			if (errno == EINTR) continue;
+			if (uwsgi_is_again()) {
+				docker_log_pending(dl, stream, iov, count);
+				return;
+			}
+			uwsgi_error("docker_log_flush()/writev()");
+			return;
+		}
+		// skip what has been written
+		while(count > 0 && (size_t) wlen >= iov->iov_len) {
+			wlen -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *) iov->iov_base + wlen;
+			iov->iov_len -= wlen;
+		}
+	}
+}
+
+// refill the token buckets (once per read)
+static void docker_log_refill(struct docker_log *dl) {
+	uint64_t now = uwsgi_micros();
+	uint64_t tokens = ((now - dl->refilled) * udocker.log_rate) / 1000000;
+	if (!tokens) return;
+	dl->refilled = now;
+	int i;
+	for(i=0;i<2;i++) {
+		dl->tokens[i] += tokens;
+		if (dl->tokens[i] > (uint64_t) udocker.log_burst) dl->tokens[i] = udocker.log_burst;
+	}
+}
+
+// tell the destination about the dropped logs, once the stream is forwarded again
+static void docker_log_dropped(struct docker_log *dl, int stream) {
+	char msg[512];
+	int ret = snprintf(msg, sizeof(msg), "[docker] %llu bytes of logs%s%s dropped by the rate limit\n", (unsigned long long) dl->dropped[stream],
+		dl->dc ? " of " : "", dl->dc ? dl->dc->name : "");
+	dl->dropped[stream] = 0;
+	if (ret <= 0 || (size_t) ret >= sizeof(msg)) return;
+	docker_log_flush(dl, stream);
+	struct iovec iov;
+	iov.iov_base = msg;
+	iov.iov_len = ret;
+	if (docker_log_flush_pending(dl, stream) || docker_log_writev(dl, stream, &iov, 1) < 0) {
+		if (uwsgi_is_again()) {
+			docker_log_pending(dl, stream, &iov, 1);
+			return;
+		}
+		uwsgi_error("docker_log_dropped()/write()");
+	}
+}
+
+static void docker_log_segment(struct docker_log *dl, int stream, char *buf, size_t len) {
+	if (!len) return;
+	if (dl->ring) {
+		struct docker_log_ring *ring = docker_log_ring(dl->dc);
+		if (ring) docker_log_ring_write(ring, buf, len);
+	}
+
+	size_t forward = len;
+	if (udocker.log_rate) {
+		if (forward > dl->tokens[stream]) forward = dl->tokens[stream];
+		dl->tokens[stream] -= forward;
+		if (forward && dl->dropped[stream]) docker_log_dropped(dl, stream);
+		dl->dropped[stream] += len - forward;
+		if (dl->dc && len > forward) __sync_add_and_fetch(&dl->dc->log_dropped[stream], len - forward);
+	}
+
+	if (forward) {
+		if (dl->iov_count[stream] >= DOCKER_LOG_IOVECS) docker_log_flush(dl, stream);
+		dl->iov[stream][dl->iov_count[stream]].iov_base = buf;
+		dl->iov[stream][dl->iov_count[stream]].iov_len = forward;
+		dl->iov_count[stream]++;
+	}
+
+	if (!dl->dc) return;
+	uint64_t lines = 0;
+	char *ptr = buf;
+	char *end = buf + len;
+	while((ptr = memchr(ptr, '\n', end - ptr))) {
+		lines++;
+		ptr++;
+	}
+	__sync_add_and_fetch(&dl->dc->log_bytes[stream], len);
+	__sync_add_and_fetch(&dl->dc->log_lines[stream], lines);
+}
+
+static void docker_log_parse(struct docker_log *dl, char *buf, size_t len) {
+	if (dl->tty) {
+		docker_log_segment(dl, 0, buf, len);
+		return;
+	}
+	while(len > 0) {
+		if (!dl->remains) {
+			size_t chunk = 8 - dl->header_pos;
+			if (chunk > len) chunk = len;
+			memcpy(dl->header + dl->header_pos, buf, chunk);
+			dl->header_pos += chunk;
+			buf += chunk;
+			len -= chunk;
+			if (dl->header_pos < 8) break;
+			dl->header_pos = 0;
+			// stdin is never echoed, unknown streams go to stdout
+			dl->stream = dl->header[0] == 2 ? 1 : 0;
+			dl->remains = ((size_t) dl->header[4] << 24) | ((size_t) dl->header[5] << 16) | ((size_t) dl->header[6] << 8) | (size_t) dl->header[7];
+			continue;
+		}
+		size_t chunk = dl->remains;
+		if (chunk > len) chunk = len;
+		docker_log_segment(dl, dl->stream, buf, chunk);
+		dl->remains -= chunk;
+		buf += chunk;
+		len -= chunk;
+	}
+}
+
+// read from the attach stream, returns -1 when the stream is over
+int docker_log_read(struct docker_log *dl, int fd) {
+	ssize_t rlen = read(fd, docker_log_buf, DOCKER_LOG_BUFSIZE);
+	if (rlen < 0) {
+		if (uwsgi_is_again() || errno == EINTR) return 0;
+		uwsgi_error("docker_log_read()/read()");
+		return -1;
+	}
+	if (rlen == 0) return -1;
+
+	char *buf = docker_log_buf;
+	size_t len = rlen;
+
+	// skip the HTTP response headers
+	if (dl->headers) {
+		if (uwsgi_buffer_append(dl->headers, buf, len)) return -1;
+		char *end = memmem(dl->headers->buf, dl->headers->pos, "\r\n\r\n", 4);
+		if (!end) {
+			if (dl->headers->pos > 8192) {
+				uwsgi_log("[docker] invalid attach response\n");
+				return -1;
+			}
+			return 0;
+		}
+		size_t skip = (end + 4) - dl->headers->buf;
+		// what remains after the headers is still in our read buffer
+		size_t body = dl->headers->pos - skip;
+		buf += len - body;
+		len = body;
+		uwsgi_buffer_destroy(dl->headers);
+		dl->headers = NULL;
+	}
+
+	if (udocker.log_rate) docker_log_refill(dl);
+	docker_log_parse(dl, buf, len);
+	docker_log_flush(dl, 0);
+	docker_log_flush(dl, 1);
+	return 0;
+}
@@ -0,0 +1,317 @@
+#include "docker.h"
+
+extern struct uwsgi_server uwsgi;
+extern struct uwsgi_docker udocker;
+
+/*
+
+	Resource usage of the containers (--docker-metrics), collected by the monitor.
+
+	The monitor keeps a /containers/<id>/stats stream open for each container managed by a bridge.
+	The daemon sends a json object (one per line) every second, we only extract the few
+	counters we need with a tiny scanner working on the read buffer (no json tree is built),
+	and keep the last minute of samples in a ring, so the stats server can report
+	cpu, memory, network, blkio and cpu throttling over rolling windows.
+
+	Streams are connected without blocking the monitor. A broken stream is reopened with an exponential
+	delay (keeping its samples), a container unknown to the daemon (404) is not asked again.
+
+*/
+
+// one minute of samples (one per second) plus the base of the window
+#define DOCKER_METRICS_SAMPLES 61
+#define DOCKER_METRICS_DEPTH 16
+
+struct docker_metrics_sample {
+	uint64_t ts;
+	// nanoseconds
+	uint64_t cpu;
+	uint64_t periods;
+	uint64_t throttled_periods;
+	uint64_t throttled_time;
+	// bytes
+	uint64_t memory;
+	uint64_t memory_limit;
+	uint64_t rx;
+	uint64_t tx;
+	uint64_t read;
+	uint64_t write;
+};
+
+struct docker_metrics {
+	// response headers still to be skipped
+	int headers;
+	struct uwsgi_buffer *ub;
+	struct docker_metrics_sample samples[DOCKER_METRICS_SAMPLES];
+	int head;
+	int count;
+};
+
+// rolling windows (in seconds)
+static int docker_metrics_windows[] = {10, 60};
+static char *docker_metrics_windows_names[] = {"10s", "60s"};
+
+struct docker_metrics *docker_metrics_new() {
+	struct docker_metrics *dm = uwsgi_calloc(sizeof(struct docker_metrics));
+	dm->ub = uwsgi_buffer_new(uwsgi.page_size);
+	return dm;
+}
+
+void docker_metrics_destroy(struct docker_metrics *dm) {
+	uwsgi_buffer_destroy(dm->ub);
+	free(dm);
+}
+
+// start connecting to the daemon (the connection is completed when the fd is writable)
+int docker_metrics_connect() {
+	return uwsgi_connect(udocker.socket, uwsgi.socket_timeout, 1);
+}
+
+// ask for the stats stream of a container on a connected (non blocking) fd
+int docker_metrics_request(struct docker_metrics *dm, int fd, char *id) {
+	int err = 0;
+	socklen_t err_len = sizeof(err);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) || err) {
+		if (udocker.debug) uwsgi_log("[docker-debug] unable to connect to the daemon for the stats of %s\n", id);
+		return -1;
+	}
+	// HTTP/1.0 avoids chunked encoding, the stream ends when the container stops
+	char request[256];
+	int len = snprintf(request, sizeof(request), "GET %s/containers/%s/stats HTTP/1.0\r\n\r\n", udocker.api_prefix, id);
+	// an empty socket buffer always takes it
+	if (len <= 0 || len >= (int) sizeof(request) || write(fd, request, len) != len) {
+		uwsgi_error("docker_metrics_request()/write()");
+		return -1;
+	}
+	// a new response
+	dm->headers = 0;
+	dm->ub->pos = 0;
+	return 0;
+}
+
+struct docker_metrics_key {
+	char *key;
+	size_t len;
+	int object;
+};
+
+static int docker_metrics_key_is(struct docker_metrics_key *k, char *name) {
+	return k->key && k->len == strlen(name) && !memcmp(k->key, name, k->len);
+}
+
+// map a counter (by its path) to the sample
+static void docker_metrics_value(struct docker_metrics_sample *s, struct docker_metrics_key *path, int depth, int blkio_op, uint64_t value) {
+	if (depth == 1) {
+		if (docker_metrics_key_is(&path[0], "memory_stats")) {
+			if (docker_metrics_key_is(&path[1], "usage")) s->memory = value;
+			else if (docker_metrics_key_is(&path[1], "limit")) s->memory_limit = value;
+		}
+		// api < 1.21
+		else if (docker_metrics_key_is(&path[0], "network")) {
+			if (docker_metrics_key_is(&path[1], "rx_bytes")) s->rx = value;
+			else if (docker_metrics_key_is(&path[1], "tx_bytes")) s->tx = value;
+		}
+		return;
+	}
+	if (depth == 2) {
+		if (docker_metrics_key_is(&path[0], "cpu_stats")) {
+			if (docker_metrics_key_is(&path[1], "cpu_usage")) {
+				if (docker_metrics_key_is(&path[2], "total_usage")) s->cpu = value;
+			}
+			else if (docker_metrics_key_is(&path[1], "throttling_data")) {
+				if (docker_metrics_key_is(&path[2], "periods")) s->periods = value;
+				else if (docker_metrics_key_is(&path[2], "throttled_periods")) s->throttled_periods = value;
+				else if (docker_metrics_key_is(&path[2], "throttled_time")) s->throttled_time = value;
+			}
+		}
+		// one object for each interface
+		else if (docker_metrics_key_is(&path[0], "networks")) {
+			if (docker_metrics_key_is(&path[2], "rx_bytes")) s->rx += value;
+			else if (docker_metrics_key_is(&path[2], "tx_bytes")) s->tx += value;
+		}
+		return;
+	}
+	// blkio_stats.io_service_bytes_recursive[].{op, value}
+	if (depth == 3 && blkio_op > -1 && docker_metrics_key_is(&path[0], "blkio_stats") &&
+		docker_metrics_key_is(&path[1], "io_service_bytes_recursive") && docker_metrics_key_is(&path[3], "value")) {
+		if (blkio_op == 0) s->read += value;
+		else s->write += value;
+	}
+}
+
+// scan a stats object, returns -1 if it is not valid
+static int docker_metrics_parse(struct docker_metrics_sample *s, char *buf, size_t len) {
+	struct docker_metrics_key path[DOCKER_METRICS_DEPTH];
+	int depth = -1;
+	int expect_key = 0;
+	// 0 -> Read, 1 -> Write (the op of a blkio entry comes before its value)
+	int blkio_op = -1;
+	size_t i = 0;
+	while(i < len) {
+		char c = buf[i];
+		if (c == '{' || c == '[') {
+			if (++depth >= DOCKER_METRICS_DEPTH) return -1;
+			path[depth].key = NULL;
+			path[depth].len = 0;
+			path[depth].object = (c == '{');
+			expect_key = path[depth].object;
+			if (c == '{') blkio_op = -1;
+			i++;
+		}
+		else if (c == '}' || c == ']') {
+			if (--depth < -1) return -1;
+			expect_key = 0;
+			i++;
+		}
+		else if (c == ',') {
+			expect_key = depth > -1 && path[depth].object;
+			i++;
+		}
+		else if (c == '"') {
+			size_t start = ++i;
+			while(i < len && buf[i] != '"') {
+				if (buf[i] == '\\') i++;
+				i++;
+			}
+			if (i >= len || depth < 0) return -1;
+			if (expect_key) {
+				path[depth].key = buf + start;
+				path[depth].len = i - start;
+				expect_key = 0;
+			}
+			else if (docker_metrics_key_is(&path[depth], "op")) {
+				if (i - start == 4 && !memcmp(buf + start, "Read", 4)) blkio_op = 0;
+				else if (i - start == 5 && !memcmp(buf + start, "Write", 5)) blkio_op = 1;
+				else blkio_op = -1;
+			}
+			i++;
+		}
+		else if (c == '-' || isdigit((int) c)) {
+			uint64_t value = 0;
+			int negative = (c == '-');
+			if (negative) i++;
+			while(i < len && isdigit((int) buf[i])) {
+				value = (value * 10) + (buf[i] - '0');
+				i++;
+			}
+			// fractions and exponents are not used by the counters
+			while(i < len && (isdigit((int) buf[i]) || buf[i] == '.' || buf[i] == 'e' || buf[i] == 'E' || buf[i] == '+' || buf[i] == '-')) i++;
+			if (depth > -1 && !negative) docker_metrics_value(s, path, depth, blkio_op, value);
+		}
+		// spaces, colons, true, false and null
+		else {
+			i++;
+		}
+	}
+	return depth == -1 ? 0 : -1;
+}
+
+static void docker_metrics_push(struct docker_metrics *dm, char *buf, size_t len) {
+	struct docker_metrics_sample s;
+	memset(&s, 0, sizeof(struct docker_metrics_sample));
+	if (docker_metrics_parse(&s, buf, len)) return;
+	s.ts = uwsgi_micros();
+	dm->head = (dm->head + 1) % DOCKER_METRICS_SAMPLES;
+	dm->samples[dm->head] = s;
+	if (dm->count < DOCKER_METRICS_SAMPLES) dm->count++;
+}
+
+// returns -1 when the stream is over, -2 when the daemon does not know the container
+int docker_metrics_read(struct docker_metrics *dm, int fd) {
+	char buf[8192];
+	ssize_t rlen = read(fd, buf, sizeof(buf));
+	if (rlen < 0) {
+		if (uwsgi_is_again() || errno == EINTR) return 0;
+		return -1;
+	}
+	if (rlen == 0) return -1;
+	if (uwsgi_buffer_append(dm->ub, buf, rlen)) return -1;
+
+	struct uwsgi_buffer *ub = dm->ub;
+	size_t pos = 0;
+	if (!dm->headers) {
+		char *end = memmem(ub->buf, ub->pos, "\r\n\r\n", 4);
+		if (!end) return 0;
+		if (ub->pos < 12 || strncmp(ub->buf + 9, "200", 3)) {
+			if (udocker.debug) uwsgi_log("[docker-debug] unable to get container stats: %.*s\n", (int) (end - ub->buf), ub->buf);
+			return (ub->pos >= 12 && !strncmp(ub->buf + 9, "404", 3)) ? -2 : -1;
+		}
+		pos = (end + 4) - ub->buf;
+		dm->headers = 1;
+	}
+
+	// one object per line
+	for(;;) {
+		char *nl = memchr(ub->buf + pos, '\n', ub->pos - pos);
+		if (!nl) break;
+		docker_metrics_push(dm, ub->buf + pos, nl - (ub->buf + pos));
+		pos = (nl + 1) - ub->buf;
+	}
+
+	if (pos > 0) {
+		memmove(ub->buf, ub->buf + pos, ub->pos - pos);
+		ub->pos -= pos;
+	}
+
+	// no stats object should be so big, the stream is corrupted
+	if (ub->pos > 1024 * 1024) {
+		uwsgi_log("[docker] invalid stats stream\n");
+		return -1;
+	}
+	return 0;
+}
+
+// counters can go back (e.g. an interface has been removed)
+static uint64_t docker_metrics_delta(uint64_t newer, uint64_t older) {
+	return newer > older ? newer - older : 0;
+}
+
+static json_t *docker_metrics_window(struct docker_metrics *dm, int seconds) {
+	struct docker_metrics_sample *last = &dm->samples[dm->head];
+	struct docker_metrics_sample *first = last;
+	uint64_t memory_sum = 0, memory_max = 0;
+	int i, samples = 0;
+	for(i=0;i<dm->count;i++) {
+		struct docker_metrics_sample *s = &dm->samples[(dm->head + DOCKER_METRICS_SAMPLES - i) % DOCKER_METRICS_SAMPLES];
+		if (last->ts - s->ts > (uint64_t) seconds * 1000000) break;
+		first = s;
+		memory_sum += s->memory;
+		if (s->memory > memory_max) memory_max = s->memory;
+		samples++;
+	}
+
+	json_t *window = json_object();
+	uint64_t elapsed = last->ts - first->ts;
+	json_object_set_new(window, "samples", json_integer(samples));
+	json_object_set_new(window, "memory_avg", json_integer(samples ? memory_sum / samples : 0));
+	json_object_set_new(window, "memory_max", json_integer(memory_max));
+	// percentage of a single cpu (200 -> two cpus)
+	json_object_set_new(window, "cpu", json_real(elapsed ? (docker_metrics_delta(last->cpu, first->cpu) / 10.0) / elapsed : 0));
+	uint64_t periods = docker_metrics_delta(last->periods, first->periods);
+	json_object_set_new(window, "throttled", json_real(periods ? (docker_metrics_delta(last->throttled_periods, first->throttled_periods) * 100.0) / periods : 0));
+	json_object_set_new(window, "throttled_us", json_integer(docker_metrics_delta(last->throttled_time, first->throttled_time) / 1000));
+	// bytes per second
+	json_object_set_new(window, "rx", json_integer(elapsed ? (docker_metrics_delta(last->rx, first->rx) * 1000000) / elapsed : 0));
+	json_object_set_new(window, "tx", json_integer(elapsed ? (docker_metrics_delta(last->tx, first->tx) * 1000000) / elapsed : 0));
+	json_object_set_new(window, "read", json_integer(elapsed ? (docker_metrics_delta(last->read, first->read) * 1000000) / elapsed : 0));
+	json_object_set_new(window, "write", json_integer(elapsed ? (docker_metrics_delta(last->write, first->write) * 1000000) / elapsed : 0));
+	return window;
+}
+
+// the metrics object of a container for the stats server
+json_t *docker_metrics_json(struct docker_metrics *dm) {
+	json_t *metrics = json_object();
+	if (!dm->count) return metrics;
+	struct docker_metrics_sample *last = &dm->samples[dm->head];
+	json_object_set_new(metrics, "memory", json_integer(last->memory));
+	json_object_set_new(metrics, "memory_limit", json_integer(last->memory_limit));
+	json_object_set_new(metrics, "rx_bytes", json_integer(last->rx));
+	json_object_set_new(metrics, "tx_bytes", json_integer(last->tx));
+	json_object_set_new(metrics, "read_bytes", json_integer(last->read));
+	json_object_set_new(metrics, "write_bytes", json_integer(last->write));
+	size_t i;
+	for(i=0;i<sizeof(docker_metrics_windows)/sizeof(int);i++) {
+		json_object_set_new(metrics, docker_metrics_windows_names[i], docker_metrics_window(dm, docker_metrics_windows[i]));
+	}
+	return metrics;
+}
@@ -0,0 +1,1446 @@
+#include "docker.h"
+
+extern struct uwsgi_server uwsgi;
+extern struct uwsgi_docker udocker;
+
+/*
+
+	The docker monitor is a single process forked by the Emperor before spawning vassals.
+
+	It subscribes to the daemon /events stream and keeps the container registry (stored in shared memory)
+	up to date, so bridges do not need to ask the daemon for the state of their containers.
+
+	Whenever a container managed by a bridge dies, the bridge is immediately notified.
+
+	With --docker-rolling, the monitor binds the vassal sockets (docker-socket) and keeps them,
+	so all of the containers of a vassal share the same listening socket.
+
+	When the Emperor dies, the monitor force-removes the containers of the bridges (and the warm pool)
+	in parallel (see teardown.c).
+
+	With --docker-metrics, the monitor consumes the stats stream of each container managed by a bridge
+	(see metrics.c) and exposes its resource usage via the stats server.
+
+	With --docker-shared-bridge, bridges hand their attach streams to the monitor (via the monitor channel)
+	and park until the monitor closes their notification socket, so a single event loop forwards the logs
+	of all of the containers.
+
+	Bridges watching their vassal socket (docker-idle and docker-pause) register it in their slot: the monitor
+	parses /proc/net once per second for all of them and stores the connection counts in the slots.
+
+*/
+
+void docker_shared_lock() {
+	// a process died while holding the lock, the registry is still usable
+	if (pthread_mutex_lock(&udocker.shared->lock) == EOWNERDEAD) {
+		pthread_mutex_consistent(&udocker.shared->lock);
+	}
+}
+
+void docker_shared_unlock() {
+	pthread_mutex_unlock(&udocker.shared->lock);
+}
+
+void docker_registry_init() {
+	if (!udocker.registry_size) udocker.registry_size = DOCKER_REGISTRY_SIZE;
+	udocker.shared = uwsgi_calloc_shared(sizeof(struct uwsgi_docker_shared) + ((sizeof(struct uwsgi_docker_container) + sizeof(uint64_t)) * udocker.registry_size));
+	udocker.shared->slots = udocker.registry_size;
+
+	pthread_mutexattr_t attr;
+	if (pthread_mutexattr_init(&attr)) goto error;
+	if (pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED)) goto error;
+	if (pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST)) goto error;
+	if (pthread_mutex_init(&udocker.shared->lock, &attr)) goto error;
+	pthread_mutexattr_destroy(&attr);
+
+	// the spawn scheduler waits on it
+	pthread_condattr_t cattr;
+	if (pthread_condattr_init(&cattr)) goto error;
+	if (pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED)) goto error;
+	if (pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC)) goto error;
+	if (pthread_cond_init(&udocker.shared->sched_cond, &cattr)) goto error;
+	pthread_condattr_destroy(&cattr);
+	return;
+error:
+	uwsgi_log("[docker] unable to initialize the containers registry lock\n");
+	exit(1);
+}
+
+// the slot of a destroyed container nobody is using anymore (its name stays in the probe chain)
+static int docker_registry_tombstone(struct uwsgi_docker_container *dc, uint64_t now) {
+	if (dc->state != DOCKER_STATE_DESTROYED || dc->bridge > 0) return 0;
+	// the history of a crashing vassal must survive its containers
+	if (dc->sched_state != DOCKER_SCHED_NONE || dc->crash_streak) return 0;
+	return now - dc->updated > (uint64_t) DOCKER_REGISTRY_GRACE * 1000000;
+}
+
+// the head of the chain of the slots with the same id hash
+static uint64_t *docker_registry_id_head(char *id) {
+	uint64_t *heads = (uint64_t *) &udocker.shared->containers[udocker.shared->slots];
+	return &heads[djb33x_hash(id, strlen(id)) % udocker.shared->slots];
+}
+
+static void docker_registry_id_link(struct uwsgi_docker_container *dc) {
+	if (!dc->id[0]) return;
+	uint64_t *head = docker_registry_id_head(dc->id);
+	dc->id_next = *head;
+	*head = (dc - udocker.shared->containers) + 1;
+}
+
+static void docker_registry_id_unlink(struct uwsgi_docker_container *dc) {
+	if (!dc->id[0]) return;
+	uint64_t *link = docker_registry_id_head(dc->id);
+	uint64_t slot = (dc - udocker.shared->containers) + 1;
+	while(*link) {
+		if (*link == slot) {
+			*link = dc->id_next;
+			break;
+		}
+		link = &udocker.shared->containers[*link - 1].id_next;
+	}
+	dc->id_next = 0;
+}
+
+// find the slot mapped to a container name, must be called with the lock held
+static struct uwsgi_docker_container *docker_registry_slot(char *name, int create) {
+	size_t len = strlen(name);
+	if (len >= sizeof(udocker.shared->containers[0].name)) return NULL;
+	struct uwsgi_docker_container *tombstone = NULL;
+	uint64_t now = uwsgi_micros();
+	uint64_t i, slot = djb33x_hash(name, len) % udocker.shared->slots;
+	for(i=0;i<udocker.shared->slots;i++) {
+		struct uwsgi_docker_container *dc = &udocker.shared->containers[slot];
+		if (!dc->name[0]) {
+			if (!create) return NULL;
+			if (tombstone) break;
+			memcpy(dc->name, name, len);
+			return dc;
+		}
+		if (!strcmp(dc->name, name)) return dc;
+		if (create && !tombstone && docker_registry_tombstone(dc, now)) tombstone = dc;
+		slot = (slot + 1) % udocker.shared->slots;
+	}
+	if (!tombstone) return NULL;
+	// the name is not in the chain, recycle the first destroyed slot
+	docker_log_release(tombstone);
+	docker_registry_id_unlink(tombstone);
+	memset(tombstone, 0, sizeof(struct uwsgi_docker_container));
+	memcpy(tombstone->name, name, len);
+	return tombstone;
+}
+
+// find the slot mapped to a container id, must be called with the lock held
+static struct uwsgi_docker_container *docker_registry_slot_by_id(char *id) {
+	uint64_t slot = *docker_registry_id_head(id);
+	while(slot) {
+		struct uwsgi_docker_container *dc = &udocker.shared->containers[slot - 1];
+		// the id of a renamed container is still mapped to its old (destroyed) name
+		if (dc->state != DOCKER_STATE_DESTROYED && !strcmp(dc->id, id)) return dc;
+		slot = dc->id_next;
+	}
+	return NULL;
+}
+
+// get the id (and state) of a live container, id must be at least 65 bytes
+int docker_registry_get(char *name, char *id, int *state) {
+	int ret = -1;
+	if (!udocker.shared || !udocker.shared->ready) return -1;
+	docker_shared_lock();
+	struct uwsgi_docker_container *dc = docker_registry_slot(name, 0);
+	if (dc && dc->id[0] && dc->state != DOCKER_STATE_DESTROYED) {
+		memcpy(id, dc->id, sizeof(dc->id));
+		if (state) *state = dc->state;
+		ret = 0;
+	}
+	docker_shared_unlock();
+	return ret;
+}
+
+// map a container name to its id (and eventually to the bridge managing it)
+void docker_registry_set(char *name, char *id, int state, pid_t bridge) {
+	if (!udocker.shared) return;
+	if (strlen(id) >= sizeof(udocker.shared->containers[0].id)) return;
+	docker_shared_lock();
+	struct uwsgi_docker_container *dc = docker_registry_slot(name, 1);
+	if (!dc) {
+		docker_shared_unlock();
+		uwsgi_log("[docker] the containers registry is full, consider increasing --docker-registry-size\n");
+		return;
+	}
+	// a new container
+	if (strcmp(dc->id, id)) {
+		memset(dc->log_bytes, 0, sizeof(dc->log_bytes));
+		memset(dc->log_lines, 0, sizeof(dc->log_lines));
+		memset(dc->log_dropped, 0, sizeof(dc->log_dropped));
+		dc->spec = 0;
+		docker_registry_id_unlink(dc);
+		strcpy(dc->id, id);
+		docker_registry_id_link(dc);
+	}
+	dc->state = state;
+	dc->oom = 0;
+	if (bridge && dc->bridge != bridge) {
+		dc->bridge = bridge;
+		dc->bridge_start = docker_pid_start(bridge);
+		// the sockets watched by the previous bridge
+		dc->idle_sockets = 0;
+	}
+	dc->updated = uwsgi_micros();
+	docker_shared_unlock();
+}
+
+void docker_registry_state(char *name, int state) {
+	if (!udocker.shared) return;
+	docker_shared_lock();
+	struct uwsgi_docker_container *dc = docker_registry_slot(name, 0);
+	if (dc) {
+		dc->state = state;
+		// a stopped container (--docker-reuse) outlives its bridge
+		if (state == DOCKER_STATE_DESTROYED || state == DOCKER_STATE_STOPPED) dc->bridge = 0;
+		dc->updated = uwsgi_micros();
+	}
+	docker_shared_unlock();
+}
+
+// start time (in clock ticks since boot) of a process, 0 if it does not exist
+uint64_t docker_pid_start(pid_t pid) {
+	char path[64];
+	char buf[1024];
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return 0;
+	ssize_t len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0) return 0;
+	buf[len] = 0;
+	// the process name could contain spaces, fields are counted after it (starttime is the 22nd)
+	char *ptr = strrchr(buf, ')');
+	if (!ptr) return 0;
+	int field = 2;
+	while(*ptr) {
+		if (*ptr++ != ' ') continue;
+		if (++field == 22) return strtoull(ptr, NULL, 10);
+	}
+	return 0;
+}
+
+// check a bridge pid still belongs to the bridge registered in a slot
+int docker_bridge_alive(pid_t pid, uint64_t start) {
+	if (pid <= 0) return 0;
+	return docker_pid_start(pid) == start;
+}
+
+// get the (stable) slot of a container, used for lock-less counters
+struct uwsgi_docker_container *docker_registry_lookup(char *name) {
+	if (!udocker.shared) return NULL;
+	docker_shared_lock();
+	struct uwsgi_docker_container *dc = docker_registry_slot(name, 0);
+	docker_shared_unlock();
+	return dc;
+}
+
+// set the spec hash of the current container of a vassal
+void docker_registry_spec(char *name, uint64_t spec) {
+	if (!udocker.shared) return;
+	docker_shared_lock();
+	struct uwsgi_docker_container *dc = docker_registry_slot(name, 0);
+	if (dc) dc->spec = spec;
+	docker_shared_unlock();
+}
+
+// get the id of the stopped container of a vassal if it has been created with the same spec
+// (the returned id must be freed). The slot is written by the bridges of the vassal, so the events
+// stream is not required: a container removed behind our back makes the start fail with 404
+char *docker_registry_reusable(char *name, uint64_t spec) {
+	char *id = NULL;
+	if (!udocker.shared) return NULL;
+	docker_shared_lock();
+	struct uwsgi_docker_container *dc = docker_registry_slot(name, 0);
+	if (dc && dc->id[0] && dc->spec == spec && (dc->state == DOCKER_STATE_STOPPED || dc->state == DOCKER_STATE_DEAD)) {
+		id = uwsgi_str(dc->id);
+	}
+	docker_shared_unlock();
+	return id;
+}
+
+// get (or create) the slot of a container name, even before the container exists
+struct uwsgi_docker_container *docker_registry_reserve(char *name) {
+	if (!udocker.shared) return NULL;
+	docker_shared_lock();
+	struct uwsgi_docker_container *dc = docker_registry_slot(name, 1);
+	docker_shared_unlock();
+	return dc;
+}
+
+static int docker_state_from_status(char *status) {
+	if (strstr(status, "(Paused)")) return DOCKER_STATE_PAUSED;
+	if (!strncmp(status, "Up", 2)) return DOCKER_STATE_RUNNING;
+	if (!strncmp(status, "Exited", 6)) return DOCKER_STATE_STOPPED;
+	if (!strncmp(status, "Dead", 4)) return DOCKER_STATE_DEAD;
+	return DOCKER_STATE_CREATED;
+}
+
+// check a container carries the spec env of the bridges
+static int docker_registry_owned(char *id) {
+	long http_status = 0;
+	int ret = 0;
+	char *url = uwsgi_concat3("/containers/", id, "/json");
+	json_t *response = docker_json("GET", url, NULL, &http_status);
+	free(url);
+	if (!response || http_status != 200) goto end;
+	json_t *config = json_object_get(response, "Config");
+	if (!config || !json_is_object(config)) goto end;
+	json_t *env = json_object_get(config, "Env");
+	if (!env || !json_is_array(env)) goto end;
+	size_t i;
+	for(i=0;i<json_array_size(env);i++) {
+		json_t *item = json_array_get(env, i);
+		if (item && json_is_string(item) && !strncmp(json_string_value(item), DOCKER_SPEC_ENV, sizeof(DOCKER_SPEC_ENV)-1)) {
+			ret = 1;
+			break;
+		}
+	}
+end:
+	if (response) json_decref(response);
+	return ret;
+}
+
+// the only full containers list we do, when the monitor (re)connects to the events stream
+static void docker_registry_populate() {
+	long http_status = 0;
+	json_t *response = docker_json("GET", "/containers/json?all=1", NULL, &http_status);
+	if (!response || !json_is_array(response)) {
+		uwsgi_log("[docker] unable to get containers list\n");
+		goto end;
+	}
+	size_t i, items = json_array_size(response);
+	uint64_t registered = 0;
+	for(i=0;i<items;i++) {
+		json_t *container_object = json_array_get(response, i);
+		if (!container_object || !json_is_object(container_object)) continue;
+		json_t *id = json_object_get(container_object, "Id");
+		json_t *names = json_object_get(container_object, "Names");
+		json_t *status = json_object_get(container_object, "Status");
+		if (!id || !json_is_string(id) || !names || !json_is_array(names)) continue;
+		json_t *name = json_array_get(names, 0);
+		if (!name || !json_is_string(name)) continue;
+		char *value = (char *) json_string_value(name);
+		if (value[0] == '/') value++;
+		// the list does not report the env, only the containers created by bridges are registered
+		if (!docker_registry_owned((char *) json_string_value(id))) continue;
+		int state = DOCKER_STATE_CREATED;
+		if (status && json_is_string(status)) {
+			state = docker_state_from_status((char *) json_string_value(status));
+		}
+		docker_registry_set(value, (char *) json_string_value(id), state, 0);
+		registered++;
+	}
+	udocker.shared->ready = 1;
+	uwsgi_log("[docker] containers registry ready (%llu containers)\n", (unsigned long long) registered);
+end:
+	if (response) json_decref(response);
+}
+
+static void docker_event(json_t *event) {
+	// newer daemons report events for images, networks and volumes too
+	json_t *type = json_object_get(event, "Type");
+	if (type && json_is_string(type) && strcmp(json_string_value(type), "container")) return;
+
+	// API >= 1.22 reports Action and Actor.ID, older daemons only status and id
+	json_t *json_status = json_object_get(event, "Action");
+	if (!json_status || !json_is_string(json_status)) json_status = json_object_get(event, "status");
+	json_t *json_id = NULL;
+	json_t *actor = json_object_get(event, "Actor");
+	if (actor && json_is_object(actor)) json_id = json_object_get(actor, "ID");
+	if (!json_id || !json_is_string(json_id)) json_id = json_object_get(event, "id");
+	if (!json_status || !json_is_string(json_status) || !json_id || !json_is_string(json_id)) return;
+	char *status = (char *) json_string_value(json_status);
+	char *id = (char *) json_string_value(json_id);
+
+	// the oom event is followed by die, it only marks the container
+	int oom = !strcmp(status, "oom");
+	int state = -1;
+	if (!strcmp(status, "create")) state = DOCKER_STATE_CREATED;
+	else if (!strcmp(status, "start") || !strcmp(status, "restart") || !strcmp(status, "unpause")) state = DOCKER_STATE_RUNNING;
+	else if (!strcmp(status, "die")) state = DOCKER_STATE_DEAD;
+	else if (!strcmp(status, "stop")) state = DOCKER_STATE_STOPPED;
+	else if (!strcmp(status, "pause")) state = DOCKER_STATE_PAUSED;
+	else if (!strcmp(status, "destroy")) state = DOCKER_STATE_DESTROYED;
+	if (state < 0 && !oom) return;
+
+	udocker.shared->events++;
+
+	pid_t bridge = 0;
+	uint64_t bridge_start = 0;
+	char name[0xff];
+	docker_shared_lock();
+	struct uwsgi_docker_container *dc = docker_registry_slot_by_id(id);
+	if (dc) {
+		if (oom) {
+			dc->oom = 1;
+		}
+		else {
+			dc->state = state;
+		}
+		dc->updated = uwsgi_micros();
+		if (state == DOCKER_STATE_DEAD) {
+			bridge = dc->bridge;
+			bridge_start = dc->bridge_start;
+		}
+		if (state == DOCKER_STATE_DESTROYED) dc->bridge = 0;
+		memcpy(name, dc->name, sizeof(name));
+	}
+	docker_shared_unlock();
+
+	// containers not created by a bridge are not tracked (bridges register theirs after the create request)
+	if (!dc) return;
+
+	if (oom) {
+		uwsgi_log("[docker] container %s (%s) is out of memory\n", id, name);
+		return;
+	}
+
+	// the bridge will destroy the container and let the Emperor respawn the vassal
+	if (bridge > 0) {
+		// the bridge could have been killed (and its pid recycled)
+		if (!docker_bridge_alive(bridge, bridge_start)) return;
+		uwsgi_log("[docker] container %s (%s) died, notifying bridge %d\n", id, name, (int) bridge);
+		kill(bridge, DOCKER_DEATH_SIGNAL);
+	}
+}
+
+// parse the events in the buffer, returns -1 on error
+static int docker_events_consume(struct uwsgi_buffer *ub, int *headers) {
+	size_t pos = 0;
+	if (!*headers) {
+		char *end = memmem(ub->buf, ub->pos, "\r\n\r\n", 4);
+		if (!end) return 0;
+		if (ub->pos < 12 || strncmp(ub->buf + 9, "200", 3)) {
+			uwsgi_log("[docker] unable to subscribe to the events stream: %.*s\n", (int) (end - ub->buf), ub->buf);
+			return -1;
+		}
+		pos = (end + 4) - ub->buf;
+		*headers = 1;
+	}
+
+	// events are concatenated json objects (newer daemons add a newline after each one)
+	while(pos < ub->pos) {
+		if (isspace((int) ub->buf[pos])) {
+			pos++;
+			continue;
+		}
+		json_error_t error;
+		json_t *event = json_loadb(ub->buf + pos, ub->pos - pos, JSON_DISABLE_EOF_CHECK, &error);
+		// incomplete object, wait for more data
+		if (!event) break;
+		pos += error.position;
+		if (json_is_object(event)) docker_event(event);
+		json_decref(event);
+	}
+
+	if (pos > 0) {
+		memmove(ub->buf, ub->buf + pos, ub->pos - pos);
+		ub->pos -= pos;
+	}
+
+	// no event should be so big, the stream is corrupted
+	if (ub->pos > 1024 * 1024) {
+		uwsgi_log("[docker] invalid events stream\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int docker_events_connect() {
+	int fd = uwsgi_connect(udocker.socket, uwsgi.socket_timeout, 0);
+	if (fd < 0) return -1;
+	// HTTP/1.0 avoids chunked encoding, the stream ends when the connection is closed
+	char request[64];
+	snprintf(request, sizeof(request), "GET %s/events HTTP/1.0\r\n\r\n", udocker.api_prefix);
+	if (uwsgi_write_nb(fd, request, strlen(request), uwsgi.socket_timeout)) {
+		uwsgi_error("docker_events_connect()/write()");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// send fds (and a body) over a UNIX socket
+int docker_send_fds(int fd, char *body, size_t len, int *fds, int count) {
+	struct msghdr msg;
+	struct iovec iov;
+	char control[CMSG_SPACE(sizeof(int) * 8)];
+	if (count > 8) return -1;
+	memset(&msg, 0, sizeof(struct msghdr));
+	memset(control, 0, sizeof(control));
+	iov.iov_base = body;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	// a body without fds
+	if (count > 0) {
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+	}
+	if (sendmsg(fd, &msg, 0) != (ssize_t) len) {
+		uwsgi_error("docker_send_fds()/sendmsg()");
+		return -1;
+	}
+	return 0;
+}
+
+// receive fds (and a body of exactly len bytes), returns the number of fds or -1
+int docker_recv_fds(int fd, char *body, size_t len, int *fds, int count) {
+	struct msghdr msg;
+	struct iovec iov;
+	char control[CMSG_SPACE(sizeof(int) * 8)];
+	if (count > 8) return -1;
+	memset(&msg, 0, sizeof(struct msghdr));
+	iov.iov_base = body;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t rlen = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	if (rlen < 0) {
+		if (!uwsgi_is_again()) uwsgi_error("docker_recv_fds()/recvmsg()");
+		return -1;
+	}
+	int received = 0;
+	struct cmsghdr *cmsg;
+	for(cmsg = CMSG_FIRSTHDR(&msg);cmsg;cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+		int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int *cfds = (int *) CMSG_DATA(cmsg);
+		int i;
+		for(i=0;i<n;i++) {
+			if (received < count) fds[received++] = cfds[i];
+			else close(cfds[i]);
+		}
+	}
+	// a truncated message is useless
+	if ((size_t) rlen != len) {
+		int i;
+		for(i=0;i<received;i++) close(fds[i]);
+		return 0;
+	}
+	return received;
+}
+
+struct docker_stream;
+struct docker_collector;
+struct docker_stats_client;
+
+struct docker_peer {
+	int type;
+	int fd;
+	struct docker_stream *stream;
+	struct docker_collector *collector;
+	struct docker_stats_client *client;
+};
+
+// an attach stream handed to the monitor by a bridge
+struct docker_stream {
+	struct docker_peer attach;
+	// closed by the monitor when the stream ends, closed by the bridge when it dies
+	struct docker_peer bridge;
+	pid_t pid;
+	char name[0xff];
+	char id[65];
+	struct docker_log *log;
+	// both peers can fire in the same epoll batch, so the stream is freed only after it
+	int dead;
+	struct docker_stream *prev;
+	struct docker_stream *next;
+};
+
+// the stats stream of a container (--docker-metrics)
+struct docker_collector {
+	struct docker_peer peer;
+	char id[65];
+	// still managed by a bridge (at the last sync)
+	int seen;
+	// waiting for the connection to complete
+	int connecting;
+	// broken streams in a row and the time of the next attempt
+	int failures;
+	uint64_t retry;
+	// the daemon does not know the container
+	int gone;
+	struct docker_metrics *metrics;
+	struct docker_collector *prev;
+	struct docker_collector *next;
+};
+
+// a stats server client still receiving its document
+struct docker_stats_client {
+	struct docker_peer peer;
+	char *body;
+	size_t len;
+	size_t pos;
+	uint64_t deadline;
+	struct docker_stats_client *prev;
+	struct docker_stats_client *next;
+};
+
+// sent by the bridges over the monitor channel
+struct docker_handoff {
+	int type;
+	pid_t pid;
+	int tty;
+	char name[0xff];
+	char id[65];
+	// the address of the vassal socket and its shards (DOCKER_HANDOFF_SOCKET)
+	char socket[0xff];
+	int shards;
+};
+
+// an attach stream (with the bridge notification socket and the log fds)
+#define DOCKER_HANDOFF_ATTACH 0
+// a request for the vassal socket (with the socket for the reply)
+#define DOCKER_HANDOFF_SOCKET 1
+// a bridge registered its vassal socket in its slot (no fds)
+#define DOCKER_HANDOFF_IDLE 2
+
+// the vassal sockets watched by an idle bridge
+struct docker_idle_watch {
+	uint64_t slot;
+	int ports[DOCKER_SHARDS_MAX];
+	unsigned char addrs[DOCKER_SHARDS_MAX][16];
+	uint32_t paths[DOCKER_SHARDS_MAX];
+	int count;
+	int connections;
+};
+
+// vassal sockets kept by the monitor (--docker-rolling), shared by all of the containers of a vassal
+struct docker_kept_socket {
+	char address[0xff];
+	int fd;
+	// the last bridge asking for it, and when it has been found dead
+	pid_t bridge;
+	uint64_t bridge_start;
+	uint64_t orphaned;
+	struct docker_kept_socket *next;
+};
+
+#define DOCKER_PEER_EMPEROR 0
+#define DOCKER_PEER_EVENTS 1
+#define DOCKER_PEER_CHANNEL 2
+#define DOCKER_PEER_ATTACH 3
+#define DOCKER_PEER_BRIDGE 4
+#define DOCKER_PEER_STATS 5
+#define DOCKER_PEER_METRICS 6
+#define DOCKER_PEER_STATS_CLIENT 7
+
+static struct docker_monitor {
+	int epoll_fd;
+	struct docker_peer emperor;
+	struct docker_peer events;
+	struct docker_peer channel;
+	struct docker_peer stats;
+	struct uwsgi_buffer *events_buf;
+	int events_headers;
+	struct docker_stream *streams;
+	// destroyed in the current epoll batch
+	struct docker_stream *dead;
+	struct docker_kept_socket *sockets;
+	struct docker_collector *collectors;
+	uint64_t collected;
+	struct docker_stats_client *clients;
+	// some bridge is watching its vassal socket
+	int idle;
+	uint64_t idle_scanned;
+	struct docker_idle_watch *idle_watches;
+} dmonitor;
+
+static void docker_monitor_watch(struct docker_peer *peer, uint32_t events) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = events;
+	ev.data.ptr = peer;
+	if (epoll_ctl(dmonitor.epoll_fd, EPOLL_CTL_ADD, peer->fd, &ev)) {
+		uwsgi_error("docker_monitor_watch()/epoll_ctl()");
+		exit(1);
+	}
+}
+
+static void docker_monitor_add(struct docker_peer *peer) {
+	docker_monitor_watch(peer, EPOLLIN);
+}
+
+static void docker_monitor_modify(struct docker_peer *peer, uint32_t events) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = events;
+	ev.data.ptr = peer;
+	if (epoll_ctl(dmonitor.epoll_fd, EPOLL_CTL_MOD, peer->fd, &ev)) {
+		uwsgi_error("docker_monitor_modify()/epoll_ctl()");
+		exit(1);
+	}
+}
+
+// closing the fd removes it from the epoll set
+static void docker_monitor_del(struct docker_peer *peer) {
+	if (peer->fd > -1) close(peer->fd);
+	peer->fd = -1;
+}
+
+static void docker_stream_destroy(struct docker_stream *ds) {
+	if (ds->dead) return;
+	docker_monitor_del(&ds->attach);
+	// this wakes up the bridge
+	docker_monitor_del(&ds->bridge);
+	if (ds->prev) ds->prev->next = ds->next;
+	else dmonitor.streams = ds->next;
+	if (ds->next) ds->next->prev = ds->prev;
+	ds->dead = 1;
+	ds->prev = NULL;
+	ds->next = dmonitor.dead;
+	dmonitor.dead = ds;
+}
+
+// free the streams destroyed in the last epoll batch
+static void docker_streams_reap() {
+	while(dmonitor.dead) {
+		struct docker_stream *ds = dmonitor.dead;
+		dmonitor.dead = ds->next;
+		docker_log_destroy(ds->log);
+		free(ds);
+	}
+}
+
+static void docker_stream_read(struct docker_stream *ds) {
+	if (docker_log_read(ds->log, ds->attach.fd)) {
+		uwsgi_log("[docker] attach stream of container %s (%s) closed\n", ds->id, ds->name);
+		docker_stream_destroy(ds);
+	}
+}
+
+// send the vassal socket to a bridge, binding it on the first request
+static void docker_keeper_send(struct docker_handoff *dh, int reply_fd) {
+	dh->name[sizeof(dh->name)-1] = 0;
+	dh->socket[sizeof(dh->socket)-1] = 0;
+	struct docker_kept_socket *ks = dmonitor.sockets;
+	while(ks) {
+		if (!strcmp(ks->address, dh->socket)) break;
+		ks = ks->next;
+	}
+	if (!ks) {
+		int fd = -1;
+		char *tcp_port = strchr(dh->socket, ':');
+		if (tcp_port) {
+			// the other shards are bound by the bridges on the same port
+			if (dh->shards > 1) uwsgi.reuse_port = 1;
+			fd = bind_to_tcp(dh->socket, uwsgi.listen_queue, tcp_port);
+		}
+		else {
+			fd = bind_to_unix(dh->socket, uwsgi.listen_queue, uwsgi.chmod_socket, 0);
+		}
+		if (fd < 0) {
+			uwsgi_log("[docker] unable to bind socket %s for vassal %s\n", dh->socket, dh->name);
+			close(reply_fd);
+			return;
+		}
+		ks = uwsgi_calloc(sizeof(struct docker_kept_socket));
+		strcpy(ks->address, dh->socket);
+		ks->fd = fd;
+		ks->next = dmonitor.sockets;
+		dmonitor.sockets = ks;
+		uwsgi_log("[docker] keeping socket %s for vassal %s\n", ks->address, dh->name);
+	}
+	ks->bridge = dh->pid;
+	ks->bridge_start = docker_pid_start(dh->pid);
+	ks->orphaned = 0;
+	docker_send_fds(reply_fd, "s", 1, &ks->fd, 1);
+	close(reply_fd);
+}
+
+// close the sockets no bridge used for --docker-rolling-grace seconds (the vassal is gone)
+static void docker_keeper_release() {
+	uint64_t now = uwsgi_now();
+	struct docker_kept_socket *ks = dmonitor.sockets, *prev = NULL;
+	while(ks) {
+		struct docker_kept_socket *next = ks->next;
+		if (docker_bridge_alive(ks->bridge, ks->bridge_start)) {
+			ks->orphaned = 0;
+		}
+		else if (!ks->orphaned) {
+			ks->orphaned = now;
+		}
+		else if (now - ks->orphaned >= (uint64_t) udocker.rolling_grace) {
+			uwsgi_log("[docker] socket %s unused for %d seconds, closing it\n", ks->address, udocker.rolling_grace);
+			close(ks->fd);
+			if (!strchr(ks->address, ':')) unlink(ks->address);
+			if (prev) prev->next = next;
+			else dmonitor.sockets = next;
+			free(ks);
+			ks = next;
+			continue;
+		}
+		prev = ks;
+		ks = next;
+	}
+}
+
+// receive an attach stream (or a socket request) from a bridge
+static void docker_channel_read() {
+	for(;;) {
+		struct docker_handoff dh;
+		// attach stream, bridge notification socket, stdout and stderr
+		int fds[4];
+		int count = docker_recv_fds(dmonitor.channel.fd, (char *) &dh, sizeof(struct docker_handoff), fds, 4);
+		if (count < 0) return;
+		if (count == 1 && dh.type == DOCKER_HANDOFF_SOCKET) {
+			docker_keeper_send(&dh, fds[0]);
+			continue;
+		}
+		// start scanning /proc/net every second
+		if (count == 0 && dh.type == DOCKER_HANDOFF_IDLE) {
+			dmonitor.idle = 1;
+			continue;
+		}
+		if (count != 4) {
+			uwsgi_log("[docker] invalid handoff on the monitor channel\n");
+			int i;
+			for(i=0;i<count;i++) close(fds[i]);
+			continue;
+		}
+		struct docker_stream *ds = uwsgi_calloc(sizeof(struct docker_stream));
+		ds->attach.type = DOCKER_PEER_ATTACH;
+		ds->attach.fd = fds[0];
+		ds->attach.stream = ds;
+		ds->bridge.type = DOCKER_PEER_BRIDGE;
+		ds->bridge.fd = fds[1];
+		ds->bridge.stream = ds;
+		ds->pid = dh.pid;
+		dh.name[sizeof(dh.name)-1] = 0;
+		dh.id[sizeof(dh.id)-1] = 0;
+		strcpy(ds->name, dh.name);
+		strcpy(ds->id, dh.id);
+		ds->log = docker_log_new(dh.tty, fds[2], fds[3], docker_registry_lookup(ds->name), 1);
+		uwsgi_socket_nb(ds->attach.fd);
+		docker_monitor_add(&ds->attach);
+		docker_monitor_add(&ds->bridge);
+		ds->next = dmonitor.streams;
+		if (dmonitor.streams) dmonitor.streams->prev = ds;
+		dmonitor.streams = ds;
+		if (udocker.debug) {
+			uwsgi_log("[docker-debug] bridge %d handed attach stream of container %s (%s)\n", (int) ds->pid, ds->id, ds->name);
+		}
+	}
+}
+
+static void docker_events_read() {
+	char buf[8192];
+	ssize_t rlen = read(dmonitor.events.fd, buf, 8192);
+	if (rlen <= 0 || uwsgi_buffer_append(dmonitor.events_buf, buf, rlen) || docker_events_consume(dmonitor.events_buf, &dmonitor.events_headers)) {
+		uwsgi_log("[docker] lost connection with the events stream, reconnecting...\n");
+		udocker.shared->ready = 0;
+		docker_monitor_del(&dmonitor.events);
+	}
+}
+
+static void docker_events_subscribe() {
+	dmonitor.events.fd = docker_events_connect();
+	if (dmonitor.events.fd < 0) return;
+	dmonitor.events_buf->pos = 0;
+	dmonitor.events_headers = 0;
+	docker_monitor_add(&dmonitor.events);
+	// subscribe before the list, so we do not miss any event
+	docker_registry_populate();
+}
+
+static void docker_collector_destroy(struct docker_collector *dcol) {
+	docker_monitor_del(&dcol->peer);
+	docker_metrics_destroy(dcol->metrics);
+	if (dcol->prev) dcol->prev->next = dcol->next;
+	else dmonitor.collectors = dcol->next;
+	if (dcol->next) dcol->next->prev = dcol->prev;
+	free(dcol);
+}
+
+// seconds between two attempts of a broken stream (doubled at each failure)
+#define DOCKER_COLLECTOR_RETRY 1
+#define DOCKER_COLLECTOR_RETRY_MAX 60
+
+// the stream broke (or never started), try again later
+static void docker_collector_failed(struct docker_collector *dcol) {
+	docker_monitor_del(&dcol->peer);
+	dcol->connecting = 0;
+	uint64_t delay = DOCKER_COLLECTOR_RETRY;
+	int i;
+	for(i=0;i<dcol->failures && delay < DOCKER_COLLECTOR_RETRY_MAX;i++) delay *= 2;
+	if (delay > DOCKER_COLLECTOR_RETRY_MAX) delay = DOCKER_COLLECTOR_RETRY_MAX;
+	dcol->failures++;
+	dcol->retry = uwsgi_micros() + (delay * 1000000);
+}
+
+static void docker_collector_connect(struct docker_collector *dcol) {
+	dcol->peer.fd = docker_metrics_connect();
+	if (dcol->peer.fd < 0) {
+		docker_collector_failed(dcol);
+		return;
+	}
+	dcol->connecting = 1;
+	docker_monitor_watch(&dcol->peer, EPOLLOUT);
+}
+
+static void docker_collector_event(struct docker_collector *dcol) {
+	if (dcol->connecting) {
+		if (docker_metrics_request(dcol->metrics, dcol->peer.fd, dcol->id)) {
+			docker_collector_failed(dcol);
+			return;
+		}
+		dcol->connecting = 0;
+		docker_monitor_modify(&dcol->peer, EPOLLIN);
+		return;
+	}
+	int ret = docker_metrics_read(dcol->metrics, dcol->peer.fd);
+	if (ret == -2) {
+		if (udocker.debug) uwsgi_log("[docker-debug] no stats for container %s, not asking again\n", dcol->id);
+		docker_monitor_del(&dcol->peer);
+		dcol->gone = 1;
+		return;
+	}
+	// the container stopped (the bridge will tell at the next sync) or the stream broke
+	if (ret) {
+		docker_collector_failed(dcol);
+		return;
+	}
+	dcol->failures = 0;
+}
+
+static struct docker_collector *docker_collector_find(char *id) {
+	struct docker_collector *dcol = dmonitor.collectors;
+	while(dcol) {
+		if (!strcmp(dcol->id, id)) return dcol;
+		dcol = dcol->next;
+	}
+	return NULL;
+}
+
+// open the stats streams of the new containers of the bridges and close the ones of the dead containers (at most once a second)
+static void docker_collectors_sync() {
+	uint64_t now = uwsgi_micros();
+	if (now - dmonitor.collected < 1000000) return;
+	dmonitor.collected = now;
+
+	struct docker_collector *dcol = dmonitor.collectors;
+	while(dcol) {
+		dcol->seen = 0;
+		dcol = dcol->next;
+	}
+
+	uint64_t i;
+	docker_shared_lock();
+	for(i=0;i<udocker.shared->slots;i++) {
+		struct uwsgi_docker_container *dc = &udocker.shared->containers[i];
+		if (!dc->name[0] || !dc->id[0] || dc->bridge <= 0) continue;
+		if (dc->state != DOCKER_STATE_CREATED && dc->state != DOCKER_STATE_RUNNING && dc->state != DOCKER_STATE_PAUSED) continue;
+		dcol = docker_collector_find(dc->id);
+		if (!dcol) {
+			// connected after releasing the lock
+			dcol = uwsgi_calloc(sizeof(struct docker_collector));
+			dcol->peer.type = DOCKER_PEER_METRICS;
+			dcol->peer.fd = -1;
+			dcol->peer.collector = dcol;
+			dcol->metrics = docker_metrics_new();
+			memcpy(dcol->id, dc->id, sizeof(dcol->id));
+			dcol->next = dmonitor.collectors;
+			if (dmonitor.collectors) dmonitor.collectors->prev = dcol;
+			dmonitor.collectors = dcol;
+		}
+		dcol->seen = 1;
+	}
+	docker_shared_unlock();
+
+	dcol = dmonitor.collectors;
+	while(dcol) {
+		struct docker_collector *next = dcol->next;
+		if (!dcol->seen) {
+			docker_collector_destroy(dcol);
+		}
+		// not connected yet (or waiting for a retry)
+		else if (dcol->peer.fd < 0 && !dcol->gone && dcol->retry <= now) {
+			docker_collector_connect(dcol);
+		}
+		dcol = next;
+	}
+}
+
+static void docker_stats_client_destroy(struct docker_stats_client *dsc) {
+	docker_monitor_del(&dsc->peer);
+	free(dsc->body);
+	if (dsc->prev) dsc->prev->next = dsc->next;
+	else dmonitor.clients = dsc->next;
+	if (dsc->next) dsc->next->prev = dsc->prev;
+	free(dsc);
+}
+
+// write what the client socket accepts, returns -1 when the client is done (or gone)
+static int docker_stats_client_write(struct docker_stats_client *dsc) {
+	while(dsc->pos < dsc->len) {
+		ssize_t wlen = write(dsc->peer.fd, dsc->body + dsc->pos, dsc->len - dsc->pos);
+		if (wlen < 0) {
+			if (errno == EINTR) continue;
+			if (uwsgi_is_again()) return 0;
+			return -1;
+		}
+		dsc->pos += wlen;
+	}
+	return -1;
+}
+
+static void docker_stats_accept() {
+	int client_fd = accept(dmonitor.stats.fd, NULL, NULL);
+	if (client_fd < 0) {
+		uwsgi_error("docker_stats_accept()/accept()");
+		return;
+	}
+	char *body = docker_stats_body();
+	if (!body) {
+		close(client_fd);
+		return;
+	}
+	uwsgi_socket_nb(client_fd);
+	struct docker_stats_client *dsc = uwsgi_calloc(sizeof(struct docker_stats_client));
+	dsc->peer.type = DOCKER_PEER_STATS_CLIENT;
+	dsc->peer.fd = client_fd;
+	dsc->peer.client = dsc;
+	dsc->body = body;
+	dsc->len = strlen(body);
+	dsc->deadline = uwsgi_micros() + ((uint64_t) uwsgi.socket_timeout * 1000000);
+	dsc->next = dmonitor.clients;
+	if (dmonitor.clients) dmonitor.clients->prev = dsc;
+	dmonitor.clients = dsc;
+	if (docker_stats_client_write(dsc)) {
+		docker_stats_client_destroy(dsc);
+		return;
+	}
+	// the rest is written when the client reads
+	docker_monitor_watch(&dsc->peer, EPOLLOUT);
+}
+
+// drop the clients not reading their document within --socket-timeout
+static void docker_stats_expire() {
+	uint64_t now = uwsgi_micros();
+	struct docker_stats_client *dsc = dmonitor.clients;
+	while(dsc) {
+		struct docker_stats_client *next = dsc->next;
+		if (now > dsc->deadline) docker_stats_client_destroy(dsc);
+		dsc = next;
+	}
+}
+
+// parse a /proc/net/tcp (or tcp6) line: the local address (ipv4 ones are mapped to ipv6, the wildcard is all zeros),
+// the local port and the state. Addresses are printed as the hex of the (network order) 32 bits words in memory
+int docker_proc_tcp_parse(char *line, unsigned char *addr, int *port, int *st) {
+	char hex[33];
+	unsigned int lport = 0, state = 0;
+	// sl local_address rem_address st
+	if (sscanf(line, "%*s %32[0-9A-Fa-f]:%x %*s %x", hex, &lport, &state) != 3) return -1;
+	size_t len = strlen(hex);
+	if (len != 8 && len != 32) return -1;
+	uint32_t words[4];
+	size_t i;
+	for(i=0;i<len/8;i++) {
+		char word[9];
+		memcpy(word, hex + (i * 8), 8);
+		word[8] = 0;
+		words[i] = strtoul(word, NULL, 16);
+	}
+	memset(addr, 0, 16);
+	if (len == 32) {
+		memcpy(addr, words, 16);
+	}
+	else if (words[0]) {
+		addr[10] = 0xff;
+		addr[11] = 0xff;
+		memcpy(addr + 12, &words[0], 4);
+	}
+	*port = lport;
+	*st = state;
+	return 0;
+}
+
+// count the connections of the watched sockets in a /proc/net file (unix sockets are matched by the hash of their path,
+// tcp ones by their port and address, unless bound to the wildcard)
+static void docker_idle_parse(char *file, int unix_sockets, struct docker_idle_watch *watches, int count) {
+	char line[512];
+	FILE *f = fopen(file, "r");
+	if (!f) return;
+	while(fgets(line, sizeof(line), f)) {
+		int i, j;
+		if (unix_sockets) {
+			unsigned int st = 0;
+			char path[256];
+			path[0] = 0;
+			// Num RefCount Protocol Flags Type St Inode Path
+			if (sscanf(line, "%*s %*s %*s %*s %*s %x %*s %255s", &st, path) < 2) continue;
+			// 03 -> connected
+			if (st != 3) continue;
+			uint32_t hash = djb33x_hash(path, strlen(path));
+			for(i=0;i<count;i++) {
+				for(j=0;j<watches[i].count;j++) {
+					if (watches[i].paths[j] && watches[i].paths[j] == hash) watches[i].connections++;
+				}
+			}
+			continue;
+		}
+		unsigned char addr[16];
+		static unsigned char any[16];
+		int port = 0, st = 0;
+		if (docker_proc_tcp_parse(line, addr, &port, &st)) continue;
+		// 01 -> established
+		if (st != 1) continue;
+		for(i=0;i<count;i++) {
+			for(j=0;j<watches[i].count;j++) {
+				if (!watches[i].ports[j] || watches[i].ports[j] != port) continue;
+				if (memcmp(watches[i].addrs[j], any, 16) && memcmp(watches[i].addrs[j], addr, 16)) continue;
+				watches[i].connections++;
+			}
+		}
+	}
+	fclose(f);
+}
+
+// count the connections of the sockets watched by the bridges (once per second), /proc/net is parsed without the lock
+static void docker_idle_scan() {
+	uint64_t now = uwsgi_now();
+	if (now == dmonitor.idle_scanned) return;
+	dmonitor.idle_scanned = now;
+	if (!dmonitor.idle_watches) {
+		dmonitor.idle_watches = uwsgi_malloc(sizeof(struct docker_idle_watch) * udocker.shared->slots);
+	}
+	struct docker_idle_watch *watches = dmonitor.idle_watches;
+	int count = 0, paths = 0, ports = 0;
+	uint64_t i;
+	docker_shared_lock();
+	for(i=0;i<udocker.shared->slots;i++) {
+		struct uwsgi_docker_container *dc = &udocker.shared->containers[i];
+		if (!dc->idle_sockets) continue;
+		if (!docker_bridge_alive(dc->bridge, dc->bridge_start)) continue;
+		watches[count].slot = i;
+		watches[count].count = dc->idle_sockets;
+		memcpy(watches[count].ports, dc->idle_ports, sizeof(dc->idle_ports));
+		memcpy(watches[count].addrs, dc->idle_addrs, sizeof(dc->idle_addrs));
+		memcpy(watches[count].paths, dc->idle_paths, sizeof(dc->idle_paths));
+		watches[count].connections = 0;
+		int j;
+		for(j=0;j<dc->idle_sockets;j++) {
+			if (dc->idle_paths[j]) paths++;
+			else ports++;
+		}
+		count++;
+	}
+	docker_shared_unlock();
+	// nobody is watching anymore, wait for the next registration
+	if (!count) {
+		dmonitor.idle = 0;
+		return;
+	}
+	if (paths) docker_idle_parse("/proc/net/unix", 1, watches, count);
+	if (ports) {
+		docker_idle_parse("/proc/net/tcp", 0, watches, count);
+		docker_idle_parse("/proc/net/tcp6", 0, watches, count);
+	}
+	uint64_t scanned = uwsgi_micros();
+	docker_shared_lock();
+	int j;
+	for(j=0;j<count;j++) {
+		struct uwsgi_docker_container *dc = &udocker.shared->containers[watches[j].slot];
+		dc->idle_connections = watches[j].connections;
+		dc->idle_scanned = scanned;
+	}
+	docker_shared_unlock();
+}
+
+// the resource usage of a container (called by the stats server)
+json_t *docker_monitor_metrics(char *id) {
+	struct docker_collector *dcol = docker_collector_find(id);
+	if (!dcol) return NULL;
+	return docker_metrics_json(dcol->metrics);
+}
+
+// number of attach streams currently managed by the monitor
+uint64_t docker_monitor_streams() {
+	uint64_t count = 0;
+	struct docker_stream *ds = dmonitor.streams;
+	while(ds) {
+		count++;
+		ds = ds->next;
+	}
+	return count;
+}
+
+// the Emperor is gone: remove the containers of the bridges (and the warm pool) in parallel,
+// instead of waiting for each bridge to stop and delete its own container
+static void docker_monitor_teardown() {
+	char **ids = uwsgi_calloc(sizeof(char *) * (udocker.shared->slots + DOCKER_POOL_SLOTS));
+	int i, count = 0;
+	// containers must survive for being adopted by the next Emperor
+	if (!udocker.adopt) {
+		uint64_t j;
+		docker_shared_lock();
+		for(j=0;j<udocker.shared->slots;j++) {
+			struct uwsgi_docker_container *dc = &udocker.shared->containers[j];
+			if (!dc->name[0] || !dc->id[0] || dc->state == DOCKER_STATE_DESTROYED) continue;
+			// the stopped containers kept by --docker-reuse have a spec (and no bridge)
+			if (dc->bridge <= 0 && !dc->spec) continue;
+			ids[count++] = uwsgi_str(dc->id);
+		}
+		docker_shared_unlock();
+	}
+	count += docker_pool_collect(ids + count);
+	if (count > 0) {
+		uwsgi_log("[docker] the Emperor is gone, removing %d containers...\n", count);
+		docker_teardown(ids, count);
+	}
+	for(i=0;i<count;i++) free(ids[i]);
+	free(ids);
+}
+
+static void docker_monitor_loop() {
+	dmonitor.epoll_fd = epoll_create(64);
+	if (dmonitor.epoll_fd < 0) {
+		uwsgi_error("docker_monitor_loop()/epoll_create()");
+		exit(1);
+	}
+
+	dmonitor.emperor.type = DOCKER_PEER_EMPEROR;
+	dmonitor.emperor.fd = udocker.monitor_pipe[0];
+	docker_monitor_add(&dmonitor.emperor);
+
+	dmonitor.channel.type = DOCKER_PEER_CHANNEL;
+	dmonitor.channel.fd = udocker.monitor_channel[0];
+	uwsgi_socket_nb(dmonitor.channel.fd);
+	docker_monitor_add(&dmonitor.channel);
+
+	dmonitor.stats.type = DOCKER_PEER_STATS;
+	dmonitor.stats.fd = -1;
+	if (udocker.stats) {
+		char *tcp_port = strchr(udocker.stats, ':');
+		if (tcp_port) {
+			dmonitor.stats.fd = bind_to_tcp(udocker.stats, uwsgi.listen_queue, tcp_port);
+		}
+		else {
+			dmonitor.stats.fd = bind_to_unix(udocker.stats, uwsgi.listen_queue, uwsgi.chmod_socket, 0);
+		}
+		if (dmonitor.stats.fd < 0) {
+			uwsgi_log("[docker] unable to bind the stats server on %s\n", udocker.stats);
+			exit(1);
+		}
+		uwsgi_log("[docker] stats server enabled on %s\n", udocker.stats);
+		docker_monitor_add(&dmonitor.stats);
+	}
+
+	dmonitor.events.type = DOCKER_PEER_EVENTS;
+	dmonitor.events.fd = -1;
+	dmonitor.events_buf = uwsgi_buffer_new(uwsgi.page_size);
+
+	docker_pool_cleanup();
+
+	for(;;) {
+		if (udocker.events && dmonitor.events.fd < 0) {
+			docker_events_subscribe();
+		}
+
+		if (udocker.metrics) {
+			docker_collectors_sync();
+		}
+
+		if (dmonitor.clients) {
+			docker_stats_expire();
+		}
+
+		if (dmonitor.idle) {
+			docker_idle_scan();
+		}
+
+		if (dmonitor.sockets) {
+			docker_keeper_release();
+		}
+
+		struct epoll_event events[64];
+		// retry connecting to the events stream (sync the stats streams, expire the stats clients, count the idle connections
+		// and release the unused sockets) every second
+		int nevents = epoll_wait(dmonitor.epoll_fd, events, 64, ((udocker.events && dmonitor.events.fd < 0) || udocker.metrics || dmonitor.clients || dmonitor.idle || dmonitor.sockets) ? 1000 : -1);
+		if (nevents < 0) {
+			if (errno == EINTR) continue;
+			uwsgi_error("docker_monitor_loop()/epoll_wait()");
+			exit(1);
+		}
+
+		int i;
+		for(i=0;i<nevents;i++) {
+			struct docker_peer *peer = (struct docker_peer *) events[i].data.ptr;
+			// already closed in this cycle (streams are not freed before the end of the batch)
+			if (peer->fd < 0) continue;
+			switch(peer->type) {
+				// the Emperor is gone
+				case DOCKER_PEER_EMPEROR:
+					docker_monitor_teardown();
+					exit(0);
+				case DOCKER_PEER_EVENTS:
+					docker_events_read();
+					break;
+				case DOCKER_PEER_CHANNEL:
+					docker_channel_read();
+					break;
+				case DOCKER_PEER_ATTACH:
+					docker_stream_read(peer->stream);
+					break;
+				// the bridge died
+				case DOCKER_PEER_BRIDGE:
+					docker_stream_destroy(peer->stream);
+					break;
+				case DOCKER_PEER_METRICS:
+					docker_collector_event(peer->collector);
+					break;
+				case DOCKER_PEER_STATS:
+					docker_stats_accept();
+					break;
+				case DOCKER_PEER_STATS_CLIENT:
+					if (docker_stats_client_write(peer->client)) {
+						docker_stats_client_destroy(peer->client);
+					}
+					break;
+				default:
+					break;
+			}
+		}
+
+		docker_streams_reap();
+	}
+}
+
+void docker_monitor_start() {
+	if (pipe(udocker.monitor_pipe)) {
+		uwsgi_error("docker_monitor_start()/pipe()");
+		exit(1);
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, udocker.monitor_channel)) {
+		uwsgi_error("docker_monitor_start()/socketpair()");
+		exit(1);
+	}
+
+	// the Emperor side is closed on exec (Emperor reloads) and by the bridges
+	if (fcntl(udocker.monitor_pipe[1], F_SETFD, FD_CLOEXEC) || fcntl(udocker.monitor_channel[1], F_SETFD, FD_CLOEXEC)) {
+		uwsgi_error("docker_monitor_start()/fcntl()");
+		exit(1);
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		uwsgi_error("docker_monitor_start()/fork()");
+		exit(1);
+	}
+
+	if (pid > 0) {
+		close(udocker.monitor_pipe[0]);
+		close(udocker.monitor_channel[0]);
+		udocker.shared->monitor = pid;
+		return;
+	}
+
+	close(udocker.monitor_pipe[1]);
+	close(udocker.monitor_channel[1]);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	uwsgi_set_processname("[uwsgi-docker-monitor]");
+	docker_monitor_loop();
+	// never here
+	exit(0);
+}
+
+// called by a bridge: pass the attach stream to the monitor, the returned fd
+// is closed by the monitor when the stream ends
+int docker_monitor_attach(char *name, char *id, int tty, int attach_fd, int *log_fds) {
+	int sp[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp)) {
+		uwsgi_error("docker_monitor_attach()/socketpair()");
+		return -1;
+	}
+	struct docker_handoff dh;
+	memset(&dh, 0, sizeof(struct docker_handoff));
+	dh.type = DOCKER_HANDOFF_ATTACH;
+	dh.pid = getpid();
+	dh.tty = tty;
+	strncpy(dh.name, name, sizeof(dh.name)-1);
+	strncpy(dh.id, id, sizeof(dh.id)-1);
+	int fds[4];
+	fds[0] = attach_fd;
+	fds[1] = sp[1];
+	fds[2] = log_fds[0];
+	fds[3] = log_fds[1];
+	if (docker_send_fds(udocker.monitor_channel[1], (char *) &dh, sizeof(struct docker_handoff), fds, 4)) {
+		close(sp[0]);
+		close(sp[1]);
+		return -1;
+	}
+	close(sp[1]);
+	return sp[0];
+}
+
+// called by a bridge: get the vassal socket kept by the monitor (the same
+// listening socket is passed to all of the containers of the vassal)
+int docker_monitor_socket(char *name, char *address, int shards) {
+	if (!udocker.shared || !udocker.shared->monitor) return -1;
+	struct docker_handoff dh;
+	memset(&dh, 0, sizeof(struct docker_handoff));
+	if (strlen(address) >= sizeof(dh.socket)) return -1;
+	int sp[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp)) {
+		uwsgi_error("docker_monitor_socket()/socketpair()");
+		return -1;
+	}
+	dh.type = DOCKER_HANDOFF_SOCKET;
+	dh.pid = getpid();
+	strncpy(dh.name, name, sizeof(dh.name)-1);
+	strcpy(dh.socket, address);
+	dh.shards = shards;
+	if (docker_send_fds(udocker.monitor_channel[1], (char *) &dh, sizeof(struct docker_handoff), &sp[1], 1)) {
+		close(sp[0]);
+		close(sp[1]);
+		return -1;
+	}
+	close(sp[1]);
+	int fd = -1;
+	char byte;
+	if (uwsgi_waitfd_event(sp[0], uwsgi.socket_timeout, POLLIN) <= 0 || docker_recv_fds(sp[0], &byte, 1, &fd, 1) != 1) {
+		uwsgi_log("[docker] unable to get socket %s from the monitor\n", address);
+		fd = -1;
+	}
+	close(sp[0]);
+	return fd;
+}
+
+// called by a bridge: let the monitor count the connections of the vassal sockets (tcp addresses and ports or unix paths)
+void docker_monitor_idle(struct uwsgi_docker_container *dc, int *ports, unsigned char (*addrs)[16], char **paths, int count) {
+	if (!dc || !udocker.shared->monitor || !count) return;
+	int i;
+	docker_shared_lock();
+	for(i=0;i<count;i++) {
+		dc->idle_ports[i] = ports[i];
+		memcpy(dc->idle_addrs[i], addrs[i], 16);
+		dc->idle_paths[i] = paths[i] ? djb33x_hash(paths[i], strlen(paths[i])) : 0;
+	}
+	dc->idle_sockets = count;
+	dc->idle_scanned = 0;
+	docker_shared_unlock();
+	struct docker_handoff dh;
+	memset(&dh, 0, sizeof(struct docker_handoff));
+	dh.type = DOCKER_HANDOFF_IDLE;
+	dh.pid = getpid();
+	strncpy(dh.name, dc->name, sizeof(dh.name)-1);
+	docker_send_fds(udocker.monitor_channel[1], (char *) &dh, sizeof(struct docker_handoff), NULL, 0);
+}
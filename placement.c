@@ -0,0 +1,237 @@
+#include "docker.h"
+
+extern struct uwsgi_server uwsgi;
+extern struct uwsgi_docker udocker;
+
+/*
+
+	Automatic cpuset placement (--docker-placement).
+
+	The Emperor reads the host topology from sysfs before spawning vassals. Each vassal without
+	a docker-cpuset attribute gets docker-cpus (default 1) cpus of the least loaded NUMA node
+	(the least loaded cpus of it) and the memory of that node.
+
+	Assignments live in the registry slot of the vassal, so every placement only counts the containers
+	still alive: the cpus of dead vassals are given to the next spawns. Running containers are never moved,
+	adopted ones (--docker-adopt) keep the cpus they have been created with, read back from inspect.
+
+*/
+
+// "0-3,8,10-11"
+static int docker_cpulist_parse(char *list, uint64_t *mask) {
+	char *p = list;
+	while(*p) {
+		char *end;
+		long first = strtol(p, &end, 10);
+		if (end == p) return -1;
+		long last = first;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p) return -1;
+		}
+		for(;first<=last;first++) {
+			if (first >= 0 && first < DOCKER_CPUSET_MAX) mask[first / 64] |= 1ULL << (first % 64);
+		}
+		p = end;
+		if (*p != ',') break;
+		p++;
+	}
+	return 0;
+}
+
+static int docker_cpulist_read(char *path, uint64_t *mask) {
+	char buf[4096];
+	FILE *f = fopen(path, "r");
+	if (!f) return -1;
+	char *line = fgets(buf, sizeof(buf), f);
+	fclose(f);
+	if (!line) return -1;
+	return docker_cpulist_parse(line, mask);
+}
+
+static int docker_cpuset_count(uint64_t *mask) {
+	int i, count = 0;
+	for(i=0;i<DOCKER_CPUSET_WORDS;i++) count += __builtin_popcountll(mask[i]);
+	return count;
+}
+
+static int docker_cpuset_has(uint64_t *mask, int cpu) {
+	return (mask[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+// format a cpuset as a cpu list ("0-3,8")
+void docker_cpuset_format(uint64_t *mask, char *buf, size_t len) {
+	size_t pos = 0;
+	int cpu = 0;
+	buf[0] = 0;
+	while(cpu < DOCKER_CPUSET_MAX) {
+		if (!docker_cpuset_has(mask, cpu)) {
+			cpu++;
+			continue;
+		}
+		int last = cpu;
+		while(last + 1 < DOCKER_CPUSET_MAX && docker_cpuset_has(mask, last + 1)) last++;
+		int ret = last > cpu ? snprintf(buf + pos, len - pos, "%s%d-%d", pos ? "," : "", cpu, last) : snprintf(buf + pos, len - pos, "%s%d", pos ? "," : "", cpu);
+		if (ret < 0 || (size_t) ret >= len - pos) return;
+		pos += ret;
+		cpu = last + 1;
+	}
+}
+
+void docker_placement_init() {
+	struct docker_topology *dt = &udocker.topology;
+	int i, cpus = 0;
+	for(i=0;i<DOCKER_NUMA_NODES;i++) {
+		uint64_t mask[DOCKER_CPUSET_WORDS];
+		memset(mask, 0, sizeof(mask));
+		char path[64];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", i);
+		// node ids can be sparse, memory only nodes have no cpus
+		if (docker_cpulist_read(path, mask) || !docker_cpuset_count(mask)) continue;
+		memcpy(dt->cpus[dt->nodes], mask, sizeof(mask));
+		dt->node[dt->nodes] = i;
+		cpus += docker_cpuset_count(mask);
+		dt->nodes++;
+	}
+	// no NUMA support in the kernel
+	if (!dt->nodes) {
+		if (docker_cpulist_read("/sys/devices/system/cpu/online", dt->cpus[0])) {
+			uwsgi_log("[docker] unable to read the cpu topology\n");
+			exit(1);
+		}
+		dt->node[0] = -1;
+		cpus = docker_cpuset_count(dt->cpus[0]);
+		dt->nodes = 1;
+	}
+	uwsgi_log("[docker] cpuset placement enabled (%d NUMA nodes, %d cpus)\n", dt->nodes, cpus);
+}
+
+// pick the cpus of a vassal, node is -1 when the cpus span all of the nodes
+int docker_placement_assign(char *name, int cpus, uint64_t *mask, int *node) {
+	struct docker_topology *dt = &udocker.topology;
+	struct uwsgi_docker_container *me = docker_registry_reserve(name);
+	if (!me) {
+		uwsgi_log("[docker] the containers registry is full, %s is not placed\n", name);
+		return -1;
+	}
+	if (cpus < 1) cpus = 1;
+
+	uint16_t load[DOCKER_CPUSET_MAX];
+	memset(load, 0, sizeof(load));
+	int i, j;
+
+	docker_shared_lock();
+	// the load of a cpu is the number of containers placed on it (our previous placement is replaced)
+	uint64_t k;
+	for(k=0;k<udocker.shared->slots;k++) {
+		struct uwsgi_docker_container *dc = &udocker.shared->containers[k];
+		if (dc == me || !dc->placed || dc->state == DOCKER_STATE_DESTROYED) continue;
+		for(i=0;i<DOCKER_CPUSET_WORDS;i++) {
+			uint64_t word = dc->cpuset[i];
+			while(word) {
+				load[(i * 64) + __builtin_ctzll(word)]++;
+				word &= word - 1;
+			}
+		}
+	}
+
+	// the least loaded node (by the average load of its cpus) with enough cpus
+	int best = -1;
+	double best_load = 0;
+	for(i=0;i<dt->nodes;i++) {
+		int count = docker_cpuset_count(dt->cpus[i]);
+		if (count < cpus) continue;
+		uint64_t sum = 0;
+		for(j=0;j<DOCKER_CPUSET_MAX;j++) {
+			if (docker_cpuset_has(dt->cpus[i], j)) sum += load[j];
+		}
+		double node_load = (double) sum / count;
+		if (best == -1 || node_load < best_load) {
+			best = i;
+			best_load = node_load;
+		}
+	}
+
+	// the vassal does not fit in a single node
+	uint64_t candidates[DOCKER_CPUSET_WORDS];
+	if (best > -1) {
+		memcpy(candidates, dt->cpus[best], sizeof(candidates));
+		*node = dt->node[best];
+	}
+	else {
+		memset(candidates, 0, sizeof(candidates));
+		for(i=0;i<dt->nodes;i++) {
+			for(j=0;j<DOCKER_CPUSET_WORDS;j++) candidates[j] |= dt->cpus[i][j];
+		}
+		*node = -1;
+	}
+
+	// the least loaded cpus of the node
+	memset(mask, 0, sizeof(uint64_t) * DOCKER_CPUSET_WORDS);
+	for(i=0;i<cpus;i++) {
+		int cpu = -1;
+		for(j=0;j<DOCKER_CPUSET_MAX;j++) {
+			if (!docker_cpuset_has(candidates, j) || docker_cpuset_has(mask, j)) continue;
+			if (cpu == -1 || load[j] < load[cpu]) cpu = j;
+		}
+		if (cpu == -1) break;
+		mask[cpu / 64] |= 1ULL << (cpu % 64);
+	}
+
+	memcpy(me->cpuset, mask, sizeof(me->cpuset));
+	me->cpuset_node = *node;
+	me->placed = 1;
+	docker_shared_unlock();
+	return 0;
+}
+
+// record the cpus of an adopted container (it keeps the cpuset it has been created with)
+void docker_placement_adopt(char *name, char *cpus) {
+	struct docker_topology *dt = &udocker.topology;
+	uint64_t mask[DOCKER_CPUSET_WORDS];
+	memset(mask, 0, sizeof(mask));
+	int placed = cpus && *cpus && !docker_cpulist_parse(cpus, mask) && docker_cpuset_count(mask);
+	// the node holding all of the cpus (-1 if they span more nodes)
+	int i, j, node = -1;
+	for(i=0;i<dt->nodes && placed;i++) {
+		for(j=0;j<DOCKER_CPUSET_WORDS;j++) {
+			if (mask[j] & ~dt->cpus[i][j]) break;
+		}
+		if (j == DOCKER_CPUSET_WORDS) {
+			node = dt->node[i];
+			break;
+		}
+	}
+	struct uwsgi_docker_container *me = docker_registry_reserve(name);
+	if (!me) return;
+	docker_shared_lock();
+	memcpy(me->cpuset, mask, sizeof(me->cpuset));
+	me->cpuset_node = node;
+	me->placed = placed;
+	docker_shared_unlock();
+}
+
+// the topology (and the number of containers placed on each node) for the stats server
+json_t *docker_placement_json() {
+	struct docker_topology *dt = &udocker.topology;
+	json_t *nodes = json_array();
+	int i;
+	for(i=0;i<dt->nodes;i++) {
+		uint64_t containers = 0, k;
+		docker_shared_lock();
+		for(k=0;k<udocker.shared->slots;k++) {
+			struct uwsgi_docker_container *dc = &udocker.shared->containers[k];
+			if (dc->placed && dc->state != DOCKER_STATE_DESTROYED && dc->cpuset_node == dt->node[i]) containers++;
+		}
+		docker_shared_unlock();
+		char cpus[DOCKER_CPUSET_MAX * 4];
+		docker_cpuset_format(dt->cpus[i], cpus, sizeof(cpus));
+		json_t *node = json_object();
+		json_object_set_new(node, "node", json_integer(dt->node[i]));
+		json_object_set_new(node, "cpus", json_string(cpus));
+		json_object_set_new(node, "containers", json_integer(containers));
+		json_array_append_new(nodes, node);
+	}
+	return nodes;
+}
@@ -0,0 +1,304 @@
+#include "docker.h"
+
+extern struct uwsgi_server uwsgi;
+extern struct uwsgi_docker udocker;
+
+/*
+
+	The warm pool (--docker-pool <n>) keeps up to n created (never started) containers
+	for each container config (the hash of the create request), so respawns skip the create step
+	(and the setup of the image layers).
+
+	A bridge taking a container from the pool renames it as its vassal and starts it. With the legacy api the binds, ports
+	and dns of the vassal are part of the start request, otherwise (HostConfig on create) they are part of the pool config,
+	but for the binds of the emperor proxy: each warm container mounts a directory of its own (<proxy dir or /tmp>/<pool name>)
+	at DOCKER_PROXY_MOUNT, and the bridge taking it binds its emperor proxy (and zerg) sockets there.
+	Once the instance got its file descriptors, a short lived child of the bridge refills the pool (with the lowest spawn
+	scheduler priority), while the bridge goes on with the logs of its container.
+
+	Pool containers are named uwsgi-pool-<owner>-<n>, where owner is the pid namespace, the pid and the start time of the Emperor:
+	the monitor destroys the pool on Emperor death (with the batched teardown), and on startup the leftovers of the Emperors
+	of the same pid namespace that are gone. Other Emperors (alive, or not visible from here) keep their warm containers.
+
+*/
+
+#define DOCKER_POOL_PREFIX "uwsgi-pool-"
+
+// find an entry in the given state (for the given config), must be called with the lock held
+static struct uwsgi_docker_pool *docker_pool_entry(int state, uint64_t key) {
+	int i;
+	for(i=0;i<DOCKER_POOL_SLOTS;i++) {
+		struct uwsgi_docker_pool *dp = &udocker.pool_entries[i];
+		if (dp->state == state && (state == DOCKER_POOL_EMPTY || dp->key == key)) return dp;
+	}
+	return NULL;
+}
+
+// the inode of the pid namespace of a process (0 if unknown)
+static unsigned long docker_pid_namespace(pid_t pid) {
+	char path[64];
+	char link[64];
+	unsigned long ns = 0;
+	snprintf(path, sizeof(path), "/proc/%d/ns/pid", (int) pid);
+	ssize_t len = readlink(path, link, sizeof(link) - 1);
+	if (len <= 0) return 0;
+	link[len] = 0;
+	// "pid:[4026531836]"
+	if (sscanf(link, "pid:[%lu]", &ns) != 1) return 0;
+	return ns;
+}
+
+void docker_pool_init() {
+	udocker.pool_entries = uwsgi_calloc_shared(sizeof(struct uwsgi_docker_pool) * DOCKER_POOL_SLOTS);
+	pid_t pid = getpid();
+	snprintf(udocker.pool_owner, sizeof(udocker.pool_owner), "%lx-%x-%llx", docker_pid_namespace(pid), (int) pid, (unsigned long long) docker_pid_start(pid));
+}
+
+// check the Emperor owning a warm container is gone, names we cannot parse
+// (or of other pid namespaces) are never considered stale
+static int docker_pool_orphaned(char *pool_name) {
+	unsigned long ns = 0;
+	unsigned int pid = 0;
+	unsigned long long start = 0;
+	int tail = 0;
+	if (sscanf(pool_name + sizeof(DOCKER_POOL_PREFIX) - 1, "%lx-%x-%llx-%*u%n", &ns, &pid, &start, &tail) != 3 || !tail) return 0;
+	if (!ns || ns != docker_pid_namespace(getpid())) return 0;
+	return !docker_bridge_alive((pid_t) pid, start);
+}
+
+static void docker_pool_delete(char *id) {
+	long http_status = 0;
+	char *url = uwsgi_concat3("/containers/", id, "?force=1");
+	json_t *response = docker_json("DELETE", url, NULL, &http_status);
+	free(url);
+	if (response) json_decref(response);
+	if (http_status != 204 && http_status != 404) {
+		uwsgi_log("[docker] unable to delete warm container %s\n", id);
+	}
+}
+
+// put back a warm container we could not use (it is deleted when the pool is full)
+static void docker_pool_put(uint64_t key, char *id, char *pool_name) {
+	docker_shared_lock();
+	struct uwsgi_docker_pool *dp = docker_pool_entry(DOCKER_POOL_EMPTY, 0);
+	if (dp) {
+		dp->key = key;
+		memcpy(dp->id, id, sizeof(dp->id));
+		memcpy(dp->name, pool_name, sizeof(dp->name));
+		dp->state = DOCKER_POOL_READY;
+	}
+	docker_shared_unlock();
+	if (!dp) docker_pool_delete(id);
+}
+
+// the directory mounted by a warm container (must be freed)
+char *docker_pool_path(char *pool_name) {
+	return uwsgi_concat3(udocker.proxy_dir ? udocker.proxy_dir : "/tmp", "/", pool_name);
+}
+
+// get a warm container for the vassal (the returned id, and its pool name, must be freed)
+char *docker_pool_get(char *name, uint64_t key, char **pool_name_out) {
+	if (!udocker.pool_entries) return NULL;
+	for(;;) {
+		char id[65];
+		char pool_name[64];
+		docker_shared_lock();
+		struct uwsgi_docker_pool *dp = docker_pool_entry(DOCKER_POOL_READY, key);
+		if (!dp) {
+			docker_shared_unlock();
+			return NULL;
+		}
+		memcpy(id, dp->id, sizeof(id));
+		memcpy(pool_name, dp->name, sizeof(pool_name));
+		dp->state = DOCKER_POOL_EMPTY;
+		docker_shared_unlock();
+
+		long http_status = 0;
+		int destroyed = 0;
+		for(;;) {
+			http_status = 0;
+			char *url = uwsgi_concat4("/containers/", id, "/rename?name=", name);
+			json_t *response = docker_json("POST", url, NULL, &http_status);
+			free(url);
+			if (response) json_decref(response);
+			// a container (left by a dead bridge) still has the vassal name, destroy it once
+			if (http_status == 409 && !destroyed) {
+				destroyed = 1;
+				if (!docker_destroy(name, NULL)) continue;
+			}
+			break;
+		}
+		if (http_status == 204) {
+			docker_registry_state(pool_name, DOCKER_STATE_DESTROYED);
+			uwsgi_log("[docker] using warm container %s (%s) for %s\n", id, pool_name, name);
+			*pool_name_out = uwsgi_str(pool_name);
+			return uwsgi_str(id);
+		}
+
+		// the daemon does not support renames, we can use the pool name
+		if (http_status == 404) {
+			json_t *container = docker_inspect(id);
+			if (container) {
+				json_decref(container);
+				uwsgi_log("[docker] using warm container %s (%s) for %s\n", id, pool_name, name);
+				*pool_name_out = uwsgi_str(pool_name);
+				return uwsgi_str(id);
+			}
+			// removed behind our back, try the next one
+			uwsgi_log("[docker] warm container %s (%s) is gone\n", id, pool_name);
+			continue;
+		}
+
+		// the container is fine, the next vassal of the config will get it
+		uwsgi_log("[docker] unable to use warm container %s (%s) for %s\n", id, pool_name, name);
+		docker_pool_put(key, id, pool_name);
+		return NULL;
+	}
+}
+
+static void docker_pool_created(void *data, long http_status, json_t *response) {
+	struct uwsgi_docker_pool *dp = (struct uwsgi_docker_pool *) data;
+	json_t *json_container_id = response ? json_object_get(response, "Id") : NULL;
+	docker_shared_lock();
+	if (http_status == 201 && json_container_id && json_is_string(json_container_id) && strlen(json_string_value(json_container_id)) < sizeof(dp->id)) {
+		strcpy(dp->id, json_string_value(json_container_id));
+		dp->state = DOCKER_POOL_READY;
+	}
+	else {
+		dp->state = DOCKER_POOL_EMPTY;
+	}
+	docker_shared_unlock();
+	if (dp->state == DOCKER_POOL_EMPTY) {
+		uwsgi_log("[docker] unable to create warm container %s\n", dp->name);
+	}
+}
+
+// create the missing pool containers of a config (all of them at the same time),
+// with mount each one gets its directory for the emperor proxy
+void docker_pool_refill(char *name, uint64_t key, json_t *body, int mount) {
+	if (!udocker.pool_entries) return;
+	int i, count = 0;
+	struct uwsgi_docker_pool *entries[DOCKER_POOL_SLOTS];
+
+	docker_shared_lock();
+	for(i=0;i<DOCKER_POOL_SLOTS;i++) {
+		struct uwsgi_docker_pool *dp = &udocker.pool_entries[i];
+		if (dp->state != DOCKER_POOL_EMPTY && dp->key == key) count++;
+	}
+	// reserve the entries, so other bridges of the same config do not overfill the pool
+	int missing = 0;
+	while(count + missing < udocker.pool) {
+		struct uwsgi_docker_pool *dp = docker_pool_entry(DOCKER_POOL_EMPTY, 0);
+		if (!dp) break;
+		dp->state = DOCKER_POOL_CREATING;
+		dp->key = key;
+		snprintf(dp->name, sizeof(dp->name), DOCKER_POOL_PREFIX "%s-%llu", udocker.pool_owner, (unsigned long long) ++udocker.shared->pool_counter);
+		entries[missing++] = dp;
+	}
+	docker_shared_unlock();
+
+	if (!missing) return;
+
+	// do not compete with vassals waiting for their spawn
+	docker_spawn_acquire(name, INT_MIN);
+	for(i=0;i<missing;i++) {
+		struct uwsgi_docker_pool *dp = entries[i];
+		json_t *container_body = body;
+		if (mount) {
+			char *dir = docker_pool_path(dp->name);
+			docker_proxy_mkdir(dir);
+			char *dir_bind = uwsgi_concat3(dir, ":", DOCKER_PROXY_MOUNT);
+			container_body = json_deep_copy(body);
+			json_array_append_new(json_object_get(json_object_get(container_body, "HostConfig"), "Binds"), json_string(dir_bind));
+			free(dir_bind);
+			free(dir);
+		}
+		char *url = uwsgi_concat2("/containers/create?name=", dp->name);
+		// the body is serialized when queued
+		int ret = docker_request("POST", url, container_body, uwsgi.socket_timeout, docker_pool_created, dp);
+		free(url);
+		if (mount) json_decref(container_body);
+		// give back the entry
+		if (ret) {
+			docker_shared_lock();
+			dp->state = DOCKER_POOL_EMPTY;
+			docker_shared_unlock();
+		}
+	}
+	docker_requests_run();
+	docker_spawn_release();
+}
+
+// refill the pool from a child, so the bridge does not wait for the lowest scheduler priority
+void docker_pool_refill_async(char *name, uint64_t key, json_t *body, int mount) {
+	if (!udocker.pool_entries) return;
+	// the bridge does not wait for its children
+	signal(SIGCHLD, SIG_IGN);
+	pid_t pid = fork();
+	if (pid < 0) {
+		uwsgi_error("docker_pool_refill_async()/fork()");
+		return;
+	}
+	if (pid > 0) return;
+	char *processname = uwsgi_concat2("[uwsgi-docker-pool] ", name);
+	uwsgi_set_processname(processname);
+	free(processname);
+	// we are not the bridge (the monitor never signals us)
+	signal(DOCKER_DEATH_SIGNAL, SIG_DFL);
+	docker_pool_refill(name, key, body, mount);
+	// skip the atexit hooks of the bridge
+	_exit(0);
+}
+
+// called by the monitor when the Emperor dies, get the ids of the warm containers
+// (ids must have room for DOCKER_POOL_SLOTS items)
+int docker_pool_collect(char **ids) {
+	if (!udocker.pool_entries) return 0;
+	int i, count = 0;
+	docker_shared_lock();
+	for(i=0;i<DOCKER_POOL_SLOTS;i++) {
+		struct uwsgi_docker_pool *dp = &udocker.pool_entries[i];
+		if (dp->state != DOCKER_POOL_READY) continue;
+		dp->state = DOCKER_POOL_EMPTY;
+		ids[count++] = uwsgi_str(dp->id);
+	}
+	docker_shared_unlock();
+	return count;
+}
+
+// called by the monitor on startup: destroy the warm containers of dead Emperors
+void docker_pool_cleanup() {
+	if (!udocker.pool_entries) return;
+	long http_status = 0;
+	json_t *response = docker_json("GET", "/containers/json?all=1", NULL, &http_status);
+	if (!response || !json_is_array(response)) {
+		uwsgi_log("[docker] unable to get containers list\n");
+		goto end;
+	}
+	size_t i, items = json_array_size(response);
+	char **ids = uwsgi_calloc(sizeof(char *) * (items + 1));
+	int count = 0;
+	for(i=0;i<items;i++) {
+		json_t *container_object = json_array_get(response, i);
+		if (!container_object || !json_is_object(container_object)) continue;
+		json_t *id = json_object_get(container_object, "Id");
+		json_t *names = json_object_get(container_object, "Names");
+		if (!id || !json_is_string(id) || !names || !json_is_array(names)) continue;
+		json_t *name = json_array_get(names, 0);
+		if (!name || !json_is_string(name)) continue;
+		char *value = (char *) json_string_value(name);
+		if (value[0] == '/') value++;
+		if (strncmp(value, DOCKER_POOL_PREFIX, sizeof(DOCKER_POOL_PREFIX)-1) || !docker_pool_orphaned(value)) continue;
+		uwsgi_log("[docker] destroying stale warm container %s\n", value);
+		ids[count++] = (char *) json_string_value(id);
+		// and its emperor proxy directory (if any)
+		char *dir = docker_pool_path(value);
+		rmdir(dir);
+		free(dir);
+	}
+	// removed in parallel
+	docker_teardown(ids, count);
+	free(ids);
+end:
+	if (response) json_decref(response);
+}
@@ -0,0 +1,155 @@
+#include "docker.h"
+
+extern struct uwsgi_server uwsgi;
+extern struct uwsgi_docker udocker;
+
+/*
+
+	The spawn scheduler (--docker-spawn-concurrency) limits the number of bridges talking
+	to the daemon at the same time (create and start), so a mass reload does not overload it.
+
+	Bridges waiting for their turn are queued in their registry slot (in shared memory),
+	the ones with the higher docker-priority go first, then the oldest ones.
+
+	The bridge releasing its turn grants it to the next waiter. Bridges dying with a turn
+	(or in the queue) are reaped by the waiters at most once a second.
+
+*/
+
+// the slot of the current bridge (if scheduled)
+static struct uwsgi_docker_container *docker_sched_slot;
+
+// grant turns to the best waiters, must be called with the lock held
+static void docker_sched_grant() {
+	struct uwsgi_docker_shared *shared = udocker.shared;
+	int granted = 0;
+	while(shared->sched_running < (uint64_t) udocker.spawn_concurrency && shared->sched_waiting > 0) {
+		struct uwsgi_docker_container *best = NULL;
+		uint64_t i;
+		for(i=0;i<shared->slots;i++) {
+			struct uwsgi_docker_container *dc = &shared->containers[i];
+			if (dc->sched_state != DOCKER_SCHED_WAITING) continue;
+			if (!best || dc->sched_priority > best->sched_priority ||
+				(dc->sched_priority == best->sched_priority && dc->sched_ticket < best->sched_ticket)) {
+				best = dc;
+			}
+		}
+		// the counters are out of sync
+		if (!best) {
+			shared->sched_waiting = 0;
+			break;
+		}
+		best->sched_state = DOCKER_SCHED_GRANTED;
+		shared->sched_waiting--;
+		shared->sched_running++;
+		granted++;
+	}
+	if (granted) pthread_cond_broadcast(&shared->sched_cond);
+}
+
+// drop the scheduler state of a slot, must be called with the lock held
+static void docker_sched_clear(struct uwsgi_docker_container *dc) {
+	if (dc->sched_state == DOCKER_SCHED_GRANTED && udocker.shared->sched_running > 0) udocker.shared->sched_running--;
+	if (dc->sched_state == DOCKER_SCHED_WAITING && udocker.shared->sched_waiting > 0) udocker.shared->sched_waiting--;
+	dc->sched_state = DOCKER_SCHED_NONE;
+	dc->sched_pid = 0;
+}
+
+// give back the turns of dead bridges, must be called with the lock held
+static void docker_sched_reap() {
+	uint64_t now = uwsgi_micros();
+	if (now - udocker.shared->sched_reaped < 1000000) return;
+	udocker.shared->sched_reaped = now;
+	uint64_t i;
+	for(i=0;i<udocker.shared->slots;i++) {
+		struct uwsgi_docker_container *dc = &udocker.shared->containers[i];
+		if (dc->sched_state == DOCKER_SCHED_NONE) continue;
+		if (kill(dc->sched_pid, 0) && errno == ESRCH) {
+			uwsgi_log("[docker] bridge %d (%s) died during the spawn, reaping its turn\n", (int) dc->sched_pid, dc->name);
+			docker_sched_clear(dc);
+		}
+	}
+	docker_sched_grant();
+}
+
+static void docker_sched_wait() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec++;
+	int ret = pthread_cond_timedwait(&udocker.shared->sched_cond, &udocker.shared->lock, &ts);
+	if (ret == EOWNERDEAD) {
+		pthread_mutex_consistent(&udocker.shared->lock);
+	}
+	else if (ret == ETIMEDOUT) {
+		docker_sched_reap();
+	}
+}
+
+// wait for our turn to talk to the daemon
+void docker_spawn_acquire(char *name, int priority) {
+	if (!udocker.spawn_concurrency || !udocker.shared) return;
+	struct uwsgi_docker_container *dc = docker_registry_reserve(name);
+	if (!dc) {
+		uwsgi_log("[docker] the containers registry is full, %s is spawned without waiting for its turn\n", name);
+		return;
+	}
+
+	docker_shared_lock();
+	// a previous bridge of this vassal died during the spawn
+	if (dc->sched_state != DOCKER_SCHED_NONE) docker_sched_clear(dc);
+	dc->sched_pid = getpid();
+	dc->sched_priority = priority;
+	dc->sched_ticket = ++udocker.shared->sched_tickets;
+	dc->sched_state = DOCKER_SCHED_WAITING;
+	udocker.shared->sched_waiting++;
+	docker_sched_grant();
+	if (dc->sched_state == DOCKER_SCHED_WAITING && udocker.debug) {
+		uwsgi_log("[docker-debug] %s queued for spawn (%llu running, %llu waiting)\n", name,
+			(unsigned long long) udocker.shared->sched_running, (unsigned long long) udocker.shared->sched_waiting);
+	}
+	while(dc->sched_state == DOCKER_SCHED_WAITING) {
+		docker_sched_wait();
+	}
+	// our turn has been reaped (should never happen)
+	if (dc->sched_state != DOCKER_SCHED_GRANTED || dc->sched_pid != getpid()) {
+		docker_shared_unlock();
+		uwsgi_log("[docker] lost the spawn turn of %s\n", name);
+		return;
+	}
+	docker_shared_unlock();
+
+	docker_sched_slot = dc;
+	// the bridge could exit() before releasing its turn
+	static int registered = 0;
+	if (!registered) {
+		atexit(docker_spawn_release);
+		registered = 1;
+	}
+}
+
+void docker_spawn_release() {
+	if (!docker_sched_slot) return;
+	docker_shared_lock();
+	if (docker_sched_slot->sched_pid == getpid()) {
+		docker_sched_clear(docker_sched_slot);
+		docker_sched_grant();
+	}
+	docker_shared_unlock();
+	docker_sched_slot = NULL;
+}
+
+// sleep before retrying a failed create/start, returns 0 if the request should not be retried.
+// Only transport errors (including timeouts) and 5xx are retried
+int docker_spawn_backoff(char *name, int attempt, long http_status) {
+	if (http_status > 0 && http_status < 500) return 0;
+	if (attempt >= udocker.spawn_retries) return 0;
+	// exponential with jitter, capped to 64 times the base
+	uint64_t delay = (uint64_t) udocker.spawn_backoff << (attempt > 6 ? 6 : attempt);
+	// bridges are forked, the clock is a better source of jitter than rand()
+	delay += uwsgi_micros() % (delay / 2 + 1);
+	uwsgi_log("[docker] daemon failure (status %ld) while spawning %s, retrying in %llums (%d/%d)\n", http_status, name,
+		(unsigned long long) delay, attempt + 1, udocker.spawn_retries);
+	if (udocker.shared) __sync_add_and_fetch(&udocker.shared->sched_retries, 1);
+	usleep(delay * 1000);
+	return 1;
+}
@@ -0,0 +1,209 @@
+#include "docker.h"
+
+extern struct uwsgi_server uwsgi;
+extern struct uwsgi_docker udocker;
+
+/*
+
+	The docker stats server (--docker-stats) is managed by the monitor.
+
+	Every connection gets a json document with the state of the monitor, of the bridges
+	and of the containers managed by them, then it is closed. The document is built from a copy
+	of the registry (the lock is not held while reading /proc, the log rings and the metrics)
+	and written by the monitor event loop, so slow clients do not stall it.
+
+*/
+
+static char *docker_states[] = {"unknown", "created", "running", "stopped", "dead", "destroyed", "paused"};
+static char *docker_spawn_phases[] = {"build", "create", "start", "proxy", "handoff", "queue", "total"};
+
+static int docker_histogram_bucket(uint64_t value) {
+	int bucket = 0;
+	while(value > 1 && bucket < DOCKER_HISTOGRAM_BUCKETS - 1) {
+		value >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+// called by the bridges once the instance received its file descriptors
+void docker_spawn_record(char *name, uint64_t *phases) {
+	if (udocker.debug) {
+		uwsgi_log("[docker-debug] spawn of %s: build %lluus queue %lluus create %lluus start %lluus proxy %lluus handoff %lluus total %lluus\n", name,
+			(unsigned long long) phases[DOCKER_SPAWN_BUILD], (unsigned long long) phases[DOCKER_SPAWN_QUEUE], (unsigned long long) phases[DOCKER_SPAWN_CREATE],
+			(unsigned long long) phases[DOCKER_SPAWN_START], (unsigned long long) phases[DOCKER_SPAWN_PROXY],
+			(unsigned long long) phases[DOCKER_SPAWN_HANDOFF], (unsigned long long) phases[DOCKER_SPAWN_TOTAL]);
+	}
+	if (!udocker.shared) return;
+	int i;
+	for(i=0;i<DOCKER_SPAWN_PHASES;i++) {
+		__sync_add_and_fetch(&udocker.shared->spawn_histogram[i][docker_histogram_bucket(phases[i])], 1);
+	}
+	struct uwsgi_docker_container *dc = docker_registry_lookup(name);
+	if (!dc) return;
+	memcpy(dc->spawn, phases, sizeof(dc->spawn));
+	__sync_add_and_fetch(&dc->spawns, 1);
+}
+
+// upper bound of the bucket holding the requested percentile
+static uint64_t docker_histogram_percentile(uint64_t *buckets, uint64_t count, uint64_t percentile) {
+	uint64_t target = (count * percentile + 99) / 100;
+	uint64_t sum = 0;
+	int i;
+	for(i=0;i<DOCKER_HISTOGRAM_BUCKETS;i++) {
+		sum += buckets[i];
+		if (sum >= target) return (1ULL << (i+1)) - 1;
+	}
+	return 0;
+}
+
+static json_t *docker_stats_spawn() {
+	json_t *spawn = json_object();
+	int i, j;
+	for(i=0;i<DOCKER_SPAWN_PHASES;i++) {
+		uint64_t buckets[DOCKER_HISTOGRAM_BUCKETS];
+		uint64_t count = 0;
+		for(j=0;j<DOCKER_HISTOGRAM_BUCKETS;j++) {
+			buckets[j] = udocker.shared->spawn_histogram[i][j];
+			count += buckets[j];
+		}
+		json_t *phase = json_object();
+		json_object_set_new(phase, "count", json_integer(count));
+		json_object_set_new(phase, "p50", json_integer(docker_histogram_percentile(buckets, count, 50)));
+		json_object_set_new(phase, "p99", json_integer(docker_histogram_percentile(buckets, count, 99)));
+		json_object_set_new(spawn, docker_spawn_phases[i], phase);
+	}
+	return spawn;
+}
+
+// resident memory of a process (in bytes)
+static uint64_t docker_pid_rss(pid_t pid) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/statm", (int) pid);
+	FILE *statm = fopen(path, "r");
+	if (!statm) return 0;
+	unsigned long long size = 0, resident = 0;
+	if (fscanf(statm, "%llu %llu", &size, &resident) != 2) resident = 0;
+	fclose(statm);
+	return resident * uwsgi.page_size;
+}
+
+static json_t *docker_stats_vassals(uint64_t *bridges, uint64_t *bridges_rss) {
+	json_t *vassals = json_array();
+	uint64_t i, count = 0;
+	// copy the slots under the lock, everything else (/proc, rings and metrics) is read without it
+	struct uwsgi_docker_container *slots = uwsgi_malloc(sizeof(struct uwsgi_docker_container) * udocker.shared->slots);
+	uint64_t *indexes = uwsgi_malloc(sizeof(uint64_t) * udocker.shared->slots);
+	docker_shared_lock();
+	for(i=0;i<udocker.shared->slots;i++) {
+		struct uwsgi_docker_container *dc = &udocker.shared->containers[i];
+		// only the containers managed by a bridge (and the crashing vassals waiting for their respawn)
+		if (!dc->name[0] || (dc->bridge <= 0 && !dc->crash_streak)) continue;
+		memcpy(&slots[count], dc, sizeof(struct uwsgi_docker_container));
+		indexes[count++] = i;
+	}
+	docker_shared_unlock();
+
+	for(i=0;i<count;i++) {
+		struct uwsgi_docker_container *dc = &slots[i];
+		// a bridge killed before clearing its slot
+		if (dc->bridge > 0 && !docker_bridge_alive(dc->bridge, dc->bridge_start)) {
+			dc->bridge = 0;
+			if (!dc->crash_streak) continue;
+		}
+		json_t *vassal = json_object();
+		json_object_set_new(vassal, "name", json_string(dc->name));
+		json_object_set_new(vassal, "id", json_string(dc->id));
+		json_object_set_new(vassal, "state", json_string(docker_states[dc->state]));
+		json_object_set_new(vassal, "oom", json_integer(dc->oom));
+		json_object_set_new(vassal, "bridge", json_integer(dc->bridge));
+		uint64_t rss = dc->bridge > 0 ? docker_pid_rss(dc->bridge) : 0;
+		json_object_set_new(vassal, "bridge_rss", json_integer(rss));
+		json_object_set_new(vassal, "stdout_bytes", json_integer(dc->log_bytes[0]));
+		json_object_set_new(vassal, "stdout_lines", json_integer(dc->log_lines[0]));
+		json_object_set_new(vassal, "stderr_bytes", json_integer(dc->log_bytes[1]));
+		json_object_set_new(vassal, "stderr_lines", json_integer(dc->log_lines[1]));
+		if (udocker.log_rate || udocker.shared_bridge) {
+			json_object_set_new(vassal, "stdout_dropped", json_integer(dc->log_dropped[0]));
+			json_object_set_new(vassal, "stderr_dropped", json_integer(dc->log_dropped[1]));
+		}
+		// rings are read without the lock anyway
+		json_t *tail = docker_log_tail(&udocker.shared->containers[indexes[i]]);
+		if (tail) json_object_set_new(vassal, "log_tail", tail);
+		json_object_set_new(vassal, "spawns", json_integer(dc->spawns));
+		json_t *spawn = json_object();
+		int j;
+		for(j=0;j<DOCKER_SPAWN_PHASES;j++) {
+			json_object_set_new(spawn, docker_spawn_phases[j], json_integer(dc->spawn[j]));
+		}
+		json_object_set_new(vassal, "spawn", spawn);
+		json_object_set_new(vassal, "pauses", json_integer(dc->pauses));
+		json_object_set_new(vassal, "wakes", json_integer(dc->wakes));
+		json_object_set_new(vassal, "wake_us_last", json_integer(dc->wake_last));
+		json_object_set_new(vassal, "wake_us_avg", json_integer(dc->wakes ? dc->wake_time / dc->wakes : 0));
+		if (dc->placed) {
+			char cpuset[DOCKER_CPUSET_MAX * 4];
+			docker_cpuset_format(dc->cpuset, cpuset, sizeof(cpuset));
+			json_object_set_new(vassal, "cpuset", json_string(cpuset));
+			json_object_set_new(vassal, "node", json_integer(dc->cpuset_node));
+		}
+		if (udocker.crash_backoff) {
+			json_object_set_new(vassal, "crashes", docker_crash_json(dc));
+		}
+		json_t *metrics = docker_monitor_metrics(dc->id);
+		if (metrics) json_object_set_new(vassal, "metrics", metrics);
+		json_array_append_new(vassals, vassal);
+		if (dc->bridge <= 0) continue;
+		(*bridges)++;
+		*bridges_rss += rss;
+	}
+	free(slots);
+	free(indexes);
+	return vassals;
+}
+
+// the stats document (the monitor writes it to the client without blocking)
+char *docker_stats_body() {
+	json_t *root = json_object();
+
+	json_t *monitor = json_object();
+	json_object_set_new(monitor, "pid", json_integer(getpid()));
+	json_object_set_new(monitor, "rss", json_integer(docker_pid_rss(getpid())));
+	json_object_set_new(monitor, "streams", json_integer(docker_monitor_streams()));
+	json_object_set_new(monitor, "events", json_integer(udocker.shared->events));
+	json_object_set_new(monitor, "registry_ready", json_integer(udocker.shared->ready));
+	json_object_set_new(root, "monitor", monitor);
+
+	uint64_t bridges = 0, bridges_rss = 0;
+	json_t *vassals = docker_stats_vassals(&bridges, &bridges_rss);
+
+	json_t *json_bridges = json_object();
+	json_object_set_new(json_bridges, "count", json_integer(bridges));
+	json_object_set_new(json_bridges, "rss", json_integer(bridges_rss));
+	json_object_set_new(json_bridges, "shared", json_integer(udocker.shared_bridge));
+	json_object_set_new(root, "bridges", json_bridges);
+
+	json_object_set_new(root, "vassals", vassals);
+	// spawn phases (in microseconds) across vassals
+	json_object_set_new(root, "spawn", docker_stats_spawn());
+
+	json_t *scheduler = json_object();
+	json_object_set_new(scheduler, "concurrency", json_integer(udocker.spawn_concurrency));
+	docker_shared_lock();
+	json_object_set_new(scheduler, "running", json_integer(udocker.shared->sched_running));
+	json_object_set_new(scheduler, "waiting", json_integer(udocker.shared->sched_waiting));
+	docker_shared_unlock();
+	json_object_set_new(scheduler, "retries", json_integer(udocker.shared->sched_retries));
+	json_object_set_new(root, "scheduler", scheduler);
+
+	if (udocker.images) {
+		json_object_set_new(root, "images", docker_image_json());
+	}
+	if (udocker.placement) {
+		json_object_set_new(root, "placement", docker_placement_json());
+	}
+
+	char *body = json_dumps(root, 0);
+	json_decref(root);
+	return body;
+}
@@ -0,0 +1,565 @@
+#! /usr/bin/env python
+# coding = utf-8
+
+"""
+Spawn benchmark: run an Emperor with the docker plugin against the stub daemon (mockd.py),
+drop N vassal files at once and measure how long it takes to get all of them handed off.
+
+python t/bench/bench.py -n 500 --latency 5 --conflict-rate 0.1 -- --docker-shared-bridge
+
+Each scenario adds Emperor options and vassal attributes to the spawn, and checks the
+feature it exercises once all of the vassals are running (python t/bench/bench.py --list).
+"""
+
+import argparse
+import json
+import os
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+VASSAL = """[emperor]
+docker-image = bench
+%(attrs)s
+[uwsgi]
+socket = :3031
+"""
+
+PROXY = 'docker-proxy = %(dir)s/%(name)s.sock:/%(name)s.sock\n'
+
+
+def wait_until(fn, timeout):
+    t = time.time()
+    while not fn():
+        if time.time() - t > timeout:
+            return False
+        time.sleep(0.1)
+    return True
+
+
+def daemon(ctx):
+    """ the counters (and the containers) of the stub daemon """
+    return http_get(ctx['daemon_socket'], '/_bench')
+
+
+def vassal_containers(ctx):
+    return dict((name, c) for name, c in daemon(ctx)['containers'].items() if name.startswith('bench'))
+
+
+def pool_containers(ctx):
+    return [name for name in daemon(ctx)['containers'] if name.startswith('uwsgi-pool-')]
+
+
+def paused_containers(ctx):
+    return [name for name, c in vassal_containers(ctx).items() if c['paused']]
+
+
+def vassal_stats(ctx, key):
+    """ the given key of the bench vassals in the stats server document (vassals without it are skipped) """
+    vassals = read_stats(ctx['stats_socket'])['vassals']
+    return dict((v['name'], v[key]) for v in vassals if v['name'].startswith('bench') and v.get(key))
+
+
+def requests_during(ctx, fn, *requests):
+    """ run fn, returns its result and how many of the given requests the daemon got meanwhile """
+    before = daemon(ctx)['requests']
+    ret = fn()
+    after = daemon(ctx)['requests']
+    return ret, [after.get(r, 0) - before.get(r, 0) for r in requests]
+
+
+def respawn(ctx, timeout=120):
+    """ stop the containers of the vassals (as if they crashed), returns True when all of them have been handed off again """
+    t = time.time()
+    for name in vassal_containers(ctx):
+        http_get(ctx['daemon_socket'], '/containers/%s/stop' % name, 'POST')
+
+    def respawned():
+        containers = vassal_containers(ctx)
+        return len([c for c in containers.values() if c['running'] and c['handoff'] and c['handoff'] > t]) >= ctx['args'].vassals
+    return wait_until(respawned, timeout)
+
+
+def respawn_from_pool(ctx):
+    """ respawn the vassals, returns True when all of them are back and the number of warm containers they took """
+    respawned, (renames,) = requests_during(ctx, lambda: respawn(ctx), 'POST /containers/{id}/rename')
+    return respawned, renames
+
+
+def kill_emperor(ctx):
+    """ kill the bridges and the Emperor, returns True when the monitor removed all of the containers (and how long it took) """
+    t = time.time()
+    for pid in bridge_pids():
+        os.kill(pid, signal.SIGKILL)
+    ctx['emperor'].kill()
+    removed = wait_until(lambda: not vassal_containers(ctx), 60)
+    return removed, round(time.time() - t, 2)
+
+
+def wake(ctx, path):
+    """ connect to a vassal socket, returns True when the paused container of bench0000.ini is woken up """
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.connect(os.path.join(ctx['tmp'], path))
+    woken = wait_until(lambda: 'bench0000.ini' not in paused_containers(ctx), 10)
+    s.close()
+    return woken
+
+
+def check_spawn(ctx):
+    """ all of the vassals have been handed off """
+    creates = ctx['bench']['requests'].get('POST /containers/create', 0)
+    return {'creates': creates, 'ok': ctx['spawned'] == ctx['args'].vassals}
+
+
+def check_scheduler(ctx):
+    """ no more than --docker-spawn-concurrency containers between create and start, nobody left in the queue """
+    scheduler = ctx['stats']['scheduler']
+    max_pending = ctx['bench']['max_pending']
+    return {'max_pending': max_pending, 'running': scheduler['running'], 'waiting': scheduler['waiting'],
+            'ok': max_pending <= 4 and not scheduler['running'] and not scheduler['waiting'] and ctx['spawned'] == ctx['args'].vassals}
+
+
+def check_pool(ctx):
+    """ the pool is refilled after the spawns, and the respawns rename warm containers instead of creating them """
+    # vassals share the config (the emperor proxy is mounted at the same path in pool containers)
+    refilled = wait_until(lambda: len(pool_containers(ctx)) >= 1, 30)
+    respawned, renames = respawn_from_pool(ctx)
+    return {'refilled': refilled, 'respawned': respawned, 'renames': renames, 'ok': refilled and respawned and renames > 0}
+
+
+def connect_lazy(ctx):
+    """ no container is created before the first connection, then connect to all of the vassal sockets """
+    sockets = [os.path.join(ctx['tmp'], 'bench%04d.ini.socket' % i) for i in range(ctx['args'].vassals)]
+    ready = wait_until(lambda: all(os.path.exists(path) for path in sockets), 60)
+    time.sleep(1)
+    ctx['early'] = len(vassal_containers(ctx))
+    ctx['clients'] = []
+    for path in sockets:
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        s.connect(path)
+        ctx['clients'].append(s)
+    return ready
+
+
+def check_lazy(ctx):
+    """ containers are created by the first connection, a vassal removed while waiting for it is stopped by the Emperor command """
+    with open(os.path.join(ctx['vassals_dir'], 'lazyidle.ini'), 'w') as f:
+        f.write(VASSAL % {'attrs': LAZY % {'dir': ctx['tmp'], 'name': 'lazyidle.ini'}})
+    waiting = wait_until(lambda: os.path.exists(os.path.join(ctx['tmp'], 'lazyidle.ini.socket')), 30)
+    os.unlink(os.path.join(ctx['vassals_dir'], 'lazyidle.ini'))
+
+    def logged():
+        with open(os.path.join(ctx['tmp'], 'emperor.log')) as f:
+            return 'vassal lazyidle.ini stopped while waiting for the first connection' in f.read()
+    stopped = wait_until(logged, 10)
+    for s in ctx['clients']:
+        s.close()
+    return {'early_creates': ctx['early'], 'stopped': stopped,
+            'ok': not ctx['early'] and waiting and stopped and ctx['spawned'] == ctx['args'].vassals}
+
+
+def check_pause(ctx):
+    """ idle containers are paused, a connection wakes one up, a paused vassal removed by the Emperor is unpaused and destroyed """
+    all_paused = wait_until(lambda: len(paused_containers(ctx)) >= ctx['args'].vassals, 30)
+    woken = wake(ctx, 'bench0000.ini.socket')
+    removed = False
+    if ctx['args'].vassals > 1:
+        os.unlink(os.path.join(ctx['vassals_dir'], 'bench0001.ini'))
+        removed = wait_until(lambda: 'bench0001.ini' not in vassal_containers(ctx), 30)
+    wakes = sum(v['wakes'] for v in read_stats(ctx['stats_socket'])['vassals'])
+    return {'paused': all_paused, 'woken': woken, 'removed': removed, 'wakes': wakes,
+            'ok': all_paused and woken and (removed or ctx['args'].vassals == 1)}
+
+
+def check_teardown(ctx):
+    """ kill the bridges and the Emperor, the monitor removes all of the containers """
+    removed, elapsed = kill_emperor(ctx)
+    return {'removed': removed, 'teardown_s': elapsed, 'ok': removed}
+
+
+def check_api(ctx):
+    """ with a slow daemon, the requests of a process overlap (pool refills, teardown) on kept-alive connections """
+    http_get(ctx['daemon_socket'], '/_bench?latency=50', 'POST')
+    refilled = wait_until(lambda: len(pool_containers(ctx)) >= 2, 30)
+    removed, elapsed = kill_emperor(ctx)
+    bench = daemon(ctx)
+    requests = sum(bench['requests'].values())
+    # a sequential teardown would need a round trip for each container
+    return {'refilled': refilled, 'removed': removed, 'teardown_s': elapsed, 'max_inflight': bench['max_inflight'],
+            'requests': requests, 'connections': bench['connections'],
+            'ok': refilled and removed and bench['max_inflight'] > 1 and bench['connections'] < requests}
+
+
+def check_hostconfig(ctx):
+    """ the host settings go in the create request (versioned paths, starts without body), warm containers are shared by the vassals """
+    respawned, renames = respawn_from_pool(ctx)
+    bench = daemon(ctx)
+    return {'respawned': respawned, 'renames': renames, 'pool': len(pool_containers(ctx)), 'start_bodies': bench['start_bodies'],
+            'unversioned': bench['unversioned'],
+            'ok': respawned and renames > 0 and not bench['start_bodies'] and not bench['unversioned']}
+
+
+PULLED = ['pull/app:1.0', 'pull/app@sha256:' + 'ab' * 32, 'localhost:5000/pull/app']
+
+
+def check_pull(ctx):
+    """ vassals of missing images (tags, digests, registry ports) wait for a single pull of each image """
+    names = []
+    for i, image in enumerate(PULLED + PULLED):
+        name = 'pull%d.ini' % i
+        names.append(name)
+        with open(os.path.join(ctx['vassals_dir'], name), 'w') as f:
+            f.write('[emperor]\ndocker-image = %s\n%s[uwsgi]\nsocket = :3031\n' % (image, PROXY % {'dir': ctx['tmp'], 'name': name}))
+
+    def spawned():
+        containers = daemon(ctx)['containers']
+        return all(name in containers and containers[name]['handoff'] for name in names)
+    ok = wait_until(spawned, 60)
+    pulls = daemon(ctx)['pulls']
+    # latest is implicit
+    return {'spawned': ok, 'pulls': pulls, 'ok': ok and sorted(pulls) == sorted(PULLED)}
+
+
+def check_crash(ctx):
+    """ containers exiting right after the handoff are crashes: the respawns slow down, the last crashed container is kept """
+    looping = wait_until(lambda: len([c for c in vassal_stats(ctx, 'crashes').values() if c['streak'] >= 3]) >= ctx['args'].vassals, 60)
+    # 200ms, 400ms, 800ms ... (half of them random): far less than a respawn per Emperor cycle
+    t = time.time()
+    _, (starts,) = requests_during(ctx, lambda: time.sleep(5), 'POST /containers/{id}/start')
+    rate = starts / (time.time() - t) / ctx['args'].vassals
+    kept = [name for name in daemon(ctx)['containers'] if name.endswith('-crashed')]
+    exit_codes = set(c['exit_code'] for c in vassal_stats(ctx, 'crashes').values())
+    return {'looping': looping, 'respawns_per_s': round(rate, 2), 'kept': len(kept), 'exit_codes': sorted(exit_codes),
+            'ok': looping and rate < 1 and len(kept) >= ctx['args'].vassals and exit_codes == set([3])}
+
+
+def check_rings(ctx):
+    """ only --docker-log-rings vassals keep their tail, the rings of removed vassals are taken over by the respawned ones """
+    rings = min(4, ctx['args'].vassals)
+    filled = wait_until(lambda: len(vassal_stats(ctx, 'log_tail')) >= rings, 10)
+    first = vassal_stats(ctx, 'log_tail')
+    correct = all(('container %s started' % name) in tail for name, tail in first.items())
+    taken_over = True
+    if ctx['args'].vassals > rings:
+        for name in first:
+            os.unlink(os.path.join(ctx['vassals_dir'], name))
+        wait_until(lambda: not set(first) & set(vassal_containers(ctx)), 30)
+        respawn(ctx)
+        taken_over = wait_until(lambda: len(set(vassal_stats(ctx, 'log_tail')) - set(first)) >= min(rings, ctx['args'].vassals - rings), 10)
+    return {'tails': len(first), 'correct': correct, 'taken_over': taken_over,
+            'ok': filled and len(first) == rings and correct and taken_over}
+
+
+def check_proxy_dir(ctx):
+    """ with chmod-socket the proxy directories can be traversed by other users (docker-user), even when created by a previous run """
+    root = os.path.join(ctx['tmp'], 'proxy')
+
+    def modes():
+        return [os.stat(os.path.join(root, name)).st_mode & 0o777 for name in [''] + sorted(os.listdir(root))]
+    created = modes()
+    # a directory left with the wrong mode is fixed by the next spawn
+    os.chmod(os.path.join(root, 'bench0000.ini'), 0o700)
+    respawned = respawn(ctx)
+    fixed = os.stat(os.path.join(root, 'bench0000.ini')).st_mode & 0o777
+    return {'dirs': len(created), 'modes': sorted(set(oct(m) for m in created)), 'respawned': respawned, 'fixed': oct(fixed),
+            'ok': ctx['spawned'] == ctx['args'].vassals and set(created) == set([0o711]) and respawned and fixed == 0o711}
+
+
+def check_rolling(ctx):
+    """ respawned vassals get the socket kept by the monitor, the socket of a removed vassal is closed after the grace period """
+    respawned = respawn(ctx)
+    path = os.path.join(ctx['tmp'], 'bench0000.ini.socket')
+    kept = os.path.exists(path)
+    os.unlink(os.path.join(ctx['vassals_dir'], 'bench0000.ini'))
+    released = wait_until(lambda: not os.path.exists(path), 30)
+    return {'respawned': respawned, 'kept': kept, 'released': released, 'ok': respawned and kept and released}
+
+
+def check_reuse(ctx):
+    """ respawned vassals restart their stopped containers instead of creating new ones """
+    respawned, (creates, starts) = requests_during(ctx, lambda: respawn(ctx), 'POST /containers/create', 'POST /containers/{id}/start')
+    return {'respawned': respawned, 'creates': creates, 'starts': starts,
+            'ok': respawned and not creates and starts >= ctx['args'].vassals}
+
+
+def check_metrics(ctx):
+    """ every container gets samples from a single stats stream (the streams are not reopened every second) """
+    def sampled():
+        vassals = read_stats(ctx['stats_socket'])['vassals']
+        return len([v for v in vassals if v.get('metrics', {}).get('10s', {}).get('samples', 0) >= 3]) >= ctx['args'].vassals
+    ok = wait_until(sampled, 30)
+    streams = daemon(ctx)['requests'].get('GET /containers/{id}/stats', 0)
+    return {'sampled': ok, 'streams': streams, 'ok': ok and streams == ctx['args'].vassals}
+
+
+def parse_cpuset(cpuset):
+    cpus = []
+    for item in cpuset.split(','):
+        if '-' in item:
+            first, last = item.split('-')
+            cpus += range(int(first), int(last) + 1)
+        elif item:
+            cpus.append(int(item))
+    return cpus
+
+
+def check_placement(ctx):
+    """ every vassal got a cpuset, and the vassals are spread evenly over the cpus """
+    vassals = [v for v in read_stats(ctx['stats_socket'])['vassals'] if v['name'].startswith('bench')]
+    load = {}
+    for v in vassals:
+        for cpu in parse_cpuset(v.get('cpuset', '')):
+            load[cpu] = load.get(cpu, 0) + 1
+    placed = len([v for v in vassals if v.get('cpuset')])
+    spread = max(load.values()) - min(load.values()) if load else 0
+    return {'placed': placed, 'cpus': len(load), 'spread': spread, 'ok': placed == ctx['args'].vassals and spread <= 1}
+
+
+def check_shards(ctx):
+    """ the instances get all of the shards from the zerg socket, a paused container wakes up on any of them """
+    containers = vassal_containers(ctx)
+    sockets = min([c['sockets'] for c in containers.values()] or [0])
+    zerg_left = [name for name in containers if os.path.exists(os.path.join(ctx['tmp'], name + '.sock.zerg'))]
+    all_paused = wait_until(lambda: len(paused_containers(ctx)) >= ctx['args'].vassals, 30)
+    # the second shard of the first vassal
+    woken = wake(ctx, 'bench0000.ini.socket.1')
+    return {'sockets': sockets, 'zerg_left': len(zerg_left), 'paused': all_paused, 'woken': woken,
+            'ok': sockets == 2 and not zerg_left and all_paused and woken}
+
+
+LAZY = PROXY + 'docker-socket = %(dir)s/%(name)s.socket\ndocker-lazy = true\ndocker-idle = 600\n'
+
+# name -> (description, Emperor options, vassal attributes, trigger of the spawns, check)
+SCENARIOS = {
+    'spawn': ('spawn the vassals at once', [], PROXY, None, check_spawn),
+    'scheduler': ('spawn with --docker-spawn-concurrency 4 (and mixed priorities)', ['--docker-spawn-concurrency', '4'],
+                  PROXY + 'docker-priority = %(n)d', None, check_scheduler),
+    'pool': ('respawn the vassals from a warm pool (--docker-pool 1)', ['--docker-pool', '1'], '', None, check_pool),
+    'lazy': ('spawn on the first connection (docker-lazy and docker-idle)', [], LAZY, connect_lazy, check_lazy),
+    'teardown': ('remove the containers on Emperor death (--docker-teardown-concurrency 8)', ['--docker-teardown-concurrency', '8'],
+                 PROXY, None, check_teardown),
+    'api': ('overlap the daemon requests of each process (50ms of latency after the spawns, --docker-pool 2)',
+            ['--docker-pool', '2', '--docker-teardown-concurrency', '8'], PROXY, None, check_api),
+    'hostconfig': ('share warm containers with HostConfig on create (--docker-pool 2, two socket shards)', ['--docker-pool', '2'],
+                   'docker-socket = %(dir)s/%(name)s.socket\ndocker-socket-shards = 2\n', None, check_hostconfig),
+    'pull': ('pull the missing images once for all of their vassals (--docker-pull)', ['--docker-pull'], PROXY, None, check_pull),
+    'crash': ('back off the respawns of crashing containers (--docker-crash-backoff 200, --docker-crash-keep)',
+              ['--docker-crash-backoff', '200', '--docker-crash-keep'], PROXY + 'docker-env = MOCKD_EXIT=3\n', None, check_crash),
+    'rings': ('keep the output tail of 4 vassals (--docker-log-ring 4 --docker-log-rings 4)', ['--docker-log-ring', '4', '--docker-log-rings', '4'],
+              PROXY, None, check_rings),
+    'proxydir': ('place the emperor proxies in a directory (--docker-proxy-dir, chmod-socket 666)',
+                 ['--docker-proxy-dir', '%(dir)s/proxy', '--chmod-socket', '666'], '', None, check_proxy_dir),
+    'rolling': ('keep the vassal sockets in the monitor (--docker-rolling, released after 2 seconds)',
+                ['--docker-rolling', '--docker-rolling-grace', '2'], PROXY + 'docker-socket = %(dir)s/%(name)s.socket\n', None, check_rolling),
+    'reuse': ('restart the stopped containers on respawn (--docker-reuse, without --docker-events)', ['--docker-reuse'],
+              PROXY, None, check_reuse),
+    'metrics': ('collect the resource usage of the containers (--docker-metrics)', ['--docker-metrics'], PROXY, None, check_metrics),
+    'placement': ('give each vassal its own cpus (--docker-placement)', ['--docker-placement'], PROXY + 'docker-cpus = 1\n', None, check_placement),
+    'pause': ('pause the idle containers (docker-pause)', [],
+              PROXY + 'docker-socket = %(dir)s/%(name)s.socket\ndocker-pause = 2\n', None, check_pause),
+    'shards': ('serve two shards of the vassal socket from the zerg socket (docker-socket-shards, docker-pause)', [],
+               PROXY + 'docker-socket = %(dir)s/%(name)s.socket\ndocker-socket-shards = 2\ndocker-pause = 2\n', None, check_shards),
+}
+
+
+def http_get(path, url, method='GET'):
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.connect(path)
+    s.sendall(('%s %s HTTP/1.0\r\n\r\n' % (method, url)).encode())
+    data = b''
+    while True:
+        chunk = s.recv(65536)
+        if not chunk:
+            break
+        data += chunk
+    s.close()
+    body = data.split(b'\r\n\r\n', 1)[1].decode()
+    return json.loads(body) if body else None
+
+
+def read_stats(path):
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.connect(path)
+    data = b''
+    while True:
+        chunk = s.recv(65536)
+        if not chunk:
+            break
+        data += chunk
+    s.close()
+    return json.loads(data.decode())
+
+
+def bridge_pids():
+    pids = []
+    for pid in os.listdir('/proc'):
+        if not pid.isdigit():
+            continue
+        try:
+            with open('/proc/%s/cmdline' % pid, 'rb') as f:
+                if f.read().startswith(b'[uwsgi-docker-bridge]'):
+                    pids.append(int(pid))
+        except (IOError, OSError):
+            pass
+    return pids
+
+
+def bridges_rss():
+    """ count the bridges and sum their resident memory """
+    count, rss = 0, 0
+    page_size = os.sysconf('SC_PAGE_SIZE')
+    for pid in bridge_pids():
+        try:
+            with open('/proc/%d/statm' % pid) as f:
+                rss += int(f.read().split()[1]) * page_size
+            count += 1
+        except (IOError, OSError):
+            pass
+    return count, rss
+
+
+def percentile(values, p):
+    if not values:
+        return 0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100.0))]
+
+
+def wait_for(path, timeout=10):
+    t = time.time()
+    while not os.path.exists(path):
+        if time.time() - t > timeout:
+            raise Exception('%s did not appear' % path)
+        time.sleep(0.05)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='uwsgi-docker spawn benchmark')
+    parser.add_argument('-n', '--vassals', type=int, default=100, help='number of vassals (1..2000)')
+    parser.add_argument('--uwsgi', default='uwsgi', help='uWSGI binary running the Emperor')
+    parser.add_argument('--plugin', default=os.path.join(HERE, '..', '..', 'docker_plugin.so'), help='docker plugin path')
+    parser.add_argument('--latency', type=float, default=0, help='daemon latency for each request (ms)')
+    parser.add_argument('--jitter', type=float, default=0, help='random daemon latency for each request (ms)')
+    parser.add_argument('--conflict-rate', type=float, default=0, help='probability of a 409 on create')
+    parser.add_argument('--boot-time', type=float, default=0, help='time before a container connects to the emperor proxy (ms)')
+    parser.add_argument('--timeout', type=float, default=300, help='max time to wait for the spawns (seconds)')
+    parser.add_argument('--scenario', default='spawn', choices=sorted(SCENARIOS), help='feature to exercise')
+    parser.add_argument('--list', action='store_true', help='list the scenarios')
+    parser.add_argument('--json', action='store_true', help='print the report as json')
+    parser.add_argument('extra', nargs='*', help='additional Emperor options (after --)')
+    args = parser.parse_args()
+
+    if args.list:
+        for name in sorted(SCENARIOS):
+            print('%-12s %s' % (name, SCENARIOS[name][0]))
+        return
+
+    description, options, attrs, trigger, check = SCENARIOS[args.scenario]
+
+    if args.vassals < 1 or args.vassals > 2000:
+        parser.error('the number of vassals must be between 1 and 2000')
+
+    tmp = tempfile.mkdtemp(prefix='uwsgi-docker-bench-')
+    vassals_dir = os.path.join(tmp, 'vassals')
+    os.mkdir(vassals_dir)
+    daemon_socket = os.path.join(tmp, 'docker.sock')
+    stats_socket = os.path.join(tmp, 'stats.sock')
+
+    procs = []
+    try:
+        mockd = subprocess.Popen([sys.executable, os.path.join(HERE, 'mockd.py'), '--socket', daemon_socket,
+                                  '--latency', str(args.latency), '--jitter', str(args.jitter),
+                                  '--conflict-rate', str(args.conflict_rate), '--boot-time', str(args.boot_time)])
+        procs.append(mockd)
+        wait_for(daemon_socket)
+
+        emperor = subprocess.Popen([args.uwsgi, '--plugin', args.plugin, '--emperor', 'dir://' + vassals_dir,
+                                    '--emperor-freq', '1', '--emperor-docker-required', '--emperor-wrapper', '/bin/true',
+                                    '--docker-daemon-socket', daemon_socket, '--docker-stats', stats_socket,
+                                    '--logto', os.path.join(tmp, 'emperor.log')] + [o % {'dir': tmp} for o in options] + args.extra)
+        procs.append(emperor)
+        wait_for(stats_socket)
+
+        # drop all of the vassal files at once
+        t0 = time.time()
+        for i in range(args.vassals):
+            name = 'bench%04d.ini' % i
+            with open(os.path.join(vassals_dir, name), 'w') as f:
+                f.write(VASSAL % {'dir': tmp, 'name': name, 'attrs': attrs % {'dir': tmp, 'name': name, 'n': i}})
+
+        ctx = {'args': args, 'tmp': tmp, 'vassals_dir': vassals_dir, 'daemon_socket': daemon_socket, 'stats_socket': stats_socket,
+               'emperor': emperor}
+        if trigger and not trigger(ctx):
+            print('timeout: the vassals did not get ready for the trigger of the spawns')
+
+        while True:
+            bench = http_get(daemon_socket, '/_bench')
+            # crashing containers (and the ones kept for post-mortem) could die before the last handoff
+            done = [c for name, c in bench['containers'].items()
+                    if c['handoff'] and (c['running'] or c['exit_code']) and not name.endswith('-crashed')]
+            if len(done) >= args.vassals:
+                break
+            if time.time() - t0 > args.timeout:
+                print('timeout: only %d vassals spawned' % len(done))
+                break
+            time.sleep(0.1)
+        elapsed = time.time() - t0
+
+        latencies = [(c['handoff'] - c['created']) * 1000 for c in done]
+        count, rss = bridges_rss()
+        stats = read_stats(stats_socket)
+
+        ctx.update({'spawned': len(done), 'bench': bench, 'stats': stats})
+        result = check(ctx)
+        # the check could have generated requests
+        bench = http_get(daemon_socket, '/_bench')
+
+        report = {
+            'scenario': args.scenario,
+            'check': result,
+            'vassals': args.vassals,
+            'spawned': len(done),
+            'elapsed': elapsed,
+            'throughput': len(done) / elapsed if elapsed else 0,
+            'latency_ms': {'p50': percentile(latencies, 50), 'p99': percentile(latencies, 99), 'max': max(latencies or [0])},
+            'bridges': {'count': count, 'rss': rss},
+            'monitor_rss': stats['monitor']['rss'],
+            'spawn_phases_us': stats.get('spawn'),
+            'daemon_requests': bench['requests'],
+            'daemon_requests_total': sum(bench['requests'].values()),
+        }
+
+        if args.json:
+            print(json.dumps(report, indent=2))
+            sys.exit(0 if result.get('ok') else 1)
+
+        print('scenario:          %s (%s)' % (args.scenario, description))
+        print('vassals spawned:   %d/%d in %.2f seconds (%.1f spawns/s)' % (len(done), args.vassals, elapsed, report['throughput']))
+        print('spawn latency:     p50 %.1fms p99 %.1fms max %.1fms (create -> proxy handoff)' % (
+            report['latency_ms']['p50'], report['latency_ms']['p99'], report['latency_ms']['max']))
+        print('bridges:           %d processes, %.1f MB RSS (monitor %.1f MB)' % (count, rss / 1048576.0, report['monitor_rss'] / 1048576.0))
+        print('daemon requests:   %d' % report['daemon_requests_total'])
+        for route in sorted(bench['requests']):
+            print('    %-40s %d' % (route, bench['requests'][route]))
+        if report['spawn_phases_us']:
+            print('spawn phases (us):')
+            for phase, value in sorted(report['spawn_phases_us'].items()):
+                print('    %-10s p50 %-10d p99 %d' % (phase, value['p50'], value['p99']))
+        print('check:             %s' % ' '.join('%s=%s' % (k, result[k]) for k in sorted(result)))
+        if not result.get('ok'):
+            sys.exit(1)
+    finally:
+        for p in reversed(procs):
+            p.terminate()
+            p.wait()
+        shutil.rmtree(tmp, ignore_errors=True)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,542 @@
+#! /usr/bin/env python
+# coding = utf-8
+
+"""
+A stub Docker daemon listening on a UNIX socket, used to benchmark the plugin
+without a real daemon (and without images).
+
+It emulates the endpoints used by the plugin (version/create/start/stop/delete/attach/list/inspect/events/rename/pause/stats/images),
+with configurable latency, conflict rate and api version (from 1.24 the host settings are accepted only on create). When a container is started it behaves like
+the dockerized vassal: it connects to the emperor proxy socket and receives the file descriptors,
+then exits on the commands of the Emperor (unless it is paused).
+A container with MOCKD_EXIT=<code> in its environment exits (with that code) right after the handoff.
+Every image exists, but the ones in a pull/ repository: they must be pulled (taking --pull-time ms) before creating their containers.
+
+GET /_bench returns the request counters and the timings of each container, POST /_bench?latency=<ms>
+changes the latency of the daemon. Clients are told apart by their pid (SO_PEERCRED), so /_bench
+reports the connections and the requests a single process had in flight at the same time.
+"""
+
+import argparse
+import array
+import json
+import os
+import random
+import re
+import select
+import socket
+import struct
+import threading
+import time
+
+try:
+    from socketserver import ThreadingMixIn, UnixStreamServer
+    from http.server import BaseHTTPRequestHandler
+    from urllib.parse import urlparse, parse_qs
+except ImportError:
+    from SocketServer import ThreadingMixIn, UnixStreamServer
+    from BaseHTTPServer import BaseHTTPRequestHandler
+    from urlparse import urlparse, parse_qs
+
+
+class Container(object):
+
+    def __init__(self, name, config):
+        self.id = '%064x' % random.getrandbits(256)
+        self.name = name
+        self.config = config
+        self.host_config = {}
+        self.running = False
+        self.stopped = threading.Event()
+        self.paused = False
+        # a paused vassal does not read the commands of the Emperor
+        self.unpaused = threading.Event()
+        self.unpaused.set()
+        self.fds = []
+        # the vassal sockets got from the zerg socket
+        self.sockets = 0
+        self.created_at = time.time()
+        self.started_at = None
+        self.handoff_at = None
+        # created and never started yet
+        self.pending = False
+        self.exit_code = 0
+
+    def inspect(self):
+        return {
+            'Id': self.id,
+            'Name': '/' + self.name,
+            'Config': self.config,
+            'HostConfig': self.host_config,
+            'State': {'Running': self.running, 'Paused': self.paused, 'ExitCode': self.exit_code,
+                      'StartedAt': '0001-01-01T00:00:00Z', 'FinishedAt': '0001-01-01T00:00:00Z'},
+        }
+
+    def summary(self):
+        return {
+            'Id': self.id,
+            'Names': ['/' + self.name],
+            'Image': self.config.get('Image'),
+            'Status': ('Up 1 second (Paused)' if self.paused else 'Up 1 second') if self.running else 'Exited (%d) 1 second ago' % self.exit_code,
+        }
+
+
+class Daemon(object):
+
+    def __init__(self, args):
+        self.args = args
+        self.lock = threading.Lock()
+        self.containers = {}
+        self.requests = {}
+        self.subscribers = []
+        # containers between create and start (bounded by the spawn scheduler)
+        self.pending = 0
+        self.max_pending = 0
+        # connections accepted, requests in flight for each client process
+        self.connections = 0
+        self.inflight = {}
+        self.max_inflight = 0
+        # requests without the api version in the path (but /version), starts with a body
+        self.unversioned = 0
+        self.start_bodies = 0
+        # pulled images (the references asked by the pull requests)
+        self.images = set()
+        self.pulls = []
+
+    def count(self, route):
+        with self.lock:
+            self.requests[route] = self.requests.get(route, 0) + 1
+
+    def find(self, ref):
+        with self.lock:
+            if ref in self.containers:
+                return self.containers[ref]
+            for c in self.containers.values():
+                if c.name == ref:
+                    return c
+        return None
+
+    def image_exists(self, name):
+        if '/pull/' not in '/' + name:
+            return True
+        with self.lock:
+            return name in self.images or (':' not in name.split('/')[-1] and '@' not in name and name + ':latest' in self.images)
+
+    def track(self, pid, delta):
+        with self.lock:
+            self.inflight[pid] = self.inflight.get(pid, 0) + delta
+            self.max_inflight = max(self.max_inflight, self.inflight[pid])
+            if not self.inflight[pid]:
+                del self.inflight[pid]
+
+    def publish(self, status, container):
+        event = json.dumps({'status': status, 'id': container.id, 'from': container.config.get('Image'),
+                            'time': int(time.time()), 'Type': 'container', 'Action': status,
+                            'Actor': {'ID': container.id, 'Attributes': {'name': container.name}}}) + '\n'
+        with self.lock:
+            subscribers = list(self.subscribers)
+        for s in subscribers:
+            try:
+                s.sendall(event.encode())
+            except socket.error:
+                pass
+
+    def stop(self, container):
+        if not container.running:
+            return False
+        container.running = False
+        container.paused = False
+        container.unpaused.set()
+        container.stopped.set()
+        for fd in container.fds:
+            os.close(fd)
+        container.fds = []
+        self.publish('die', container)
+        self.publish('stop', container)
+        return True
+
+    def handoff(self, container, binds):
+        """ behave like the dockerized vassal: get the fds from the emperor proxy """
+        time.sleep(self.args.boot_time / 1000.0)
+        proxy = None
+        zerg = False
+        exit_code = None
+        for env in container.config.get('Env') or []:
+            if env.startswith('UWSGI_EMPEROR_PROXY='):
+                proxy = env.split('=', 1)[1]
+            elif env.startswith('UWSGI_ZERG='):
+                zerg = True
+            elif env.startswith('MOCKD_EXIT='):
+                exit_code = int(env.split('=', 1)[1])
+        if not proxy:
+            return
+        # the socket itself, or the directory containing it
+        path = None
+        for bind in binds:
+            parts = bind.split(':')
+            if len(parts) < 2:
+                continue
+            if parts[1] == proxy:
+                path = parts[0]
+            elif proxy.startswith(parts[1].rstrip('/') + '/'):
+                path = parts[0] + proxy[len(parts[1].rstrip('/')):]
+        if not path:
+            return
+        try:
+            # keep them open as long as the container runs, as the vassal would do
+            container.fds = self.receive(path)
+            container.handoff_at = time.time()
+            # the Emperor pipe comes first
+            if container.fds:
+                threading.Thread(target=self.vassal, args=(container, os.dup(container.fds[0]))).start()
+            # the zerg socket is mounted next to the emperor proxy
+            if zerg:
+                sockets = self.receive(path + '.zerg')
+                container.sockets = len(sockets)
+                container.fds += sockets
+        except socket.error as e:
+            print('[mockd] unable to get the fds of %s: %s' % (path, e))
+        # a broken app
+        if exit_code is not None:
+            time.sleep(0.1)
+            container.exit_code = exit_code
+            self.stop(container)
+
+    def receive(self, path):
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        try:
+            s.connect(path)
+            fds = array.array('i')
+            msg, ancdata, flags, addr = s.recvmsg(4096, socket.CMSG_SPACE(16 * fds.itemsize))
+            for level, kind, data in ancdata:
+                if level == socket.SOL_SOCKET and kind == socket.SCM_RIGHTS:
+                    fds.frombytes(data[:len(data) - (len(data) % fds.itemsize)])
+            return list(fds)
+        finally:
+            s.close()
+
+
+    def vassal(self, container, fd):
+        """ exit on the stop (or reload) commands of the Emperor, and when the Emperor dies """
+        try:
+            while container.running:
+                container.unpaused.wait()
+                r, _, _ = select.select([fd], [], [], 1)
+                # frozen before reading
+                if not r or not container.running or container.paused:
+                    continue
+                os.read(fd, 1)
+                self.stop(container)
+        except (OSError, select.error):
+            pass
+        finally:
+            os.close(fd)
+
+
+class Handler(BaseHTTPRequestHandler):
+
+    protocol_version = 'HTTP/1.1'
+
+    def log_message(self, format, *args):
+        pass
+
+    def address_string(self):
+        return 'unix'
+
+    def setup(self):
+        BaseHTTPRequestHandler.setup(self)
+        creds = self.connection.getsockopt(socket.SOL_SOCKET, socket.SO_PEERCRED, struct.calcsize('3i'))
+        self.pid = struct.unpack('3i', creds)[0]
+        daemon = self.server.daemon
+        with daemon.lock:
+            daemon.connections += 1
+
+    def reply(self, status, body=None):
+        data = b''
+        if body is not None:
+            data = json.dumps(body).encode()
+        self.send_response(status)
+        self.send_header('Content-Type', 'application/json')
+        self.send_header('Content-Length', str(len(data)))
+        self.end_headers()
+        if data:
+            self.wfile.write(data)
+
+    def body(self):
+        length = int(self.headers.get('Content-Length') or 0)
+        if not length:
+            return {}
+        try:
+            return json.loads(self.rfile.read(length).decode() or '{}')
+        except ValueError:
+            return {}
+
+    def route(self, method):
+        daemon = self.server.daemon
+        url = urlparse(self.path)
+        # strip the api version
+        path = re.sub(r'^/v[0-9.]+', '', url.path)
+        qs = parse_qs(url.query)
+        if path == url.path and path not in ('/version', '/_bench'):
+            with daemon.lock:
+                daemon.unversioned += 1
+
+        if path == '/_bench':
+            if method == 'POST' and 'latency' in qs:
+                daemon.args.latency = float(qs['latency'][0])
+            return self.bench()
+
+        # container ids and names are normalized, the verbs of the collection are not
+        route = method + ' ' + re.sub(r'^/containers/(?!(create|json)$)[^/]+', '/containers/{id}', path)
+        route = re.sub(r'^(\w+ )/images/.+/json$', r'\1/images/{name}/json', route)
+        daemon.count(route)
+
+        if daemon.args.latency or daemon.args.jitter:
+            time.sleep((daemon.args.latency + random.random() * daemon.args.jitter) / 1000.0)
+
+        if path == '/events':
+            return self.events()
+
+        if path == '/version':
+            return self.reply(200, {'Version': 'mockd', 'ApiVersion': daemon.args.api_version, 'MinAPIVersion': '1.12'})
+
+        m = re.match(r'^/images/(.+)/json$', path)
+        if m:
+            if not daemon.image_exists(m.group(1)):
+                return self.reply(404, {'message': 'No such image: %s' % m.group(1)})
+            return self.reply(200, {'Id': 'sha256:%064x' % random.getrandbits(256), 'RepoTags': [m.group(1)]})
+
+        if path == '/images/create':
+            # fromImage carries the tag (or the digest) unless tag is given
+            ref = qs.get('fromImage', [''])[0]
+            tag = qs.get('tag', [''])[0]
+            if tag:
+                ref += ':' + tag
+            time.sleep(daemon.args.pull_time / 1000.0)
+            with daemon.lock:
+                daemon.pulls.append(ref)
+                daemon.images.add(ref)
+            return self.reply(200, {'status': 'Downloaded newer image for %s' % ref})
+
+        if path == '/containers/json':
+            with daemon.lock:
+                containers = [c.summary() for c in daemon.containers.values()]
+            return self.reply(200, containers)
+
+        if path == '/containers/create':
+            name = qs.get('name', [''])[0]
+            body = self.body()
+            if not daemon.image_exists(body.get('Image') or ''):
+                return self.reply(404, {'message': 'No such image: %s' % body.get('Image')})
+            if name and daemon.find(name):
+                return self.reply(409, {'message': 'Conflict'})
+            # simulate a stale container with the same name
+            if name and random.random() < daemon.args.conflict_rate:
+                stale = Container(name, body)
+                with daemon.lock:
+                    daemon.containers[stale.id] = stale
+                return self.reply(409, {'message': 'Conflict'})
+            c = Container(name or 'mock%d' % random.getrandbits(32), body)
+            c.host_config = body.get('HostConfig') or {}
+            c.pending = True
+            with daemon.lock:
+                daemon.containers[c.id] = c
+                daemon.pending += 1
+                daemon.max_pending = max(daemon.max_pending, daemon.pending)
+            daemon.publish('create', c)
+            return self.reply(201, {'Id': c.id, 'Warnings': None})
+
+        m = re.match(r'^/containers/([^/]+)(/.*)?$', path)
+        if not m:
+            return self.reply(404, {'message': 'page not found'})
+        c = daemon.find(m.group(1))
+        action = m.group(2) or ''
+        if not c:
+            return self.reply(404, {'message': 'No such container'})
+
+        if method == 'GET' and action == '/json':
+            return self.reply(200, c.inspect())
+
+        if method == 'DELETE' and action == '':
+            if c.running and qs.get('force', ['0'])[0] not in ('1', 'true'):
+                return self.reply(409, {'message': 'You cannot remove a running container'})
+            daemon.stop(c)
+            with daemon.lock:
+                daemon.containers.pop(c.id, None)
+            daemon.publish('destroy', c)
+            return self.reply(204)
+
+        if action == '/start':
+            body = self.body()
+            if body:
+                with daemon.lock:
+                    daemon.start_bodies += 1
+                if int(daemon.args.api_version.split('.')[1]) >= 24:
+                    return self.reply(400, {'message': 'starting container with non-empty request body was deprecated since API v1.22 and removed in v1.24'})
+            if c.running:
+                return self.reply(304)
+            c.running = True
+            c.exit_code = 0
+            c.stopped.clear()
+            c.started_at = time.time()
+            with daemon.lock:
+                if c.pending:
+                    c.pending = False
+                    daemon.pending -= 1
+            if body:
+                c.host_config = body
+            binds = (c.host_config or {}).get('Binds') or []
+            daemon.publish('start', c)
+            threading.Thread(target=daemon.handoff, args=(c, binds)).start()
+            return self.reply(204)
+
+        if action == '/stop':
+            # like the daemons before 1.13
+            if c.paused:
+                return self.reply(409, {'message': 'Container %s is paused. Unpause the container before stopping' % c.id})
+            if not daemon.stop(c):
+                return self.reply(304)
+            return self.reply(204)
+
+        if action == '/rename':
+            name = qs.get('name', [''])[0]
+            if not name or daemon.find(name):
+                return self.reply(409, {'message': 'Conflict'})
+            c.name = name
+            return self.reply(204)
+
+        if action == '/pause':
+            if not c.running or c.paused:
+                return self.reply(409, {'message': 'Container %s is not running or already paused' % c.id})
+            c.paused = True
+            c.unpaused.clear()
+            daemon.publish('pause', c)
+            return self.reply(204)
+
+        if action == '/unpause':
+            if not c.paused:
+                return self.reply(409, {'message': 'Container %s is not paused' % c.id})
+            c.paused = False
+            c.unpaused.set()
+            daemon.publish('unpause', c)
+            return self.reply(204)
+
+        if action == '/attach':
+            return self.attach(c)
+
+        if method == 'GET' and action == '/stats':
+            return self.stats(c)
+
+        return self.reply(404, {'message': 'page not found'})
+
+    def attach(self, c):
+        self.close_connection = True
+        self.wfile.write(b'HTTP/1.1 200 OK\r\nContent-Type: application/vnd.docker.raw-stream\r\n\r\n')
+        line = ('[mockd] container %s started\n' % c.name).encode()
+        tty = c.config.get('Tty', True)
+        if not tty:
+            # stdout frame
+            line = b'\x01\x00\x00\x00' + len(line).to_bytes(4, 'big') + line
+        self.wfile.write(line)
+        self.wfile.flush()
+        c.stopped.wait()
+
+    def stats(self, c):
+        """ a stats object every second (HTTP/1.0, no chunks) until the container stops (or is removed) """
+        self.close_connection = True
+        self.wfile.write(b'HTTP/1.0 200 OK\r\nContent-Type: application/json\r\n\r\n')
+        cpu = 0
+        try:
+            while not c.stopped.is_set() and self.server.daemon.find(c.id):
+                cpu += random.randint(0, 10 ** 9) if c.running else 0
+                sample = {'read': time.strftime('%Y-%m-%dT%H:%M:%SZ', time.gmtime()),
+                          'cpu_stats': {'cpu_usage': {'total_usage': cpu},
+                                        'throttling_data': {'periods': 0, 'throttled_periods': 0, 'throttled_time': 0}},
+                          'memory_stats': {'usage': random.randint(1, 64) * 1048576, 'limit': 256 * 1048576},
+                          'networks': {'eth0': {'rx_bytes': 0, 'tx_bytes': 0}},
+                          'blkio_stats': {'io_service_bytes_recursive': []}}
+                self.wfile.write((json.dumps(sample) + '\n').encode())
+                self.wfile.flush()
+                c.stopped.wait(1)
+        except socket.error:
+            pass
+
+    def events(self):
+        daemon = self.server.daemon
+        self.close_connection = True
+        self.wfile.write(b'HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n\r\n')
+        self.wfile.flush()
+        with daemon.lock:
+            daemon.subscribers.append(self.connection)
+        # wait for the client to go away
+        try:
+            while self.connection.recv(4096):
+                pass
+        except socket.error:
+            pass
+        with daemon.lock:
+            daemon.subscribers.remove(self.connection)
+
+    def bench(self):
+        daemon = self.server.daemon
+        with daemon.lock:
+            containers = dict((c.name, {'created': c.created_at, 'started': c.started_at, 'handoff': c.handoff_at,
+                                        'running': c.running, 'paused': c.paused, 'sockets': c.sockets, 'exit_code': c.exit_code})
+                              for c in daemon.containers.values())
+            requests = dict(daemon.requests)
+            report = {'requests': requests, 'containers': containers, 'max_pending': daemon.max_pending,
+                      'connections': daemon.connections, 'max_inflight': daemon.max_inflight,
+                      'unversioned': daemon.unversioned, 'start_bodies': daemon.start_bodies, 'pulls': list(daemon.pulls)}
+        return self.reply(200, report)
+
+    def tracked(self, method):
+        """ the streams (events, attach, stats) are not requests in flight """
+        if re.search(r'/(events|attach|stats|_bench)(\?|$)', self.path):
+            return self.route(method)
+        daemon = self.server.daemon
+        daemon.track(self.pid, 1)
+        try:
+            self.route(method)
+        finally:
+            daemon.track(self.pid, -1)
+
+    def do_GET(self):
+        self.tracked('GET')
+
+    def do_POST(self):
+        self.tracked('POST')
+
+    def do_DELETE(self):
+        self.tracked('DELETE')
+
+
+class Server(ThreadingMixIn, UnixStreamServer):
+    daemon_threads = True
+
+
+def main():
+    parser = argparse.ArgumentParser(description='stub Docker daemon for the uwsgi-docker benchmarks')
+    parser.add_argument('--socket', required=True, help='UNIX socket to bind')
+    parser.add_argument('--latency', type=float, default=0, help='latency added to each request (ms)')
+    parser.add_argument('--jitter', type=float, default=0, help='random latency added to each request (ms)')
+    parser.add_argument('--conflict-rate', type=float, default=0, help='probability of a 409 on create')
+    parser.add_argument('--boot-time', type=float, default=0, help='time before a container connects to the emperor proxy (ms)')
+    parser.add_argument('--api-version', default='1.41', help='api version reported by /version')
+    parser.add_argument('--pull-time', type=float, default=500, help='time taken by an image pull (ms)')
+    args = parser.parse_args()
+
+    if os.path.exists(args.socket):
+        os.unlink(args.socket)
+    server = Server(args.socket, Handler)
+    server.daemon = Daemon(args)
+    print('[mockd] listening on %s' % args.socket)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        os.unlink(args.socket)
+
+
+if __name__ == '__main__':
+    main()
@@ -51,6 +51,20 @@ class TestDockerPlugin(unittest.TestCase):
                                     timeout=10)
         self.addTypeEqualityFunc(dict, 'assertDictionariesSubset')
 
+    def test_lazy_container(self):
+        def lazy_running():
+            containers = self.client.containers(quiet=False, all=False)
+            return [c for c in containers if c[u'Names'][0] == u'/vassal_lazy.ini']
+
+        # no container before the first connection
+        self.assertFalse(lazy_running())
+
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.connect('/tmp/vassal_lazy_docker.socket')
+        sleep(5)
+        self.assertTrue(lazy_running())
+        sock.close()
+
     def test_running_containers(self):
         containers = self.client.containers(quiet=False, all=False, trunc=True, latest=False, since=None,
                                             before=None, limit=-1)
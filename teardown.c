@@ -0,0 +1,76 @@
+#include "docker.h"
+
+extern struct uwsgi_server uwsgi;
+extern struct uwsgi_docker udocker;
+
+/*
+
+	Batched teardown: force-remove a list of containers (DELETE /containers/<id>?force=1&v=1)
+	with up to --docker-teardown-concurrency requests in flight (see the requests engine in api.c).
+
+	Every completed removal queues the next one.
+
+*/
+
+struct docker_teardown {
+	char **ids;
+	int count;
+	int next;
+	int removed;
+};
+
+struct docker_removal {
+	struct docker_teardown *dt;
+	char *id;
+};
+
+static void docker_removal_start(struct docker_teardown *dt);
+
+static void docker_removal_done(void *data, long http_status, json_t *response) {
+	struct docker_removal *dr = (struct docker_removal *) data;
+	if (http_status == 204 || http_status == 404) {
+		dr->dt->removed++;
+		if (udocker.debug) uwsgi_log("[docker-debug] container %s removed\n", dr->id);
+	}
+	else {
+		uwsgi_log("[docker] unable to remove container %s\n", dr->id);
+	}
+	struct docker_teardown *dt = dr->dt;
+	free(dr);
+	docker_removal_start(dt);
+}
+
+// queue the next removal
+static void docker_removal_start(struct docker_teardown *dt) {
+	while(dt->next < dt->count) {
+		struct docker_removal *dr = uwsgi_malloc(sizeof(struct docker_removal));
+		dr->dt = dt;
+		dr->id = dt->ids[dt->next++];
+		char *url = uwsgi_concat3("/containers/", dr->id, "?force=1&v=1");
+		int ret = docker_request("DELETE", url, NULL, uwsgi.socket_timeout, docker_removal_done, dr);
+		free(url);
+		if (!ret) return;
+		uwsgi_log("[docker] unable to remove container %s\n", dr->id);
+		free(dr);
+	}
+}
+
+// returns the number of removed containers
+int docker_teardown(char **ids, int count) {
+	if (count <= 0) return 0;
+	int concurrency = udocker.teardown_concurrency > 0 ? udocker.teardown_concurrency : 16;
+	if (concurrency > count) concurrency = count;
+	struct docker_teardown dt;
+	dt.ids = ids;
+	dt.count = count;
+	dt.next = 0;
+	dt.removed = 0;
+	uint64_t start = uwsgi_micros();
+
+	int i;
+	for(i=0;i<concurrency;i++) docker_removal_start(&dt);
+	docker_requests_run();
+
+	uwsgi_log("[docker] removed %d/%d containers in %llums\n", dt.removed, count, (unsigned long long) ((uwsgi_micros() - start) / 1000));
+	return dt.removed;
+}
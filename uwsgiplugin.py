@@ -1,3 +1,3 @@
 NAME='docker'
 LIBS=['-lcurl', '-ljansson']
-GCC_LIST=['docker']
+GCC_LIST=['docker', 'api', 'monitor', 'stats', 'logs', 'scheduler', 'pool', 'teardown', 'metrics', 'placement', 'image', 'crash']